@@ -0,0 +1,55 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Helpers shared by the loopback benchmarks
+#include "../socket_client/chat_client.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+    #define CHDIR(dir) _chdir(dir)
+#else
+    #define CHDIR(dir) chdir(dir)
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+inline double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Poll until the flag is set or the timeout expires
+inline bool waitFor(const std::atomic<bool>& flag, int timeoutSec) {
+    Clock::time_point start = Clock::now();
+    while (!flag && secondsSince(start) < timeoutSec) {
+        SLEEP_MS(1);
+    }
+    return flag;
+}
+
+// Run in bench_data/ under the current directory (the repo root for make run-bench,
+// ignored by git), so the broker's data/ and the clients' downloads/ are not
+// mixed with those of a server or client run from the same place
+inline void enterBenchDir() {
+    MKDIR("bench_data");
+    CHDIR("bench_data");
+}
+
+// Write 'sizeMB' MB of pseudo-random bytes; different seeds give contents the
+// file store cannot deduplicate
+inline void writeSourceFile(const char* path, int sizeMB, uint32_t seed) {
+    std::ofstream src(path, std::ios::binary | std::ios::trunc);
+    std::vector<char> block(1024 * 1024);
+    uint32_t x = seed;
+    for (int i = 0; i < sizeMB; i++) {
+        for (size_t j = 0; j < block.size(); j++) {
+            x = x * 1103515245 + 12345;
+            block[j] = (char)(x >> 24);
+        }
+        src.write(block.data(), block.size());
+    }
+}
+
+#endif // BENCH_UTIL_H
@@ -0,0 +1,140 @@
+#ifndef LATENCY_PROXY_H
+#define LATENCY_PROXY_H
+
+#include "../utils/network_utils.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Loopback TCP proxy that holds every byte for a fixed one-way delay in each
+// direction, so benchmarks can emulate a long link without root or netem.
+// Bandwidth is not limited, only latency.
+class LatencyProxy {
+private:
+    typedef std::chrono::steady_clock Clock;
+    
+    // One direction of a proxied connection: a reader queues data with its
+    // release time, a writer forwards it once the delay has passed
+    struct Pipe {
+        std::deque<std::pair<Clock::time_point, std::vector<char>>> queue; // Empty block = end of stream
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+    
+    SocketType listenSocket;
+    int targetPort;
+    std::chrono::milliseconds delay;
+    std::atomic<bool> running;
+
+public:
+    LatencyProxy() : listenSocket(SOCKET_INVALID), targetPort(0), delay(0), running(false) {}
+    
+    ~LatencyProxy() {
+        stop();
+    }
+    
+    // Listen on listenPort and forward each connection to targetPort on loopback
+    bool start(int listenPort, int target, int delayMs) {
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listenSocket == SOCKET_INVALID) {
+            return false;
+        }
+        
+        sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(listenPort);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (bind(listenSocket, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            listen(listenSocket, 16) == SOCKET_ERROR) {
+            CLOSE_SOCKET(listenSocket);
+            listenSocket = SOCKET_INVALID;
+            return false;
+        }
+        
+        targetPort = target;
+        delay = std::chrono::milliseconds(delayMs);
+        running = true;
+        std::thread(&LatencyProxy::acceptLoop, this).detach();
+        return true;
+    }
+    
+    void stop() {
+        running = false;
+        if (listenSocket != SOCKET_INVALID) {
+            CLOSE_SOCKET(listenSocket);
+            listenSocket = SOCKET_INVALID;
+        }
+    }
+
+private:
+    void acceptLoop() {
+        while (running) {
+            SocketType client = accept(listenSocket, nullptr, nullptr);
+            if (client == SOCKET_INVALID) {
+                continue;
+            }
+            
+            SocketType server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            sockaddr_in addr;
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(targetPort);
+            inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+            if (server == SOCKET_INVALID || connect(server, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+                if (server != SOCKET_INVALID) CLOSE_SOCKET(server);
+                CLOSE_SOCKET(client);
+                continue;
+            }
+            NetworkUtils::setNoDelay(client);
+            NetworkUtils::setNoDelay(server);
+            
+            // Both sockets are closed once both directions have ended
+            std::shared_ptr<std::atomic<int>> openDirections(new std::atomic<int>(2));
+            forward(client, server, openDirections);
+            forward(server, client, openDirections);
+        }
+    }
+    
+    void forward(SocketType from, SocketType to, std::shared_ptr<std::atomic<int>> openDirections) {
+        std::shared_ptr<Pipe> pipe(new Pipe());
+        std::chrono::milliseconds lag = delay;
+        
+        std::thread([from, pipe, lag]() {
+            std::vector<char> buffer(65536);
+            while (true) {
+                int n = recv(from, buffer.data(), buffer.size(), 0);
+                std::lock_guard<std::mutex> lock(pipe->mtx);
+                pipe->queue.push_back(std::make_pair(Clock::now() + lag,
+                    n > 0 ? std::vector<char>(buffer.begin(), buffer.begin() + n) : std::vector<char>()));
+                pipe->cv.notify_one();
+                if (n <= 0) break;
+            }
+        }).detach();
+        
+        std::thread([from, to, pipe, openDirections]() {
+            while (true) {
+                std::unique_lock<std::mutex> lock(pipe->mtx);
+                pipe->cv.wait(lock, [&]() { return !pipe->queue.empty(); });
+                std::pair<Clock::time_point, std::vector<char>> block = std::move(pipe->queue.front());
+                pipe->queue.pop_front();
+                lock.unlock();
+                
+                std::this_thread::sleep_until(block.first);
+                if (block.second.empty() || !NetworkUtils::sendAll(to, block.second.data(), block.second.size())) {
+                    break;
+                }
+            }
+            shutdown(to, SHUTDOWN_SEND);
+            if (--*openDirections == 0) {
+                CLOSE_SOCKET(from);
+                CLOSE_SOCKET(to);
+            }
+        }).detach();
+    }
+};
+
+#endif // LATENCY_PROXY_H
@@ -0,0 +1,81 @@
+// Parallel upload speedup on an emulated long link
+// Runs a broker in-process behind a LatencyProxy and uploads one file to the
+// group file store, first over a single stream, then over several streams.
+// Usage: bench_parallel [sizeMB] [delayMs] [streams] [port]
+#include "../socket_server/broker.h"
+#include "bench_util.h"
+#include "latency_proxy.h"
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char* argv[]) {
+    int sizeMB = argc > 1 ? atoi(argv[1]) : 64;
+    int delayMs = argc > 2 ? atoi(argv[2]) : 20;
+    int streams = argc > 3 ? atoi(argv[3]) : 4;
+    int port = argc > 4 ? atoi(argv[4]) : 18090;
+    int proxyPort = port + 1;
+    double fileMB = sizeMB;
+    
+    enterBenchDir();
+    
+    // Different contents per run so the store cannot deduplicate the second upload
+    writeSourceFile("parallel_1.bin", sizeMB, 1);
+    writeSourceFile("parallel_n.bin", sizeMB, 2);
+    
+    // Silence broker and client logging; results go to stdout via printf
+    std::cout.rdbuf(nullptr);
+    
+    Broker* broker = new Broker();
+    if (!broker->initialize(port)) {
+        fprintf(stderr, "Failed to start broker on port %d\n", port);
+        return 1;
+    }
+    std::thread(&Broker::run, broker).detach();
+    
+    LatencyProxy proxy;
+    if (!proxy.start(proxyPort, port, delayMs)) {
+        fprintf(stderr, "Failed to start proxy on port %d\n", proxyPort);
+        return 1;
+    }
+    
+    ChatClient sender, receiver;
+    std::atomic<bool> available(false);
+    receiver.setFileAvailableCallback([&](const std::string&, const std::string&, const std::string&,
+                                          const std::string&, uint64_t) { available = true; });
+    
+    if (!sender.connect("127.0.0.1", proxyPort, "benchpx") || !receiver.connect("127.0.0.1", port, "benchpr")) {
+        fprintf(stderr, "Failed to connect clients\n");
+        return 1;
+    }
+    sender.joinGroup("parallel");
+    receiver.joinGroup("parallel");
+    SLEEP_MS(500);
+    
+    printf("File size: %d MB, one-way delay %d ms, credit window %d chunks per stream\n",
+           sizeMB, delayMs, FILE_CREDIT_WINDOW);
+    
+    double single = 0;
+    const char* files[] = {"parallel_1.bin", "parallel_n.bin"};
+    int counts[] = {1, streams};
+    for (int run = 0; run < 2; run++) {
+        sender.setUploadStreams(counts[run]);
+        available = false;
+        
+        Clock::time_point start = Clock::now();
+        sender.sendFileToGroup("parallel", files[run]);
+        if (!waitFor(available, 600)) {
+            fprintf(stderr, "Upload over %d streams timed out\n", counts[run]);
+            return 1;
+        }
+        double seconds = secondsSince(start);
+        if (run == 0) single = seconds;
+        
+        printf("%2d stream(s)  %8.3f s  %9.1f MB/s  speedup %.2fx\n",
+               counts[run], seconds, fileMB / seconds, single / seconds);
+    }
+    
+    sender.disconnect();
+    receiver.disconnect();
+    SLEEP_MS(100);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Loopback file transfer throughput
+// Runs a broker in-process and measures, for one file:
+//   - DM upload relayed to an online recipient
+//   - group upload into the file store
+//   - group download from the file store
+// Usage: bench_throughput [sizeMB] [port]
+#include "../socket_server/broker.h"
+#include "bench_util.h"
+#include <cstdio>
+#include <cstdlib>
+
+static void report(const char* name, double bytes, double seconds) {
+    printf("%-22s %8.3f s  %9.1f MB/s\n", name, seconds, bytes / (1024.0 * 1024.0) / seconds);
+}
+
+int main(int argc, char* argv[]) {
+    int sizeMB = argc > 1 ? atoi(argv[1]) : 256;
+    int port = argc > 2 ? atoi(argv[2]) : 18080;
+    uint64_t fileSize = (uint64_t)sizeMB * 1024 * 1024;
+    
+    enterBenchDir();
+    writeSourceFile("bench_src.bin", sizeMB, 12345);
+    
+    // Silence broker and client logging; results go to stdout via printf
+    std::cout.rdbuf(nullptr);
+    
+    Broker* broker = new Broker();
+    if (!broker->initialize(port)) {
+        fprintf(stderr, "Failed to start broker on port %d\n", port);
+        return 1;
+    }
+    std::thread(&Broker::run, broker).detach();
+    
+    ChatClient sender, receiver;
+    sender.setUploadStreams(1);     // One connection; parallel_bench measures more
+    std::atomic<bool> received(false), available(false);
+    std::string fileHash;
+    
+    receiver.setFileCallback([&](const std::string&, const std::string&, uint64_t) { received = true; });
+    receiver.setFileAvailableCallback([&](const std::string&, const std::string&, const std::string&,
+                                          const std::string& hash, uint64_t) {
+        fileHash = hash;
+        available = true;
+    });
+    
+    if (!sender.connect("127.0.0.1", port, "benchtx") || !receiver.connect("127.0.0.1", port, "benchrx")) {
+        fprintf(stderr, "Failed to connect clients\n");
+        return 1;
+    }
+    sender.joinGroup("bench");
+    receiver.joinGroup("bench");
+    SLEEP_MS(200);
+    
+    printf("File size: %d MB, chunk %d bytes, credit window %d chunks\n",
+           sizeMB, FILE_CHUNK_SIZE, FILE_CREDIT_WINDOW);
+    
+    Clock::time_point start = Clock::now();
+    sender.sendFileToUser("benchrx", "bench_src.bin");
+    if (!waitFor(received, 120)) {
+        fprintf(stderr, "DM relay timed out\n");
+        return 1;
+    }
+    report("DM relay", fileSize, secondsSince(start));
+    
+    start = Clock::now();
+    sender.sendFileToGroup("bench", "bench_src.bin");
+    if (!waitFor(available, 120)) {
+        fprintf(stderr, "Group upload timed out\n");
+        return 1;
+    }
+    report("Group upload (store)", fileSize, secondsSince(start));
+    
+    received = false;
+    start = Clock::now();
+    receiver.downloadFile("bench", fileHash, "bench_dl.bin", fileSize);
+    if (!waitFor(received, 120)) {
+        fprintf(stderr, "Download timed out\n");
+        return 1;
+    }
+    report("Store download", fileSize, secondsSince(start));
+    
+    sender.disconnect();
+    receiver.disconnect();
+    SLEEP_MS(100);
+    return 0;
+}
@@ -4,6 +4,8 @@
 #include "../utils/protocol.h"
 #include "../utils/network_utils.h"
 #include "../utils/string_utils.h"
+#include "../utils/sha256.h"
+#include "download_engine.h"
 #include <iostream>
 #include <string>
 #include <sstream>
@@ -14,6 +16,9 @@
 #include <mutex>
 #include <fstream>
 #include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 
 // Cross-platform includes
 #ifdef _WIN32
@@ -21,6 +26,9 @@
     #include <ws2tcpip.h>
     #include <windows.h>
     #include <direct.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
     #define MKDIR(dir) _mkdir(dir)
     #define SLEEP_MS(ms) Sleep(ms)
 #else
@@ -28,51 +36,106 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <fcntl.h>
     #include <sys/stat.h>
     #define MKDIR(dir) mkdir(dir, 0755)
     #define SLEEP_MS(ms) usleep((ms) * 1000)
 #endif
 
+#define UPLOAD_MIN_STRIPE_SIZE (4 * 1024 * 1024) // Smallest range worth a connection of its own
+#define UPLOAD_DEFAULT_STREAMS 4                  // Connections a large upload may use unless set
+
+// One row of a paged history batch
+struct HistoryEntry {
+    uint32_t id;
+    std::string sender;
+    std::string content;   // Filename for file messages
+    time_t timestamp;
+    bool isFile;
+    std::string fileHash;  // Set when the file is in the server store
+    uint64_t fileSize;
+};
+
 class ChatClient {
 public:
     using MessageCallback = std::function<void(const std::string&, const std::string&, const std::string&)>;
-    using FileCallback = std::function<void(const std::string&, const std::string&, uint32_t)>;
+    using FileCallback = std::function<void(const std::string&, const std::string&, uint64_t)>;
     using UserStatusCallback = std::function<void(const std::string&, bool)>;  // username, isOnline
     using UserListCallback = std::function<void(const std::vector<std::string>&)>;
     using HistoryCallback = std::function<void(const std::string&, const std::string&, const std::string&, time_t)>;
+    using HistoryBatchCallback = std::function<void(const std::string&, const std::vector<HistoryEntry>&, bool)>;  // topic, rows (oldest first), hasMore
     using GroupCallback = std::function<void(const std::string&, const std::string&)>;  // groupName, creator
     using GroupListCallback = std::function<void(const std::vector<std::pair<std::string, bool>>&)>;  // groupName, isMember
     using GameCallback = std::function<void(const std::string&, const std::string&)>;  // from, payload
+    using FileAvailableCallback = std::function<void(const std::string&, const std::string&, const std::string&,
+                                                     const std::string&, uint64_t)>;  // sender, topic, filename, hash, size
 
 private:
     SocketType clientSocket;
+    std::string serverHost;
+    int serverPort;
+    int uploadStreams;  // Parallel connections for large uploads, 1 = main connection only
     std::string username;
     std::string currentTopic;
     bool connected;
     std::mutex mtx;
     std::vector<std::string> onlineUsers;
+    std::map<std::string, uint32_t> topicSequences; // topic -> last sequence received
+    std::mutex seqMtx;
     
     MessageCallback onMessageReceived;
     FileCallback onFileReceived;
     UserStatusCallback onUserStatusChanged;
     UserListCallback onUserListReceived;
     HistoryCallback onHistoryReceived;
+    HistoryBatchCallback onHistoryBatchReceived;
     GroupCallback onGroupCreated;
     GroupListCallback onGroupListReceived;
     GameCallback onGameReceived;
+    FileAvailableCallback onFileAvailable;
     
     struct FileReceiver {
         std::string filename;
-        uint32_t fileSize;
-        uint32_t receivedSize;
-        std::ofstream file;
+        uint64_t fileSize;
+        uint64_t receivedSize;
+        uint32_t handle;            // DownloadEngine file the chunks are written through
+        bool complete;              // Every chunk received, waiting for the final sync
         std::string sender;
+        std::string topic;
+        std::string hash;           // Set for downloads from the server store (resumable)
+        std::vector<bool> chunks;   // Received FILE_DOWNLOAD_CHUNK_SIZE chunks of a store download
+        uint32_t unacked;           // Relayed chunks written but not yet credited back
+        
+        FileReceiver() : fileSize(0), receivedSize(0), handle(0), complete(false), unacked(0) {}
+    };
+    
+    struct PendingUpload {
+        std::string topic;
+        std::string filepath;
+        std::string hash;           // Content hash of a group upload, computed once
     };
     
     std::map<uint32_t, FileReceiver> activeDownloads;
+    std::mutex downloadMtx;
+    std::map<uint32_t, PendingUpload> pendingUploads;   // transferId -> unfinished upload
+    std::map<uint32_t, TransferStatus> transferStatuses; // Replies to upload handshakes
+    std::map<uint32_t, std::vector<StripeStatus>> transferStripes; // What the server has of each stripe
+    std::map<uint32_t, uint32_t> uploadCredits;         // transferId -> chunks we may still send
+    std::mutex transferMtx;
+    std::condition_variable transferCv;
+    
+    // Declared last: destroyed first, so its IO thread is drained while the rest is alive
+    DownloadEngine downloadEngine;
 
 public:
-    ChatClient() : clientSocket(SOCKET_INVALID), connected(false) {}
+    ChatClient() : clientSocket(SOCKET_INVALID), serverPort(0), uploadStreams(UPLOAD_DEFAULT_STREAMS), connected(false) {
+        downloadEngine.setWrittenCallback([this](uint32_t id, uint32_t handle) {
+            handleChunkWritten(id, handle);
+        });
+        downloadEngine.setFinishedCallback([this](uint32_t id, uint32_t handle, bool ok) {
+            handleDownloadFinished(id, handle, ok);
+        });
+    }
     
     ~ChatClient() {
         disconnect();
@@ -86,6 +149,15 @@ public:
         onFileReceived = callback;
     }
     
+    // Split large uploads over up to 'streams' parallel connections
+    void setUploadStreams(int streams) {
+        uploadStreams = std::max(1, std::min(streams, FILE_MAX_STREAMS));
+    }
+    
+    void setFileAvailableCallback(FileAvailableCallback callback) {
+        onFileAvailable = callback;
+    }
+    
     void setUserStatusCallback(UserStatusCallback callback) {
         onUserStatusChanged = callback;
     }
@@ -98,6 +170,10 @@ public:
         onHistoryReceived = callback;
     }
     
+    void setHistoryBatchCallback(HistoryBatchCallback callback) {
+        onHistoryBatchReceived = callback;
+    }
+    
     void setGroupCallback(GroupCallback callback) {
         onGroupCreated = callback;
     }
@@ -114,6 +190,13 @@ public:
         return onlineUsers;
     }
     
+    // Get last sequence number received in a topic (0 if none)
+    uint32_t getLastSequence(const std::string& topic) {
+        std::lock_guard<std::mutex> lock(seqMtx);
+        auto it = topicSequences.find(topic);
+        return it != topicSequences.end() ? it->second : 0;
+    }
+    
     bool connect(const std::string& serverIp, int port, const std::string& user) {
         if (!NetworkUtils::initWinsock()) {
             std::cerr << "WSAStartup failed" << std::endl;
@@ -139,6 +222,9 @@ public:
             return false;
         }
         
+        NetworkUtils::setNoDelay(clientSocket);
+        serverHost = serverIp;
+        serverPort = port;
         username = user;
         connected = true;
         
@@ -150,6 +236,10 @@ public:
         std::thread(&ChatClient::receiveLoop, this).detach();
         
         std::cout << "[CLIENT] Connected as '" << username << "'" << std::endl;
+        
+        if (hasPendingTransfers()) {
+            std::thread(&ChatClient::resumeTransfers, this).detach();
+        }
         return true;
     }
     
@@ -189,6 +279,26 @@ public:
         return sendPacket(&header, nullptr, 0);
     }
     
+    // Request a page of history; beforeId = 0 asks for the latest page,
+    // otherwise the page of messages older than beforeId (scroll-back)
+    bool requestHistoryPage(const std::string& topic, uint32_t beforeId, uint32_t limit) {
+        HistoryQuery query = {0};
+        query.beforeId = beforeId;
+        query.limit = limit;
+        return requestHistoryPage(topic, query);
+    }
+    
+    // Request a page of history with an explicit id/time window
+    bool requestHistoryPage(const std::string& topic, const HistoryQuery& query) {
+        PacketHeader header = {0};
+        header.msgType = MSG_REQUEST_HISTORY_PAGE;
+        header.payloadLength = sizeof(HistoryQuery);
+        strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+        strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        
+        return sendPacket(&header, (const char*)&query, sizeof(HistoryQuery));
+    }
+    
     bool joinGroup(const std::string& groupName) {
         return subscribe(groupName);
     }
@@ -215,6 +325,97 @@ public:
         return sendFile(groupName, filepath);
     }
     
+    // Pull a stored group file into downloads/; completion is reported through the file callback
+    bool downloadFile(const std::string& topic, const std::string& hash,
+                      const std::string& filename, uint64_t fileSize) {
+        if (hash.length() != FILE_HASH_LEN) return false;
+        
+        PacketHeader header = {0};
+        header.msgType = LTM_DOWNLOAD;
+        header.messageId = rand();
+        strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+        strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        
+        FileReceiver fr;
+        fr.filename = filename;
+        fr.fileSize = fileSize;
+        fr.sender = topic;
+        fr.topic = topic;
+        fr.hash = hash;
+        fr.chunks.assign((fileSize + FILE_DOWNLOAD_CHUNK_SIZE - 1) / FILE_DOWNLOAD_CHUNK_SIZE, false);
+        if (!beginDownload(header.messageId, fr)) return false;
+        if (fileSize == 0) return true;
+        
+        FileDownloadRequest request;
+        memcpy(request.hash, hash.data(), FILE_HASH_LEN);
+        request.offset = 0;
+        request.length = 0;
+        header.payloadLength = sizeof(request);
+        
+        std::cout << "[FILE] Downloading '" << filename << "' (" << fileSize << " bytes)" << std::endl;
+        return sendPacket(&header, (const char*)&request, sizeof(request));
+    }
+    
+    // Check for uploads or downloads interrupted by a disconnect
+    bool hasPendingTransfers() {
+        {
+            std::lock_guard<std::mutex> lock(transferMtx);
+            if (!pendingUploads.empty()) return true;
+        }
+        std::lock_guard<std::mutex> lock(downloadMtx);
+        for (const auto& d : activeDownloads) {
+            if (!d.second.hash.empty() && !d.second.complete) return true;
+        }
+        return false;
+    }
+    
+    // Continue interrupted transfers after reconnecting: uploads resend only the
+    // chunks the server is missing, downloads request only their missing ranges
+    void resumeTransfers() {
+        std::vector<std::pair<uint32_t, PendingUpload>> uploads;
+        {
+            std::lock_guard<std::mutex> lock(transferMtx);
+            uploads.assign(pendingUploads.begin(), pendingUploads.end());
+        }
+        for (const auto& u : uploads) {
+            uploadFile(u.first, u.second.topic, u.second.filepath);
+        }
+        
+        std::vector<std::pair<PacketHeader, FileDownloadRequest>> requests;
+        {
+            std::lock_guard<std::mutex> lock(downloadMtx);
+            for (const auto& d : activeDownloads) {
+                const FileReceiver& fr = d.second;
+                if (fr.hash.empty() || fr.complete) continue;
+                
+                // One ranged request per run of missing chunks
+                size_t i = 0;
+                while (i < fr.chunks.size()) {
+                    if (fr.chunks[i]) { i++; continue; }
+                    size_t first = i;
+                    while (i < fr.chunks.size() && !fr.chunks[i]) i++;
+                    
+                    PacketHeader header = {0};
+                    header.msgType = LTM_DOWNLOAD;
+                    header.messageId = d.first;
+                    header.payloadLength = sizeof(FileDownloadRequest);
+                    strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+                    strncpy(header.topic, fr.topic.c_str(), MAX_TOPIC_LEN - 1);
+                    
+                    FileDownloadRequest request;
+                    memcpy(request.hash, fr.hash.data(), FILE_HASH_LEN);
+                    request.offset = (uint64_t)first * FILE_DOWNLOAD_CHUNK_SIZE;
+                    request.length = (uint64_t)(i - first) * FILE_DOWNLOAD_CHUNK_SIZE;
+                    requests.push_back(std::make_pair(header, request));
+                }
+            }
+        }
+        for (auto& r : requests) {
+            std::cout << "[FILE] Resuming download at offset " << r.second.offset << std::endl;
+            sendPacket(&r.first, (const char*)&r.second, sizeof(r.second));
+        }
+    }
+    
     bool sendGameMessage(const std::string& recipient, const std::string& payload) {
         PacketHeader header = {0};
         header.msgType = MSG_GAME;
@@ -234,6 +435,13 @@ public:
         strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
         strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
         
+        // Ask the server to replay what we missed since the last sequence seen
+        uint32_t resumeFrom = getLastSequence(topic);
+        if (resumeFrom > 0) {
+            header.payloadLength = sizeof(resumeFrom);
+            return sendPacket(&header, (const char*)&resumeFrom, sizeof(resumeFrom));
+        }
+        
         return sendPacket(&header, nullptr, 0);
     }
     
@@ -279,80 +487,264 @@ private:
     }
     
     bool sendFile(const std::string& topic, const std::string& filepath) {
-        std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-        if (!file.is_open()) {
+        uint32_t transferId = makeTransferId(topic, filepath);
+        {
+            std::lock_guard<std::mutex> lock(transferMtx);
+            pendingUploads[transferId] = PendingUpload{topic, filepath, ""};
+        }
+        return uploadFile(transferId, topic, filepath);
+    }
+    
+    // Announce the file, then send only the chunks the server reports missing
+    // The upload stays pending (resumable) until every chunk is sent
+    bool uploadFile(uint32_t transferId, const std::string& topic, const std::string& filepath) {
+        uint64_t fileSize = 0;
+        int fd = openSourceFile(filepath, fileSize);
+        if (fd < 0) {
             std::cerr << "Failed to open file: " << filepath << std::endl;
+            finishUpload(transferId);
             return false;
         }
         
-        uint32_t fileSize = file.tellg();
-        file.seekg(0);
-        
         size_t pos = filepath.find_last_of("\\/");
         std::string filename = (pos != std::string::npos) ? filepath.substr(pos + 1) : filepath;
         
+        // Group uploads name their content so the store can skip files it already holds
+        std::string hash;
+        if (!StringUtils::isDMTopic(topic)) {
+            hash = contentHash(transferId, filepath);
+        }
+        
+        bool sent = streamUpload(transferId, topic, filepath, filename, fd, fileSize, hash);
+        closeSourceFile(fd);
+        return sent;
+    }
+    
+    // Chunk payloads go from the file descriptor straight to the socket
+    // (sendfile on Linux), so the file is never copied through user space.
+    // Large files are split into stripes: stripe 0 goes over the main connection,
+    // every other stripe over a connection (and credit window) of its own.
+    bool streamUpload(uint32_t transferId, const std::string& topic, const std::string& filepath,
+                      const std::string& filename, int fd, uint64_t fileSize, const std::string& hash) {
         PacketHeader header = {0};
         header.msgType = MSG_PUBLISH_FILE;
-        header.messageId = rand();
+        header.messageId = transferId;
         header.timestamp = time(nullptr);
         strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
         strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
         
-        std::vector<char> metadata;
-        uint32_t filenameLen = filename.length();
-        metadata.insert(metadata.end(), (char*)&filenameLen, (char*)&filenameLen + 4);
-        metadata.insert(metadata.end(), filename.begin(), filename.end());
-        metadata.insert(metadata.end(), (char*)&fileSize, (char*)&fileSize + 4);
+        std::vector<char> metadata = NetworkUtils::buildFileMetadata(filename, fileSize, streamsFor(fileSize), hash);
         
         header.payloadLength = metadata.size();
         
+        {
+            std::lock_guard<std::mutex> lock(transferMtx);
+            transferStatuses.erase(transferId);
+        }
         if (!sendPacket(&header, metadata.data(), metadata.size())) {
-            file.close();
             return false;
         }
         
-        std::vector<char> buffer(FILE_CHUNK_SIZE);
-        uint32_t totalSent = 0;
+        TransferStatus status;
+        std::vector<StripeStatus> stripes;
+        if (!waitTransferStatus(transferId, status, stripes)) {
+            std::cerr << "[FILE] No reply to upload of " << filename << std::endl;
+            return false;
+        }
+        if (!status.accepted || status.fileSize != fileSize) {
+            finishUpload(transferId);
+            return false;
+        }
+        if (status.accepted == TRANSFER_STORED) {
+            finishUpload(transferId);
+            std::cout << "[FILE] Server already has " << filename << ", nothing to upload" << std::endl;
+            return true;
+        }
         
-        while (totalSent < fileSize) {
-            uint32_t chunkSize = std::min((uint32_t)FILE_CHUNK_SIZE, fileSize - totalSent);
-            file.read(buffer.data(), chunkSize);
+        // A resumed upload keeps the stripe layout the server already has
+        uint32_t stripeCount = stripes.size();
+        uint64_t resumed = 0;
+        for (uint32_t i = 0; i < stripeCount; i++) {
+            uint64_t begin, end;
+            stripeRange(fileSize, stripeCount, i, begin, end);
+            resumed += stripes[i].contiguousOffset - begin;
+        }
+        if (resumed > 0) {
+            std::cout << "[FILE] Resuming " << filename << " with " << resumed << " bytes on the server" << std::endl;
+        }
+        {
+            std::lock_guard<std::mutex> lock(transferMtx);
+            uploadCredits[transferId] = status.credits;
+        }
+        
+        std::atomic<bool> failed(false);
+        std::vector<std::thread> workers;
+        for (uint32_t i = 1; i < stripeCount; i++) {
+            workers.push_back(std::thread([&, i]() {
+                if (!sendStripeOverStream(transferId, topic, filepath, fileSize, stripeCount, i, stripes[i])) {
+                    failed = true;
+                }
+            }));
+        }
+        bool sent = sendStripe(clientSocket, transferId, topic, fd, fileSize, stripeCount, 0, stripes[0]);
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        if (!sent || failed) {
+            return false;
+        }
+        
+        finishUpload(transferId);
+        std::cout << "[FILE] Transfer complete: " << filename << std::endl;
+        return true;
+    }
+    
+    // Send the chunks of one stripe the server does not have yet
+    bool sendStripe(SocketType sock, uint32_t transferId, const std::string& topic, int fd,
+                    uint64_t fileSize, uint32_t stripeCount, uint32_t index, const StripeStatus& arrived) {
+        uint64_t begin, end;
+        stripeRange(fileSize, stripeCount, index, begin, end);
+        
+        for (uint64_t offset = begin; offset < end; offset += FILE_CHUNK_SIZE) {
+            if (chunkArrived(arrived, offset)) continue;
             
+            uint32_t chunkSize = (uint32_t)std::min((uint64_t)FILE_CHUNK_SIZE, end - offset);
             PacketHeader chunkHeader = {0};
             chunkHeader.msgType = MSG_FILE_DATA;
-            chunkHeader.messageId = header.messageId;
+            chunkHeader.messageId = transferId;
+            chunkHeader.offset = offset;
             chunkHeader.payloadLength = chunkSize;
             strncpy(chunkHeader.sender, username.c_str(), MAX_USERNAME_LEN - 1);
             strncpy(chunkHeader.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
             
-            if (!sendPacket(&chunkHeader, buffer.data(), chunkSize)) {
-                file.close();
+            // Wait for the broker to grant credit instead of pacing blindly
+            if (!takeCredit(transferId)) {
+                return false;
+            }
+            bool sent = (sock == clientSocket) ? sendFileChunk(&chunkHeader, fd, offset, chunkSize)
+                                               : NetworkUtils::sendFileChunk(sock, &chunkHeader, fd, offset, chunkSize);
+            if (!sent) {
                 return false;
             }
-            
-            totalSent += chunkSize;
-            
-            // Small delay to prevent network flooding
-            SLEEP_MS(1);
         }
-        
-        file.close();
-        std::cout << "[FILE] Transfer complete: " << filename << std::endl;
         return true;
     }
     
+    // Send one stripe over an extra connection, reading through a descriptor of its own
+    bool sendStripeOverStream(uint32_t transferId, const std::string& topic, const std::string& filepath,
+                              uint64_t fileSize, uint32_t stripeCount, uint32_t index, const StripeStatus& arrived) {
+        uint64_t size = 0;
+        int fd = openSourceFile(filepath, size);
+        if (fd < 0) {
+            return false;
+        }
+        
+        // If the server refuses the extra connection the stripe still goes over the main one
+        SocketType sock = openUploadStream(transferId, topic);
+        bool sent = sendStripe(sock != SOCKET_INVALID ? sock : clientSocket, transferId, topic, fd,
+                               fileSize, stripeCount, index, arrived);
+        if (sock != SOCKET_INVALID) {
+            closeUploadStream(sock);
+        }
+        closeSourceFile(fd);
+        return sent;
+    }
+    
     bool sendPacket(PacketHeader* header, const char* payload, uint32_t payloadLen) {
         std::lock_guard<std::mutex> lock(mtx);
         return NetworkUtils::sendPacket(clientSocket, header, payload, payloadLen);
     }
     
+    bool sendFileChunk(PacketHeader* header, int fd, uint64_t offset, size_t length) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return NetworkUtils::sendFileChunk(clientSocket, header, fd, offset, length);
+    }
+    
+    // Number of streams to upload a file over; small files are not worth extra connections
+    uint32_t streamsFor(uint64_t fileSize) {
+        uint64_t stripes = fileSize / UPLOAD_MIN_STRIPE_SIZE;
+        return (uint32_t)std::max((uint64_t)1, std::min((uint64_t)uploadStreams, stripes));
+    }
+    
+    // Open an extra connection to carry one stripe of a parallel upload
+    SocketType openUploadStream(uint32_t transferId, const std::string& topic) {
+        SocketType sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock == SOCKET_INVALID) {
+            return SOCKET_INVALID;
+        }
+        
+        sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(serverPort);
+        inet_pton(AF_INET, serverHost.c_str(), &serverAddr.sin_addr);
+        
+        if (::connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            CLOSE_SOCKET(sock);
+            return SOCKET_INVALID;
+        }
+        NetworkUtils::setNoDelay(sock);
+        
+        PacketHeader header = {0};
+        header.msgType = MSG_ATTACH_STREAM;
+        header.messageId = transferId;
+        strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+        strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        
+        PacketHeader reply;
+        std::vector<char> payload;
+        if (!NetworkUtils::sendPacket(sock, &header, nullptr, 0) ||
+            !NetworkUtils::receiveAll(sock, (char*)&reply, sizeof(reply)) ||
+            !NetworkUtils::receivePayload(sock, payload, reply.payloadLength) ||
+            reply.msgType != MSG_ACK) {
+            CLOSE_SOCKET(sock);
+            return SOCKET_INVALID;
+        }
+        return sock;
+    }
+    
+    // Close a stream only after the server has read everything and closed its side,
+    // so chunks still queued are not lost to a connection reset
+    static void closeUploadStream(SocketType sock) {
+        shutdown(sock, SHUTDOWN_SEND);
+        char buffer[MAX_BUFFER_SIZE];
+        while (recv(sock, buffer, sizeof(buffer), 0) > 0) {}
+        CLOSE_SOCKET(sock);
+    }
+    
+    // Open a file for raw reads; returns a file descriptor or -1
+    static int openSourceFile(const std::string& path, uint64_t& size) {
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+        if (fd < 0) return -1;
+        size = _filelengthi64(fd);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return -1;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+#endif
+        return fd;
+    }
+    
+    static void closeSourceFile(int fd) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+    
     void receiveLoop() {
         char buffer[MAX_BUFFER_SIZE];
         
         while (connected) {
-            int received = recv(clientSocket, buffer, sizeof(PacketHeader), 0);
-            if (received <= 0) {
+            if (!NetworkUtils::receiveAll(clientSocket, buffer, sizeof(PacketHeader))) {
                 connected = false;
+                transferCv.notify_all();
                 std::cout << "[CLIENT] Disconnected from server" << std::endl;
                 break;
             }
@@ -384,6 +776,18 @@ private:
             case MSG_FILE_DATA:
                 handleFileData(header, payload);
                 break;
+            
+            case MSG_FILE_AVAILABLE:
+                handleFileAvailable(header, payload);
+                break;
+            
+            case MSG_TRANSFER_STATUS:
+                handleTransferStatus(header, payload);
+                break;
+            
+            case MSG_FILE_CREDIT:
+                handleFileCredit(header, payload);
+                break;
                 
             case MSG_ACK:
                 handleAck(payload);
@@ -401,6 +805,10 @@ private:
                 handleUserOffline(header, payload);
                 break;
                 
+            case MSG_USER_HIDDEN:
+                handleUserHidden(payload);
+                break;
+            
             case MSG_USER_LIST:
                 handleUserList(payload);
                 break;
@@ -409,6 +817,14 @@ private:
                 handleHistoryData(header, payload);
                 break;
                 
+            case MSG_HISTORY_BATCH:
+                handleHistoryBatch(header, payload);
+                break;
+            
+            case MSG_MESSAGE_BATCH:
+                handleMessageBatch(header, payload);
+                break;
+            
             case MSG_GROUP_CREATED:
                 handleGroupCreated(header, payload);
                 break;
@@ -439,6 +855,15 @@ private:
         std::string topic(header->topic);
         std::string message(payload.begin(), payload.end());
         
+        if (header->flags & FLAG_SEQUENCED) {
+            std::lock_guard<std::mutex> lock(seqMtx);
+            uint32_t& lastSeq = topicSequences[topic];
+            if (header->messageId <= lastSeq) {
+                return; // Already seen (overlapping replay)
+            }
+            lastSeq = header->messageId;
+        }
+        
         std::cout << "[" << topic << "] " << sender << ": " << message << std::endl;
         
         if (onMessageReceived) {
@@ -447,53 +872,296 @@ private:
     }
     
     void handleFileMetadata(PacketHeader* header, std::vector<char>& payload) {
-        uint32_t filenameLen = *(uint32_t*)payload.data();
-        std::string filename(payload.data() + 4, filenameLen);
-        uint32_t fileSize = *(uint32_t*)(payload.data() + 4 + filenameLen);
+        std::string filename;
+        uint64_t fileSize = 0;
+        uint32_t streams = 1;
+        std::string hash;
+        if (!NetworkUtils::parseFileMetadata(payload, filename, fileSize, streams, hash)) {
+            std::cerr << "[FILE] Invalid file metadata" << std::endl;
+            return;
+        }
         std::string sender(header->sender);
         
         std::cout << "[FILE] Receiving '" << filename << "' (" << fileSize 
                   << " bytes) from " << sender << std::endl;
         
-        MKDIR("downloads");
-        
         FileReceiver fr;
         fr.filename = filename;
         fr.fileSize = fileSize;
-        fr.receivedSize = 0;
         fr.sender = sender;
+        beginDownload(header->messageId, fr);
+    }
+    
+    // Create the file in downloads/ and start tracking its chunks
+    // A zero-length file is finished right away
+    bool beginDownload(uint32_t id, FileReceiver& fr) {
+        MKDIR("downloads");
 #ifdef _WIN32
-        fr.file.open("downloads\\" + filename, std::ios::binary);
+        std::string path = "downloads\\" + fr.filename;
 #else
-        fr.file.open("downloads/" + filename, std::ios::binary);
+        std::string path = "downloads/" + fr.filename;
 #endif
+        fr.handle = downloadEngine.open(id, path, fr.fileSize);
+        if (fr.handle == 0) {
+            std::cerr << "[FILE] Cannot create " << path << std::endl;
+            return false;
+        }
+        fr.complete = (fr.fileSize == 0);
         
-        activeDownloads[header->messageId] = std::move(fr);
+        uint32_t replaced = 0;
+        {
+            std::lock_guard<std::mutex> lock(downloadMtx);
+            auto it = activeDownloads.find(id);
+            if (it != activeDownloads.end() && !it->second.complete) {
+                replaced = it->second.handle; // Sender started the same transfer over
+            }
+            activeDownloads[id] = fr;
+        }
+        if (replaced) downloadEngine.finish(replaced);
+        if (fr.complete) downloadEngine.finish(fr.handle);
+        return true;
     }
     
-    void handleFileData(PacketHeader* header, std::vector<char>& payload) {
-        uint32_t msgId = header->messageId;
+    void handleTransferStatus(PacketHeader* header, std::vector<char>& payload) {
+        if (payload.size() < sizeof(TransferStatus)) return;
         
-        if (activeDownloads.find(msgId) == activeDownloads.end()) {
-            std::cerr << "[FILE] Unknown file transfer" << std::endl;
-            return;
+        TransferStatus status;
+        memcpy(&status, payload.data(), sizeof(status));
+        
+        // Stripe 0 is described by the status itself, the others follow it
+        std::vector<StripeStatus> stripes(1);
+        stripes[0].contiguousOffset = status.contiguousOffset;
+        stripes[0].reorderMask = status.reorderMask;
+        size_t pos = sizeof(status);
+        while (stripes.size() < status.stripes && pos + sizeof(StripeStatus) <= payload.size()) {
+            StripeStatus stripe;
+            memcpy(&stripe, payload.data() + pos, sizeof(stripe));
+            stripes.push_back(stripe);
+            pos += sizeof(stripe);
+        }
+        if (status.stripes > stripes.size()) {
+            status.accepted = 0; // Truncated status
         }
         
-        FileReceiver& fr = activeDownloads[msgId];
-        fr.file.write(payload.data(), payload.size());
-        fr.receivedSize += payload.size();
+        std::lock_guard<std::mutex> lock(transferMtx);
+        transferStatuses[header->messageId] = status;
+        transferStripes[header->messageId] = stripes;
+        transferCv.notify_all();
+    }
+    
+    bool waitTransferStatus(uint32_t transferId, TransferStatus& status, std::vector<StripeStatus>& stripes) {
+        std::unique_lock<std::mutex> lock(transferMtx);
+        bool replied = transferCv.wait_for(lock, std::chrono::seconds(5), [&]() {
+            return transferStatuses.find(transferId) != transferStatuses.end() || !connected;
+        });
         
-        std::cout << "[FILE] Received " << fr.receivedSize << "/" << fr.fileSize << " bytes" << std::endl;
+        auto it = transferStatuses.find(transferId);
+        if (!replied || it == transferStatuses.end()) return false;
+        status = it->second;
+        stripes = transferStripes[transferId];
+        transferStatuses.erase(it);
+        transferStripes.erase(transferId);
+        return true;
+    }
+    
+    void finishUpload(uint32_t transferId) {
+        std::lock_guard<std::mutex> lock(transferMtx);
+        pendingUploads.erase(transferId);
+        uploadCredits.erase(transferId);
+    }
+    
+    // Block until the upload may send one more chunk
+    bool takeCredit(uint32_t transferId) {
+        std::unique_lock<std::mutex> lock(transferMtx);
+        uint32_t& credits = uploadCredits[transferId];
+        bool granted = transferCv.wait_for(lock, std::chrono::seconds(10), [&]() {
+            return credits > 0 || !connected;
+        });
+        if (!granted || credits == 0) {
+            std::cerr << "[FILE] Upload stalled, no credit from server" << std::endl;
+            return false;
+        }
+        credits--;
+        return true;
+    }
+    
+    void handleFileCredit(PacketHeader* header, std::vector<char>& payload) {
+        if (payload.size() < sizeof(uint32_t)) return;
         
-        if (fr.receivedSize >= fr.fileSize) {
-            fr.file.close();
-            std::cout << "[FILE] Download complete: " << fr.filename << std::endl;
+        std::lock_guard<std::mutex> lock(transferMtx);
+        auto it = uploadCredits.find(header->messageId);
+        if (it != uploadCredits.end()) {
+            it->second += *(uint32_t*)payload.data();
+            transferCv.notify_all();
+        }
+    }
+    
+    // Acknowledge relayed chunks so the broker can grant the uploader more credit
+    void sendFileCredit(uint32_t transferId, uint32_t chunks) {
+        PacketHeader header = {0};
+        header.msgType = MSG_FILE_CREDIT;
+        header.messageId = transferId;
+        header.payloadLength = sizeof(chunks);
+        strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+        
+        sendPacket(&header, (const char*)&chunks, sizeof(chunks));
+    }
+    
+    // Check a chunk against the server's resume state
+    static bool chunkArrived(const StripeStatus& status, uint64_t offset) {
+        if (offset < status.contiguousOffset) return true;
+        if (offset == status.contiguousOffset) return false;
+        
+        uint64_t slot = (offset - status.contiguousOffset) / FILE_CHUNK_SIZE - 1;
+        return slot < 64 && (status.reorderMask & (1ULL << slot));
+    }
+    
+    // SHA-256 of an upload's file, kept with the pending upload so a resume does not rehash
+    std::string contentHash(uint32_t transferId, const std::string& filepath) {
+        {
+            std::lock_guard<std::mutex> lock(transferMtx);
+            auto it = pendingUploads.find(transferId);
+            if (it != pendingUploads.end() && !it->second.hash.empty()) {
+                return it->second.hash;
+            }
+        }
+        
+        std::string hash = Sha256::hashFile(filepath);
+        std::lock_guard<std::mutex> lock(transferMtx);
+        auto it = pendingUploads.find(transferId);
+        if (it != pendingUploads.end()) {
+            it->second.hash = hash;
+        }
+        return hash;
+    }
+    
+    // Same user, conversation and file contents give the same id, so an upload
+    // can be resumed after a reconnect or a restart of the client
+    uint32_t makeTransferId(const std::string& topic, const std::string& filepath) {
+        struct stat st;
+        std::string key = username + "\n" + topic + "\n" + filepath;
+        if (stat(filepath.c_str(), &st) == 0) {
+            key += "\n" + std::to_string((long long)st.st_size) + "\n" + std::to_string((long long)st.st_mtime);
+        }
+        
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (unsigned char c : key) {
+            hash = (hash ^ c) * 16777619u;
+        }
+        return hash ? hash : 1;
+    }
+    
+    void handleFileAvailable(PacketHeader* header, std::vector<char>& payload) {
+        if (payload.size() < sizeof(FileNotice)) return;
+        
+        std::string sender(header->sender);
+        std::string topic(header->topic);
+        
+        if (header->flags & FLAG_SEQUENCED) {
+            std::lock_guard<std::mutex> lock(seqMtx);
+            uint32_t& lastSeq = topicSequences[topic];
+            if (header->messageId <= lastSeq) {
+                return; // Already seen (overlapping replay)
+            }
+            lastSeq = header->messageId;
+        }
+        
+        FileNotice notice;
+        memcpy(&notice, payload.data(), sizeof(notice));
+        std::string hash(notice.hash, FILE_HASH_LEN);
+        std::string filename(payload.begin() + sizeof(notice), payload.end());
+        
+        std::cout << "[FILE] " << sender << " shared '" << filename << "' (" << notice.fileSize
+                  << " bytes) in " << topic << std::endl;
+        
+        if (onFileAvailable) {
+            onFileAvailable(sender, topic, filename, hash, notice.fileSize);
+        }
+    }
+    
+    void handleFileData(PacketHeader* header, std::vector<char>& payload) {
+        uint32_t msgId = header->messageId;
+        uint32_t handle = 0;
+        bool complete = false;
+        {
+            std::lock_guard<std::mutex> lock(downloadMtx);
+            auto it = activeDownloads.find(msgId);
+            if (it == activeDownloads.end() || it->second.complete) {
+                std::cerr << "[FILE] Unknown file transfer" << std::endl;
+                sendFileCredit(msgId, 1); // Don't stall the uploader
+                return;
+            }
+            
+            FileReceiver& fr = it->second;
+            if (!fr.hash.empty()) {
+                uint64_t chunk = header->offset / FILE_DOWNLOAD_CHUNK_SIZE;
+                if (chunk >= fr.chunks.size() || fr.chunks[chunk]) {
+                    return; // Overlap from a resumed range
+                }
+                fr.chunks[chunk] = true;
+            }
+            uint64_t before = fr.receivedSize;
+            fr.receivedSize += payload.size();
             
-            if (onFileReceived) {
-                onFileReceived(fr.sender, fr.filename, fr.fileSize);
+            // Log in 10% steps
+            if (fr.fileSize > 0 && before * 10 / fr.fileSize != fr.receivedSize * 10 / fr.fileSize) {
+                std::cout << "[FILE] Received " << fr.receivedSize << "/" << fr.fileSize << " bytes" << std::endl;
             }
             
-            activeDownloads.erase(msgId);
+            handle = fr.handle;
+            complete = fr.complete = (fr.receivedSize >= fr.fileSize);
+        }
+        
+        // The IO thread writes the chunk; this thread goes straight back to the socket
+        downloadEngine.write(handle, header->offset, std::move(payload));
+        if (complete) {
+            downloadEngine.finish(handle);
+        }
+    }
+    
+    // IO thread: a relayed chunk is on disk, so its credit can go back to the uploader
+    void handleChunkWritten(uint32_t id, uint32_t handle) {
+        uint32_t credit = 0;
+        {
+            std::lock_guard<std::mutex> lock(downloadMtx);
+            auto it = activeDownloads.find(id);
+            if (it == activeDownloads.end() || it->second.handle != handle || !it->second.hash.empty()) {
+                return;
+            }
+            if (++it->second.unacked >= FILE_CREDIT_BATCH) {
+                credit = it->second.unacked;
+                it->second.unacked = 0;
+            }
+        }
+        if (credit > 0) {
+            sendFileCredit(id, credit);
+        }
+    }
+    
+    // IO thread: the file is synced and closed
+    void handleDownloadFinished(uint32_t id, uint32_t handle, bool ok) {
+        FileReceiver fr;
+        {
+            std::lock_guard<std::mutex> lock(downloadMtx);
+            auto it = activeDownloads.find(id);
+            if (it == activeDownloads.end() || it->second.handle != handle) {
+                return; // A restarted transfer replaced this file
+            }
+            fr = it->second;
+            activeDownloads.erase(it);
+        }
+        
+        if (fr.hash.empty() && fr.unacked > 0) {
+            sendFileCredit(id, fr.unacked);
+        }
+        if (!ok) {
+            std::cerr << "[FILE] Could not write " << fr.filename << std::endl;
+            return;
+        }
+        
+        std::cout << "[FILE] Download complete: " << fr.filename << std::endl;
+        if (onFileReceived) {
+            onFileReceived(fr.sender, fr.filename, fr.fileSize);
         }
     }
     
@@ -543,6 +1211,21 @@ private:
         }
     }
     
+    // The user may still be online, we just no longer share a group or DM with them
+    void handleUserHidden(std::vector<char>& payload) {
+        std::string user(payload.begin(), payload.end());
+        
+        auto it = std::find(onlineUsers.begin(), onlineUsers.end(), user);
+        if (it == onlineUsers.end()) return;
+        onlineUsers.erase(it);
+        
+        std::cout << "[STATUS] No longer sharing a group or DM with " << user << std::endl;
+        
+        if (onUserListReceived) {
+            onUserListReceived(onlineUsers);
+        }
+    }
+    
     void handleUserList(std::vector<char>& payload) {
         std::string userListStr(payload.begin(), payload.end());
         
@@ -581,6 +1264,100 @@ private:
         }
     }
     
+    void handleHistoryBatch(PacketHeader* header, std::vector<char>& payload) {
+        std::string topic(header->topic);
+        std::vector<HistoryEntry> rows;
+        bool hasMore = false;
+        if (!parseBatch(payload, rows, hasMore)) return;
+        
+        std::cout << "[HISTORY] [" << topic << "] Received " << rows.size() << " messages"
+                  << (hasMore ? " (more available)" : "") << std::endl;
+        
+        if (onHistoryBatchReceived) {
+            onHistoryBatchReceived(topic, rows, hasMore);
+        }
+    }
+    
+    // Replayed or offline-spooled messages: delivered like live messages, row id is the sequence
+    void handleMessageBatch(PacketHeader* header, std::vector<char>& payload) {
+        std::string topic(header->topic);
+        std::vector<HistoryEntry> rows;
+        bool hasMore = false;
+        if (!parseBatch(payload, rows, hasMore)) return;
+        
+        size_t delivered = 0;
+        for (const auto& row : rows) {
+            {
+                std::lock_guard<std::mutex> lock(seqMtx);
+                uint32_t& lastSeq = topicSequences[topic];
+                if (row.id <= lastSeq) continue; // Already seen
+                lastSeq = row.id;
+            }
+            
+            delivered++;
+            if (row.isFile && !row.fileHash.empty()) {
+                if (onFileAvailable) {
+                    onFileAvailable(row.sender, topic, row.content, row.fileHash, row.fileSize);
+                }
+            } else if (onMessageReceived) {
+                onMessageReceived(row.sender, topic, row.isFile ? "[FILE] " + row.content : row.content);
+            }
+        }
+        
+        std::cout << "[" << topic << "] Caught up on " << delivered << " missed messages" << std::endl;
+    }
+    
+    // Parse a MSG_HISTORY_BATCH / MSG_MESSAGE_BATCH payload
+    bool parseBatch(const std::vector<char>& payload, std::vector<HistoryEntry>& rows, bool& hasMore) {
+        if (payload.size() < sizeof(uint32_t) + 1) return false;
+        
+        const char* ptr = payload.data();
+        const char* end = ptr + payload.size();
+        uint32_t rowCount = *(uint32_t*)ptr;
+        hasMore = ptr[sizeof(uint32_t)] != 0;
+        ptr += sizeof(uint32_t) + 1;
+        
+        rows.reserve(rowCount);
+        for (uint32_t i = 0; i < rowCount && ptr + sizeof(uint32_t) <= end; i++) {
+            uint32_t rowLength = *(uint32_t*)ptr;
+            ptr += sizeof(uint32_t);
+            if (rowLength < sizeof(HistoryRow) || rowLength > (size_t)(end - ptr)) break;
+            
+            HistoryRow row;
+            memcpy(&row, ptr, sizeof(row));
+            const char* text = ptr + sizeof(row);
+            if (row.senderLength > rowLength - sizeof(row)) break;
+            
+            HistoryEntry entry;
+            entry.id = row.id;
+            entry.timestamp = row.timestamp;
+            entry.isFile = row.isFile != 0;
+            entry.sender.assign(text, row.senderLength);
+            entry.content.assign(text + row.senderLength, rowLength - sizeof(row) - row.senderLength);
+            entry.fileSize = 0;
+            if (entry.isFile) {
+                splitFileRef(entry);
+            }
+            rows.push_back(entry);
+            
+            ptr += rowLength;
+        }
+        return true;
+    }
+    
+    // Split a stored file row "<hash>:<size>:<filename>" into its parts
+    static void splitFileRef(HistoryEntry& entry) {
+        const std::string& ref = entry.content;
+        if (ref.length() <= FILE_HASH_LEN + 2 || ref[FILE_HASH_LEN] != ':') return;
+        
+        size_t sep = ref.find(':', FILE_HASH_LEN + 1);
+        if (sep == std::string::npos) return;
+        
+        entry.fileHash = ref.substr(0, FILE_HASH_LEN);
+        entry.fileSize = strtoull(ref.c_str() + FILE_HASH_LEN + 1, nullptr, 10);
+        entry.content = ref.substr(sep + 1);
+    }
+    
     void handleGroupCreated(PacketHeader* header, std::vector<char>& payload) {
         std::string groupName(payload.begin(), payload.end());
         std::string creator(header->sender);
@@ -616,6 +1393,30 @@ private:
         if (onGroupListReceived) {
             onGroupListReceived(groups);
         }
+        
+        resumeTopics(groups);
+    }
+    
+    // After (re)login, ask for the gap in every conversation we have seen before
+    void resumeTopics(const std::vector<std::pair<std::string, bool>>& groups) {
+        std::vector<std::string> topics;
+        {
+            std::lock_guard<std::mutex> lock(seqMtx);
+            for (const auto& g : groups) {
+                if (g.second && topicSequences.find(g.first) != topicSequences.end()) {
+                    topics.push_back(g.first);
+                }
+            }
+            for (const auto& t : topicSequences) {
+                if (StringUtils::isDMTopic(t.first)) {
+                    topics.push_back(t.first);
+                }
+            }
+        }
+        
+        for (const std::string& topic : topics) {
+            subscribe(topic);
+        }
     }
 };
 
@@ -24,6 +24,16 @@ std::set<std::string> g_joinedGroups; // Groups that current user has joined
 std::map<std::string, std::string> g_chatHistory; // Cache chat history for each conversation
 std::vector<std::string> g_downloadedFiles; // List of downloaded files for click handling
 std::string g_lastReceivedFile = ""; // Last received file path for quick open
+int g_uploadStreams = UPLOAD_DEFAULT_STREAMS; // Connections a large upload may use
+
+// Paged history state per conversation (for scroll-back)
+struct HistoryCursor {
+    uint32_t oldestId;  // Oldest message id loaded so far
+    bool hasMore;       // Server has older messages
+    bool loading;       // A page request is in flight
+};
+std::map<std::string, HistoryCursor> g_historyCursors;
+#define HISTORY_PAGE_SIZE 50
 
 // Caro game state
 CaroState g_caroState;
@@ -152,7 +162,7 @@ struct FileData {
     std::string sender;
     std::string filename;
     std::string filepath;
-    uint32_t size;
+    uint64_t size;
 };
 
 #ifdef _WIN32
@@ -257,6 +267,62 @@ gboolean display_file_ui(gpointer data) {
     return G_SOURCE_REMOVE;
 }
 
+// Struct for passing a stored group file notice to UI thread
+struct FileAvailableData {
+    std::string sender;
+    std::string topic;
+    std::string filename;
+    std::string hash;
+    uint64_t size;
+};
+
+// Callback when clicking Download button of a stored group file
+void on_embedded_download_clicked(GtkButton* button, gpointer user_data) {
+    (void)user_data; // unused
+    FileAvailableData* fileData = (FileAvailableData*)g_object_get_data(G_OBJECT(button), "file");
+    if (fileData && g_client && g_client->isConnected()) {
+        if (g_client->downloadFile(fileData->topic, fileData->hash, fileData->filename, fileData->size)) {
+            gtk_widget_set_sensitive(GTK_WIDGET(button), FALSE);
+        }
+    }
+}
+
+// Thread-safe display of a file that can be downloaded on demand
+gboolean display_file_available_ui(gpointer data) {
+    FileAvailableData* fileData = static_cast<FileAvailableData*>(data);
+    
+    std::string display = "[FILE] " + fileData->sender + " shared '" + fileData->filename + "' ("
+                          + std::to_string(fileData->size) + " bytes) ";
+    g_chatHistory[fileData->topic] += display + "\n";
+    
+    if (fileData->topic != g_currentRecipient) {
+        delete fileData;
+        return G_SOURCE_REMOVE;
+    }
+    
+    GtkTextIter iter;
+    gtk_text_buffer_get_end_iter(app->chatBuffer, &iter);
+    gtk_text_buffer_insert(app->chatBuffer, &iter, display.c_str(), -1);
+    
+    // Embedded Download button; the button owns the notice data
+    gtk_text_buffer_get_end_iter(app->chatBuffer, &iter);
+    GtkTextChildAnchor* anchor = gtk_text_buffer_create_child_anchor(app->chatBuffer, &iter);
+    
+    GtkWidget* downloadBtn = gtk_button_new_with_label("Download");
+    gtk_widget_set_size_request(downloadBtn, 80, 24);
+    g_object_set_data_full(G_OBJECT(downloadBtn), "file", fileData,
+                           [](gpointer p) { delete static_cast<FileAvailableData*>(p); });
+    g_signal_connect(downloadBtn, "clicked", G_CALLBACK(on_embedded_download_clicked), nullptr);
+    
+    gtk_text_view_add_child_at_anchor(GTK_TEXT_VIEW(app->chatView), downloadBtn, anchor);
+    gtk_widget_show(downloadBtn);
+    
+    gtk_text_buffer_get_end_iter(app->chatBuffer, &iter);
+    gtk_text_buffer_insert(app->chatBuffer, &iter, "\n", -1);
+    
+    return G_SOURCE_REMOVE;
+}
+
 // Struct for history data
 struct HistoryData {
     std::string sender;
@@ -282,6 +348,86 @@ gboolean display_history_ui(gpointer data) {
     return G_SOURCE_REMOVE;
 }
 
+// Struct for a batch of paged history
+struct HistoryBatchData {
+    std::string topic;
+    std::vector<HistoryEntry> rows;
+    bool hasMore;
+};
+
+// Topic used on the wire for the current conversation
+std::string current_history_topic() {
+    if (g_isGroupChat) {
+        return g_currentRecipient;
+    }
+    return StringUtils::createDMTopic(g_client->getUsername(), g_currentRecipient);
+}
+
+// Request the latest page of the current conversation
+void request_latest_history() {
+    if (!g_client || g_currentRecipient.empty()) return;
+    
+    HistoryCursor cursor = {0, false, true};
+    g_historyCursors[g_currentRecipient] = cursor;
+    g_client->requestHistoryPage(current_history_topic(), 0, HISTORY_PAGE_SIZE);
+}
+
+// Request the page before the oldest loaded message of the current conversation
+void request_older_history() {
+    if (!g_client || g_currentRecipient.empty()) return;
+    
+    auto it = g_historyCursors.find(g_currentRecipient);
+    if (it == g_historyCursors.end() || !it->second.hasMore || it->second.loading) return;
+    
+    it->second.loading = true;
+    g_client->requestHistoryPage(current_history_topic(), it->second.oldestId, HISTORY_PAGE_SIZE);
+}
+
+// Thread-safe paged history display - pages are always older than what is shown, so prepend
+gboolean display_history_batch_ui(gpointer data) {
+    HistoryBatchData* batch = static_cast<HistoryBatchData*>(data);
+    
+    std::string conversationKey = batch->topic;
+    if (StringUtils::isDMTopic(batch->topic) && g_client) {
+        conversationKey = StringUtils::extractRecipient(batch->topic, g_client->getUsername());
+    }
+    
+    HistoryCursor& cursor = g_historyCursors[conversationKey];
+    cursor.loading = false;
+    cursor.hasMore = batch->hasMore;
+    if (!batch->rows.empty()) {
+        cursor.oldestId = batch->rows.front().id;
+    }
+    
+    std::string display;
+    for (const auto& row : batch->rows) {
+        char timeStr[20];
+        time_t ts = row.timestamp;
+        strftime(timeStr, sizeof(timeStr), "%H:%M", localtime(&ts));
+        
+        std::string content = row.isFile ? "[FILE] " + row.content : row.content;
+        display += "[" + std::string(timeStr) + "] " + row.sender + ": " + content + "\n";
+    }
+    
+    if (conversationKey == g_currentRecipient) {
+        GtkTextIter iter;
+        gtk_text_buffer_get_start_iter(app->chatBuffer, &iter);
+        gtk_text_buffer_insert(app->chatBuffer, &iter, display.c_str(), -1);
+    } else {
+        g_chatHistory[conversationKey] = display + g_chatHistory[conversationKey];
+    }
+    
+    delete batch;
+    return G_SOURCE_REMOVE;
+}
+
+// Load older messages when the chat view is scrolled to the top
+void on_chat_edge_reached(GtkScrolledWindow* scrolled, GtkPositionType pos, gpointer user_data) {
+    if (pos == GTK_POS_TOP) {
+        request_older_history();
+    }
+}
+
 // Open file when clicking on file link
 void open_file(const char* filepath) {
     if (filepath) {
@@ -364,7 +510,7 @@ void on_user_selected(GtkTreeView* tree_view, GtkTreePath* path, GtkTreeViewColu
                     gtk_text_buffer_set_text(app->chatBuffer, g_chatHistory[g_currentRecipient].c_str(), -1);
                 } else {
                     gtk_text_buffer_set_text(app->chatBuffer, "", -1);
-                    g_client->requestHistory(g_currentRecipient);
+                    request_latest_history();
                 }
             }
             g_free(username);
@@ -411,7 +557,7 @@ void on_group_selected(GtkTreeView* tree_view, GtkTreePath* path, GtkTreeViewCol
                 gtk_text_buffer_set_text(app->chatBuffer, g_chatHistory[g_currentRecipient].c_str(), -1);
             } else {
                 gtk_text_buffer_set_text(app->chatBuffer, "", -1);
-                g_client->requestHistory(g_currentRecipient);
+                request_latest_history();
             }
             
             g_free(groupname);
@@ -533,6 +679,7 @@ void on_connect_clicked(GtkButton* button, gpointer user_data) {
     }
     
     g_client = new ChatClient();
+    g_client->setUploadStreams(g_uploadStreams);
     
     // Set callbacks - use g_idle_add for thread-safe GTK updates
     g_client->setMessageCallback([](const std::string& sender, const std::string& topic, const std::string& msg) {
@@ -553,7 +700,7 @@ void on_connect_clicked(GtkButton* button, gpointer user_data) {
         g_idle_add(display_message_ui, data);
     });
     
-    g_client->setFileCallback([](const std::string& sender, const std::string& filename, uint32_t size) {
+    g_client->setFileCallback([](const std::string& sender, const std::string& filename, uint64_t size) {
         FileData* data = new FileData();
         data->sender = sender;
         data->filename = filename;
@@ -563,6 +710,18 @@ void on_connect_clicked(GtkButton* button, gpointer user_data) {
         g_idle_add(display_file_ui, data);
     });
     
+    g_client->setFileAvailableCallback([](const std::string& sender, const std::string& topic,
+                                          const std::string& filename, const std::string& hash, uint64_t size) {
+        FileAvailableData* data = new FileAvailableData();
+        data->sender = sender;
+        data->topic = topic;
+        data->filename = filename;
+        data->hash = hash;
+        data->size = size;
+        
+        g_idle_add(display_file_available_ui, data);
+    });
+    
     g_client->setUserStatusCallback([](const std::string& username, bool isOnline) {
         if (isOnline) {
             g_idle_add(add_online_user_ui, new std::string(username));
@@ -585,6 +744,15 @@ void on_connect_clicked(GtkButton* button, gpointer user_data) {
         g_idle_add(display_history_ui, data);
     });
     
+    g_client->setHistoryBatchCallback([](const std::string& topic, const std::vector<HistoryEntry>& rows, bool hasMore) {
+        HistoryBatchData* data = new HistoryBatchData();
+        data->topic = topic;
+        data->rows = rows;
+        data->hasMore = hasMore;
+        
+        g_idle_add(display_history_batch_ui, data);
+    });
+    
     // Set callback for new group broadcast
     g_client->setGroupCallback([](const std::string& groupName, const std::string& creator) {
         GroupInfo* info = new GroupInfo();
@@ -754,7 +922,7 @@ void on_join_group_clicked(GtkButton* button, gpointer user_data) {
             g_isGroupChat = true;
             update_chat_title();
             gtk_text_buffer_set_text(app->chatBuffer, "", -1);
-            g_client->requestHistory(g_currentRecipient);
+            request_latest_history();
             
             gtk_entry_set_text(GTK_ENTRY(app->groupEntry), "");
         }
@@ -1064,6 +1232,9 @@ void build_ui() {
     g_signal_connect(app->chatView, "button-press-event", G_CALLBACK(on_chat_click), nullptr);
     
     gtk_container_add(GTK_CONTAINER(chatScrolled), app->chatView);
+    
+    // Scroll-back: fetch older history pages when reaching the top
+    g_signal_connect(chatScrolled, "edge-reached", G_CALLBACK(on_chat_edge_reached), nullptr);
     gtk_box_pack_start(GTK_BOX(rightPanel), chatScrolled, TRUE, TRUE, 0);
     
     // Message input area
@@ -1106,9 +1277,19 @@ void build_ui() {
     gtk_widget_hide(app->chatBox);
 }
 
+// Usage: client [upload-streams]
+// upload-streams: parallel connections for large file uploads, 1 to FILE_MAX_STREAMS (default 4)
 int main(int argc, char* argv[]) {
     gtk_init(&argc, &argv);
     
+    if (argc > 1) {
+        g_uploadStreams = atoi(argv[1]);
+        if (g_uploadStreams < 1 || g_uploadStreams > FILE_MAX_STREAMS) {
+            fprintf(stderr, "Upload streams must be 1 to %d\n", FILE_MAX_STREAMS);
+            return 1;
+        }
+    }
+    
     build_ui();
     
     gtk_main();
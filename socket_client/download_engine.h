@@ -0,0 +1,256 @@
+#ifndef DOWNLOAD_ENGINE_H
+#define DOWNLOAD_ENGINE_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <iostream>
+#include <fcntl.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+    #include <sys/stat.h>
+#else
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/statvfs.h>
+#endif
+
+#define DOWNLOAD_QUEUE_LIMIT (64 * 1024 * 1024) // Bytes queued for the disk before write() waits
+#define DOWNLOAD_FREE_MARGIN (64ULL * 1024 * 1024) // Disk space a download must leave free
+
+// Writes incoming files on a dedicated IO thread so the network receive
+// thread never waits on the disk. Each file is preallocated when opened,
+// chunks land at their offsets with positional writes, and the file is
+// fsynced once when it is finished.
+class DownloadEngine {
+public:
+    using WrittenCallback = std::function<void(uint32_t, uint32_t)>;        // id, handle
+    using FinishedCallback = std::function<void(uint32_t, uint32_t, bool)>; // id, handle, every write succeeded
+
+private:
+    struct Job {
+        uint32_t handle;
+        uint64_t offset;
+        std::vector<char> data;
+        bool finish;        // Sync and close the file instead of writing
+    };
+    
+    struct OpenFile {
+        uint32_t id;
+        int fd;
+        bool failed;
+    };
+    
+    // Handles rather than transfer ids key the files, so a transfer id that is
+    // reused while its previous file is still being flushed gets a file of its own
+    std::map<uint32_t, OpenFile> files;  // handle -> open target file
+    uint32_t nextHandle;
+    std::deque<Job> jobs;
+    size_t queuedBytes;
+    bool stopping;
+    std::mutex mtx;
+    std::condition_variable jobReady;
+    std::condition_variable spaceFreed;
+    std::thread worker;
+    
+    WrittenCallback onWritten;
+    FinishedCallback onFinished;
+
+public:
+    DownloadEngine() : nextHandle(1), queuedBytes(0), stopping(false) {
+        worker = std::thread(&DownloadEngine::ioLoop, this);
+    }
+    
+    // Drains queued writes, then closes anything still open
+    ~DownloadEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        worker.join();
+        
+        for (auto& f : files) {
+            closeFile(f.second.fd);
+        }
+    }
+    
+    // Callbacks run on the IO thread
+    void setWrittenCallback(WrittenCallback callback) {
+        onWritten = callback;
+    }
+    
+    void setFinishedCallback(FinishedCallback callback) {
+        onFinished = callback;
+    }
+    
+    // Create the target file at its final size
+    // Returns the handle to write through, or 0 if the file cannot be created.
+    // The size comes from the peer, so it is checked against the free space
+    // before anything is reserved.
+    uint32_t open(uint32_t id, const std::string& path, uint64_t size) {
+        if (!hasRoomFor(path, size)) {
+            std::cerr << "[FILE] Not enough disk space for " << size << " bytes" << std::endl;
+            return 0;
+        }
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (fd < 0) {
+            return 0;
+        }
+        preallocate(fd, size);
+        
+        std::lock_guard<std::mutex> lock(mtx);
+        uint32_t handle = nextHandle++;
+        if (nextHandle == 0) nextHandle = 1;
+        files[handle] = OpenFile{id, fd, false};
+        return handle;
+    }
+    
+    // Queue a chunk; returns at once unless DOWNLOAD_QUEUE_LIMIT bytes are already waiting
+    void write(uint32_t handle, uint64_t offset, std::vector<char>&& data) {
+        std::unique_lock<std::mutex> lock(mtx);
+        spaceFreed.wait(lock, [&]() { return queuedBytes < DOWNLOAD_QUEUE_LIMIT || stopping; });
+        
+        queuedBytes += data.size();
+        jobs.push_back(Job{handle, offset, std::move(data), false});
+        jobReady.notify_one();
+    }
+    
+    // Sync and close the file once every chunk queued before this call is written
+    void finish(uint32_t handle) {
+        std::lock_guard<std::mutex> lock(mtx);
+        jobs.push_back(Job{handle, 0, std::vector<char>(), true});
+        jobReady.notify_one();
+    }
+
+private:
+    void ioLoop() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx);
+            jobReady.wait(lock, [&]() { return !jobs.empty() || stopping; });
+            if (jobs.empty()) {
+                return; // Stopping and drained
+            }
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            
+            auto it = files.find(job.handle);
+            if (it == files.end()) {
+                queuedBytes -= job.data.size();
+                spaceFreed.notify_all();
+                continue;
+            }
+            OpenFile file = it->second;
+            if (job.finish) {
+                files.erase(it);
+            }
+            lock.unlock();
+            
+            if (job.finish) {
+                bool ok = !file.failed && syncFile(file.fd);
+                closeFile(file.fd);
+                if (onFinished) onFinished(file.id, job.handle, ok);
+                continue;
+            }
+            
+            bool written = writeAt(file.fd, job.offset, job.data.data(), job.data.size());
+            
+            lock.lock();
+            queuedBytes -= job.data.size();
+            if (!written) {
+                auto failedIt = files.find(job.handle);
+                if (failedIt != files.end()) failedIt->second.failed = true;
+            }
+            lock.unlock();
+            spaceFreed.notify_all();
+            
+            if (written && onWritten) onWritten(file.id, job.handle);
+        }
+    }
+    
+    // Check that the file system holding 'path' can take 'size' more bytes and
+    // still keep DOWNLOAD_FREE_MARGIN free; when free space is unknown the
+    // writes are left to fail instead
+    static bool hasRoomFor(const std::string& path, uint64_t size) {
+        size_t slash = path.find_last_of("/\\");
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+#ifdef _WIN32
+        ULARGE_INTEGER available;
+        if (!GetDiskFreeSpaceExA(dir.c_str(), &available, nullptr, nullptr)) return true;
+        uint64_t free = available.QuadPart;
+#else
+        struct statvfs st;
+        if (statvfs(dir.c_str(), &st) != 0) return true;
+        uint64_t free = (uint64_t)st.f_bavail * st.f_frsize;
+#endif
+        return size <= free && free - size >= DOWNLOAD_FREE_MARGIN;
+    }
+    
+    // Reserve the blocks up front so out-of-order chunks do not fragment the file
+    static void preallocate(int fd, uint64_t size) {
+        if (size == 0) return;
+#ifdef _WIN32
+        _chsize_s(fd, size);
+#else
+#ifdef __linux__
+        if (fallocate(fd, 0, 0, size) == 0) return;
+#endif
+        // Filesystems without fallocate still get the final size up front
+        if (ftruncate(fd, size) != 0) {
+            std::cerr << "[FILE] Could not preallocate " << size << " bytes" << std::endl;
+        }
+#endif
+    }
+    
+    static bool writeAt(int fd, uint64_t offset, const char* data, size_t size) {
+#ifdef _WIN32
+        // Only the IO thread touches the file position, so seek + write is safe here
+        if (_lseeki64(fd, offset, SEEK_SET) < 0) return false;
+        while (size > 0) {
+            int n = _write(fd, data, (unsigned int)size);
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+#else
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, offset);
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+#endif
+        return true;
+    }
+    
+    static bool syncFile(int fd) {
+#ifdef _WIN32
+        return _commit(fd) == 0;
+#else
+        return fsync(fd) == 0;
+#endif
+    }
+    
+    static void closeFile(int fd) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+};
+
+#endif // DOWNLOAD_ENGINE_H
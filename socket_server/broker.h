@@ -7,6 +7,11 @@
 #include "client_manager.h"
 #include "topic_manager.h"
 #include "file_transfer_manager.h"
+#include "presence_manager.h"
+#include "topic_sequencer.h"
+#include "history_cache.h"
+#include "offline_spool.h"
+#include "file_store.h"
 #include "message_handler.h"
 #include <iostream>
 #include <thread>
@@ -18,21 +23,31 @@ private:
     ClientManager clientManager;
     TopicManager topicManager;
     FileTransferManager fileTransferManager;
+    PresenceManager presenceManager;
+    TopicSequencer topicSequencer;
+    HistoryCache historyCache;
     DatabaseManager* dbManager;
+    OfflineSpool* offlineSpool;
+    FileStore* fileStore;
     MessageHandler* messageHandler;
     std::mutex mtx;
     bool running;
 
 public:
-    Broker() : serverSocket(SOCKET_INVALID), dbManager(nullptr), messageHandler(nullptr), running(false) {}
+    Broker() : serverSocket(SOCKET_INVALID), dbManager(nullptr), offlineSpool(nullptr),
+               fileStore(nullptr), messageHandler(nullptr), running(false) {}
     
     ~Broker() {
         stop();
         delete messageHandler;
+        delete fileStore;
+        delete offlineSpool;
         delete dbManager;
     }
     
-    bool initialize(int port = DEFAULT_PORT) {
+    // syncMode / syncIntervalMs choose when saved messages are fsynced (see LogSyncMode)
+    bool initialize(int port = DEFAULT_PORT, LogSyncMode syncMode = LOG_SYNC_INTERVAL,
+                    int syncIntervalMs = MESSAGE_LOG_SYNC_INTERVAL_MS) {
         if (!NetworkUtils::initWinsock()) {
             std::cerr << "WSAStartup failed" << std::endl;
             return false;
@@ -66,9 +81,16 @@ public:
         
         // Initialize database manager
         dbManager = new DatabaseManager("data");
+        dbManager->setMessageSync(syncMode, syncIntervalMs);
+        offlineSpool = new OfflineSpool("data/spool");
+        fileStore = new FileStore("data/files");
         
         // Initialize message handler with database
-        messageHandler = new MessageHandler(clientManager, topicManager, fileTransferManager, dbManager);
+        messageHandler = new MessageHandler(clientManager, topicManager, fileTransferManager,
+                                            presenceManager, topicSequencer, historyCache,
+                                            dbManager, offlineSpool, fileStore);
+        messageHandler->loadPresenceIndex();
+        messageHandler->loadFileIndex();
         
         std::cout << "[SERVER] Broker started on port " << port << std::endl;
         std::cout << "[SERVER] Database initialized in 'data/' folder" << std::endl;
@@ -86,6 +108,7 @@ public:
                 continue;
             }
             
+            NetworkUtils::setNoDelay(clientSocket);
             std::cout << "[SERVER] New client connected" << std::endl;
             std::thread(&Broker::handleClient, this, clientSocket).detach();
         }
@@ -104,34 +127,71 @@ public:
     size_t getClientCount() const { return clientManager.getClientCount(); }
     size_t getTopicCount() const { return topicManager.getTopicCount(); }
     size_t getActiveTransfers() const { return fileTransferManager.getActiveCount(); }
+    uint64_t getHistoryCacheHits() const { return historyCache.getHits(); }
+    uint64_t getHistoryCacheMisses() const { return historyCache.getMisses(); }
+    uint64_t getDedupHits() const { return fileStore ? fileStore->getDedupHits() : 0; }
+    uint64_t getDedupMisses() const { return fileStore ? fileStore->getDedupMisses() : 0; }
 
 private:
     void handleClient(SocketType clientSocket) {
         char buffer[MAX_BUFFER_SIZE];
+#ifdef __linux__
+        NetworkUtils::SplicePipe relayPipe;
+#endif
         
         while (running) {
             // Receive header
-            int received = recv(clientSocket, buffer, sizeof(PacketHeader), 0);
-            if (received <= 0) {
-                messageHandler->handleDisconnect(clientSocket);
+            if (!NetworkUtils::receiveAll(clientSocket, buffer, sizeof(PacketHeader))) {
+                disconnect(clientSocket);
                 break;
             }
             
             PacketHeader* header = (PacketHeader*)buffer;
+
+#ifdef __linux__
+            // DM file chunks go socket to socket without being copied into user space
+            if (header->msgType == MSG_FILE_DATA) {
+                RelayResult relayed = messageHandler->spliceFileData(clientSocket, header, relayPipe, mtx);
+                if (relayed == RELAY_FAILED) {
+                    disconnect(clientSocket);
+                    return;
+                }
+                if (relayed == RELAY_DONE) {
+                    continue;
+                }
+            }
+#endif
             
             // Receive payload if any
             std::vector<char> payload;
             if (header->payloadLength > 0) {
                 if (!NetworkUtils::receivePayload(clientSocket, payload, header->payloadLength)) {
-                    messageHandler->handleDisconnect(clientSocket);
+                    disconnect(clientSocket);
                     return;
                 }
             }
             
+            // Downloads stream outside the broker lock, under the client's send lock
+            if (header->msgType == LTM_DOWNLOAD) {
+                messageHandler->handleDownload(clientSocket, header, payload, mtx);
+                continue;
+            }
+            
             processMessage(clientSocket, header, payload);
+            
+            // Completed group uploads are hashed outside the lock
+            if (header->msgType == MSG_FILE_DATA || header->msgType == MSG_PUBLISH_FILE) {
+                messageHandler->finishUploads(clientSocket, mtx);
+            }
         }
     }
     
+    // A dropped connection updates the same state as messages do, so it takes the lock too
+    void disconnect(SocketType clientSocket) {
+        std::lock_guard<std::mutex> lock(mtx);
+        messageHandler->handleDisconnect(clientSocket);
+    }
+    
     void processMessage(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload) {
         std::lock_guard<std::mutex> lock(mtx);
         
@@ -141,7 +201,7 @@ private:
                 break;
                 
             case MSG_SUBSCRIBE:
-                messageHandler->handleSubscribe(clientSocket, header);
+                messageHandler->handleSubscribe(clientSocket, header, payload);
                 break;
                 
             case MSG_UNSUBSCRIBE:
@@ -160,6 +220,14 @@ private:
                 messageHandler->handleFileData(clientSocket, header, payload);
                 break;
                 
+            case MSG_FILE_CREDIT:
+                messageHandler->handleFileCredit(clientSocket, header, payload);
+                break;
+            
+            case MSG_ATTACH_STREAM:
+                messageHandler->handleAttachStream(clientSocket, header);
+                break;
+            
             case MSG_LOGOUT:
                 messageHandler->handleDisconnect(clientSocket);
                 break;
@@ -172,6 +240,10 @@ private:
                 messageHandler->handleRequestHistory(clientSocket, header, payload);
                 break;
                 
+            case MSG_REQUEST_HISTORY_PAGE:
+                messageHandler->handleRequestHistoryPage(clientSocket, header, payload);
+                break;
+            
             case MSG_GAME:
                 messageHandler->handleGameMessage(clientSocket, header, payload);
                 break;
@@ -10,6 +10,7 @@ class ClientManager {
 private:
     std::map<std::string, SocketType> clients;      // username -> socket
     std::map<SocketType, std::string> socketToUser; // socket -> username
+    std::map<SocketType, std::string> streams;      // extra upload connection -> username
     std::mutex mtx;
 
 public:
@@ -29,10 +30,21 @@ public:
         return true;
     }
 
+    // Register an extra upload connection of a logged-in user
+    void addStream(SocketType socket, const std::string& username) {
+        std::lock_guard<std::mutex> lock(mtx);
+        streams[socket] = username;
+    }
+    
     // Remove a client by socket
+    // Returns "" for upload streams, their user stays logged in
     std::string removeClient(SocketType socket) {
         std::lock_guard<std::mutex> lock(mtx);
         
+        if (streams.erase(socket) > 0) {
+            return "";
+        }
+        
         auto it = socketToUser.find(socket);
         if (it == socketToUser.end()) {
             return "";
@@ -45,7 +57,7 @@ public:
         return username;
     }
 
-    // Get username by socket
+    // Get username by socket (login connection or upload stream)
     std::string getUsername(SocketType socket) {
         std::lock_guard<std::mutex> lock(mtx);
         
@@ -53,6 +65,10 @@ public:
         if (it != socketToUser.end()) {
             return it->second;
         }
+        it = streams.find(socket);
+        if (it != streams.end()) {
+            return it->second;
+        }
         return "";
     }
 
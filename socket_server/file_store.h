@@ -0,0 +1,354 @@
+#ifndef FILE_STORE_H
+#define FILE_STORE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <mutex>
+#include <cstdint>
+#include <functional>
+#include <fcntl.h>
+#include "../utils/sha256.h"
+#include "../utils/record_codec.h"
+
+// Cross-platform directory creation and raw file access
+#ifdef _WIN32
+    #include <direct.h>
+    #include <io.h>
+    #include <sys/stat.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <unistd.h>
+#endif
+
+// Disk-backed, content-addressed store for group file uploads.
+// An upload is written once to <dir>/tmp/<transferId>.part, then renamed
+// to <dir>/<sha256> when complete; identical files share one blob.
+// Chunks are hashed as they arrive in order, so committing a single-stream
+// upload reads nothing back; only bytes that arrived ahead of the hashed
+// prefix (other stripes) are read from disk, without holding the lock.
+// Members pull blobs on demand with ranged reads, and only from a group
+// the blob was announced in: <dir>/published.log records each
+// (hash, group) pair as a RecordCodec frame when it is announced.
+// Uploaders may name the content's hash up front; if the blob is already
+// stored and published in a group they can read, the upload is skipped
+// entirely (see findBlob).
+class FileStore {
+private:
+    struct Upload {
+        std::ofstream file;
+        std::string path;
+        Sha256 sha;         // Hash of the first 'hashed' bytes
+        uint64_t hashed;
+    };
+    
+    std::string storeDir;
+    std::map<uint32_t, Upload> uploads; // transferId -> partial file
+    std::map<std::string, uint64_t> blobSizes; // hash -> size of blobs known to be stored
+    std::map<std::string, std::set<std::string>> publishedIn; // hash -> groups it was announced in
+    std::ofstream publishLog;
+    bool indexExisted;  // published.log was there at startup
+    uint64_t dedupHits;
+    uint64_t dedupMisses;
+    uint64_t dedupBytesSaved;
+    std::mutex mtx;
+
+public:
+    FileStore(const std::string& directory)
+        : storeDir(directory), dedupHits(0), dedupMisses(0), dedupBytesSaved(0) {
+        createDirectory(storeDir);
+        createDirectory(storeDir + "/tmp");
+        loadPublished();
+    }
+    ~FileStore() = default;
+    
+    // Begin receiving a file into the store
+    bool beginUpload(uint32_t transferId) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        Upload upload;
+        upload.path = storeDir + "/tmp/" + std::to_string(transferId) + ".part";
+        upload.hashed = 0;
+        upload.file.open(upload.path, std::ios::binary | std::ios::trunc);
+        if (!upload.file.is_open()) {
+            return false;
+        }
+        uploads[transferId] = std::move(upload);
+        return true;
+    }
+    
+    // Check if a transfer is being written into the store
+    bool isUploading(uint32_t transferId) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return uploads.find(transferId) != uploads.end();
+    }
+    
+    // Write a chunk at its byte offset
+    bool writeChunk(uint32_t transferId, uint64_t offset, const char* data, size_t size) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = uploads.find(transferId);
+        if (it == uploads.end()) {
+            return false;
+        }
+        Upload& upload = it->second;
+        upload.file.seekp(offset);
+        upload.file.write(data, size);
+        if (offset == upload.hashed) {
+            upload.sha.update(data, size);
+            upload.hashed += size;
+        }
+        return upload.file.good();
+    }
+    
+    // Finish an upload: complete its hash and move it to its content address
+    // Returns the hex digest, or "" on failure
+    std::string commitUpload(uint32_t transferId) {
+        std::unique_lock<std::mutex> lock(mtx);
+        
+        auto it = uploads.find(transferId);
+        if (it == uploads.end()) {
+            return "";
+        }
+        
+        // Move the file off its .part name so a new upload reusing the id cannot touch it
+        std::string tmpPath = it->second.path + ".commit";
+        it->second.file.close();
+        bool moved = std::rename(it->second.path.c_str(), tmpPath.c_str()) == 0;
+        Sha256 sha = it->second.sha;
+        uint64_t hashed = it->second.hashed;
+        uploads.erase(it);
+        lock.unlock();
+        
+        std::string hash;
+        if (moved && sha.updateFile(tmpPath, hashed)) {
+            hash = sha.hexDigest();
+        }
+        
+        lock.lock();
+        if (hash.empty()) {
+            std::remove(tmpPath.c_str());
+            return "";
+        }
+        
+        std::string blobPath = blobPathFor(hash);
+        uint64_t size = 0;
+        if (blobSize(blobPath, size)) {
+            std::remove(tmpPath.c_str()); // Same content already stored
+        } else if (std::rename(tmpPath.c_str(), blobPath.c_str()) != 0 || !blobSize(blobPath, size)) {
+            std::remove(tmpPath.c_str());
+            return "";
+        }
+        blobSizes[hash] = size;
+        return hash;
+    }
+    
+    // Check whether an upload announced with this hash and size is already stored,
+    // counting a dedup hit or miss. Blobs from earlier runs are found on disk once,
+    // then answered from the in-memory index.
+    // The client only names the hash, so a hit also needs the blob to be published
+    // in a group canRead accepts: the uploader could download it from there anyway,
+    // and the answer reveals nothing about content held in other groups.
+    bool findBlob(const std::string& hash, uint64_t size,
+                  const std::function<bool(const std::string&)>& canRead) {
+        std::set<std::string> groups;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = publishedIn.find(hash);
+            if (it != publishedIn.end()) {
+                groups = it->second;
+            }
+        }
+        
+        // Membership is checked without the store lock
+        bool readable = false;
+        for (const auto& group : groups) {
+            if (canRead(group)) {
+                readable = true;
+                break;
+            }
+        }
+        
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        bool found = false;
+        if (readable && Sha256::isHexDigest(hash)) {
+            auto it = blobSizes.find(hash);
+            if (it != blobSizes.end()) {
+                found = (it->second == size);
+            } else {
+                uint64_t stored = 0;
+                if (blobSize(blobPathFor(hash), stored)) {
+                    blobSizes[hash] = stored;
+                    found = (stored == size);
+                }
+            }
+        }
+        
+        if (found) {
+            dedupHits++;
+            dedupBytesSaved += size;
+        } else {
+            dedupMisses++;
+        }
+        return found;
+    }
+    
+    // Record that a blob was announced in a group, which lets the group's members read it
+    // Returns true if the pair is new
+    bool publish(const std::string& hash, const std::string& group) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        if (!publishedIn[hash].insert(group).second) {
+            return false;
+        }
+        std::string payload;
+        RecordCodec::putString(payload, hash);
+        RecordCodec::putString(payload, group);
+        std::string frame;
+        RecordCodec::putFrame(frame, payload);
+        publishLog.write(frame.data(), frame.size());
+        publishLog.flush();
+        return true;
+    }
+    
+    // Check if a blob was announced in a group
+    bool isPublished(const std::string& hash, const std::string& group) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = publishedIn.find(hash);
+        return it != publishedIn.end() && it->second.count(group) > 0;
+    }
+    
+    // Whether the store predates published.log, so announcements made before it must be indexed
+    bool needsIndex() const {
+        return !indexExisted;
+    }
+    
+    // Get dedup counters
+    uint64_t getDedupHits() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return dedupHits;
+    }
+    
+    uint64_t getDedupMisses() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return dedupMisses;
+    }
+    
+    uint64_t getDedupBytesSaved() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return dedupBytesSaved;
+    }
+    
+    // Discard a partial upload
+    void abortUpload(uint32_t transferId) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = uploads.find(transferId);
+        if (it != uploads.end()) {
+            it->second.file.close();
+            std::remove(it->second.path.c_str());
+            uploads.erase(it);
+        }
+    }
+    
+    // Open a stored blob for reading; returns a file descriptor or -1
+    int openBlob(const std::string& hash, uint64_t& size) {
+        if (!Sha256::isHexDigest(hash)) {
+            return -1;
+        }
+        
+        std::string path = blobPathFor(hash);
+#ifdef _WIN32
+        int fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+        if (fd < 0) return -1;
+        size = _filelengthi64(fd);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return -1;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+#endif
+        return fd;
+    }
+    
+    void closeBlob(int fd) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+
+private:
+    std::string publishLogPath() const {
+        return storeDir + "/published.log";
+    }
+    
+    // Read published.log, cut a torn frame off its end, and open it for appending
+    void loadPublished() {
+        std::string path = publishLogPath();
+        std::vector<char> data;
+        indexExisted = RecordCodec::readFile(path, data);
+        
+        const char* begin = data.data();
+        const char* end = begin + data.size();
+        const char* p = begin;
+        RecordCodec::FrameStatus status = RecordCodec::FRAME_OK;
+        while (p < end) {
+            const char* payload;
+            size_t size;
+            status = RecordCodec::getFrame(p, end, payload, size);
+            if (status != RecordCodec::FRAME_OK) break;
+            
+            RecordCodec::Reader reader(payload, size);
+            std::string hash = reader.string();
+            std::string group = reader.string();
+            if (reader.ok()) {
+                publishedIn[hash].insert(group);
+            }
+        }
+        if (p < end) {
+            std::cerr << "[STORE] Ignoring " << (end - p) << " damaged bytes at the end of " << path << std::endl;
+            if (status == RecordCodec::FRAME_INCOMPLETE) RecordCodec::truncateFile(path, p - begin);
+        }
+        
+        publishLog.open(path, std::ios::binary | std::ios::app);
+    }
+    
+    std::string blobPathFor(const std::string& hash) const {
+        return storeDir + "/" + hash;
+    }
+    
+    static bool blobSize(const std::string& path, uint64_t& size) {
+#ifdef _WIN32
+        struct _stat64 st;
+        if (_stat64(path.c_str(), &st) != 0) return false;
+#else
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+#endif
+        size = st.st_size;
+        return true;
+    }
+    
+    static void createDirectory(const std::string& dir) {
+        #ifdef _WIN32
+        _mkdir(dir.c_str());
+        #else
+        mkdir(dir.c_str(), 0755);
+        #endif
+    }
+};
+
+#endif // FILE_STORE_H
@@ -6,17 +6,41 @@
 #include <string>
 #include <mutex>
 #include <cstdint>
+#include <algorithm>
+#include <ctime>
+#include "../utils/protocol.h"
 
+#define TRANSFER_REORDER_WINDOW 64  // Chunks past the contiguous offset we can track
+#define TRANSFER_RESUME_TIMEOUT 600 // Seconds an idle transfer is kept for the sender to resume
+
+// Result of accepting a chunk into a streaming transfer
+enum ChunkResult {
+    CHUNK_ACCEPTED,
+    CHUNK_DUPLICATE,    // Already received, do not forward again
+    CHUNK_REJECTED      // Bad offset/size or outside the reorder window
+};
+
+// Byte range of a file uploaded in order over one stream
+struct FileStripe {
+    uint64_t end;
+    uint64_t contiguousOffset;  // Every byte of the stripe below this offset has arrived
+    uint64_t reorderMask;       // Bit i: chunk (contiguousOffset / FILE_CHUNK_SIZE + 1 + i) arrived
+};
+
+// Streaming relay state: chunks are forwarded as they arrive, so only
+// offsets and counters are kept - memory per transfer does not depend on file size
 struct FileTransfer {
     std::string filename;
-    uint32_t fileSize;
-    uint32_t receivedSize;
-    std::vector<char> data;
+    uint64_t fileSize;
+    uint64_t receivedSize;      // Total unique bytes received
+    std::vector<FileStripe> stripes; // One per upload stream, in file order
     std::string sender;
     std::string recipient; // Can be username or topic/group name
     bool isComplete;
+    time_t lastActivity;
+    uint32_t consumedChunks;    // Chunks stored or acknowledged by the recipient, not yet credited back
     
-    FileTransfer() : fileSize(0), receivedSize(0), isComplete(false) {}
+    FileTransfer() : fileSize(0), receivedSize(0), isComplete(false), lastActivity(0), consumedChunks(0) {}
 };
 
 class FileTransferManager {
@@ -28,42 +52,85 @@ public:
     FileTransferManager() = default;
     ~FileTransferManager() = default;
 
-    // Start a new file transfer
+    // Start a new file transfer, split into one stripe per upload stream
     bool startTransfer(uint32_t messageId, const std::string& filename, 
-                       uint32_t fileSize, const std::string& sender, 
-                       const std::string& recipient) {
+                       uint64_t fileSize, const std::string& sender, 
+                       const std::string& recipient, uint32_t streams = 1) {
         std::lock_guard<std::mutex> lock(mtx);
         
         FileTransfer ft;
         ft.filename = filename;
         ft.fileSize = fileSize;
-        ft.receivedSize = 0;
+        for (uint32_t i = 0; i < streams; i++) {
+            FileStripe stripe;
+            stripeRange(fileSize, streams, i, stripe.contiguousOffset, stripe.end);
+            stripe.reorderMask = 0;
+            ft.stripes.push_back(stripe);
+        }
         ft.sender = sender;
         ft.recipient = recipient;
-        ft.isComplete = false;
+        ft.isComplete = (fileSize == 0);
+        ft.lastActivity = time(nullptr);
         
         activeTransfers[messageId] = ft;
         return true;
     }
 
-    // Add data chunk to transfer
-    bool addChunk(uint32_t messageId, const std::vector<char>& chunk) {
+    // Record a chunk at the given byte offset without storing its data
+    // Chunks must start on a FILE_CHUNK_SIZE boundary and all but the last must be full
+    ChunkResult addChunk(uint32_t messageId, uint64_t offset, uint32_t size) {
         std::lock_guard<std::mutex> lock(mtx);
         
         auto it = activeTransfers.find(messageId);
         if (it == activeTransfers.end()) {
-            return false;
+            return CHUNK_REJECTED;
         }
         
         FileTransfer& ft = it->second;
-        ft.data.insert(ft.data.end(), chunk.begin(), chunk.end());
-        ft.receivedSize += chunk.size();
+        ft.lastActivity = time(nullptr);
+        if (offset % FILE_CHUNK_SIZE != 0 || offset >= ft.fileSize ||
+            size != std::min((uint64_t)FILE_CHUNK_SIZE, ft.fileSize - offset)) {
+            return CHUNK_REJECTED;
+        }
+        
+        FileStripe* stripe = nullptr;
+        for (FileStripe& s : ft.stripes) {
+            if (offset < s.end) {
+                stripe = &s;
+                break;
+            }
+        }
+        if (!stripe || offset < stripe->contiguousOffset) {
+            return CHUNK_DUPLICATE;
+        }
+        
+        if (offset > stripe->contiguousOffset) {
+            // Out of order: remember it in the window
+            uint64_t slot = (offset - stripe->contiguousOffset) / FILE_CHUNK_SIZE - 1;
+            if (slot >= TRANSFER_REORDER_WINDOW) {
+                return CHUNK_REJECTED;
+            }
+            uint64_t bit = 1ULL << slot;
+            if (stripe->reorderMask & bit) {
+                return CHUNK_DUPLICATE;
+            }
+            stripe->reorderMask |= bit;
+        } else {
+            // Fills the gap: advance past it and any buffered successors
+            stripe->contiguousOffset += size;
+            while (stripe->reorderMask & 1) {
+                stripe->reorderMask >>= 1;
+                stripe->contiguousOffset += std::min((uint64_t)FILE_CHUNK_SIZE, stripe->end - stripe->contiguousOffset);
+            }
+            stripe->reorderMask >>= 1;
+        }
         
+        ft.receivedSize += size;
         if (ft.receivedSize >= ft.fileSize) {
             ft.isComplete = true;
         }
         
-        return true;
+        return CHUNK_ACCEPTED;
     }
 
     // Get transfer info
@@ -111,6 +178,70 @@ public:
         return activeTransfers.erase(messageId) > 0;
     }
 
+    // Fill the resume state of a transfer; 'stripes' gets every stripe after the first
+    // Each stream has its own credit window
+    bool getStatus(uint32_t messageId, TransferStatus& status, std::vector<StripeStatus>& stripes) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = activeTransfers.find(messageId);
+        if (it == activeTransfers.end()) {
+            return false;
+        }
+        const FileTransfer& ft = it->second;
+        status.accepted = 1;
+        status.fileSize = ft.fileSize;
+        status.contiguousOffset = ft.stripes[0].contiguousOffset;
+        status.reorderMask = ft.stripes[0].reorderMask;
+        status.credits = FILE_CREDIT_WINDOW * ft.stripes.size();
+        status.stripes = ft.stripes.size();
+        
+        stripes.clear();
+        for (size_t i = 1; i < ft.stripes.size(); i++) {
+            StripeStatus stripe;
+            stripe.contiguousOffset = ft.stripes[i].contiguousOffset;
+            stripe.reorderMask = ft.stripes[i].reorderMask;
+            stripes.push_back(stripe);
+        }
+        it->second.consumedChunks = 0; // Uploader starts over with a full window
+        return true;
+    }
+    
+    // Count chunks that left the pipeline (stored, or acknowledged by the recipient)
+    // Returns the credits to grant the uploader now, in FILE_CREDIT_BATCH steps
+    uint32_t consumeChunks(uint32_t messageId, uint32_t count) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = activeTransfers.find(messageId);
+        if (it == activeTransfers.end()) {
+            return 0;
+        }
+        
+        it->second.consumedChunks += count;
+        if (it->second.consumedChunks < FILE_CREDIT_BATCH) {
+            return 0;
+        }
+        uint32_t grant = it->second.consumedChunks;
+        it->second.consumedChunks = 0;
+        return grant;
+    }
+    
+    // Drop transfers nobody has sent a chunk to for maxIdle seconds, returns their ids
+    std::vector<uint32_t> expireIdle(time_t maxIdle = TRANSFER_RESUME_TIMEOUT) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        time_t now = time(nullptr);
+        std::vector<uint32_t> removed;
+        for (auto it = activeTransfers.begin(); it != activeTransfers.end(); ) {
+            if (now - it->second.lastActivity > maxIdle) {
+                removed.push_back(it->first);
+                it = activeTransfers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return removed;
+    }
+    
     // Get sender of transfer
     std::string getSender(uint32_t messageId) {
         std::lock_guard<std::mutex> lock(mtx);
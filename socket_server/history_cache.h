@@ -0,0 +1,158 @@
+#ifndef HISTORY_CACHE_H
+#define HISTORY_CACHE_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
+#include "../utils/database_manager.h"
+
+#define HISTORY_CACHE_SIZE 200          // Messages kept per conversation
+#define HISTORY_CACHE_MAX_TOPICS 1024   // Conversations kept before evicting the least recently used
+
+// Bounded ring of the most recent messages of each group/DM conversation.
+// Rings are filled on publish and warmed from the database on first miss,
+// so "last N messages" requests are answered without touching disk.
+class HistoryCache {
+private:
+    struct Ring {
+        std::vector<ChatMessage> slots;
+        size_t head;   // Next slot to write
+        size_t count;  // Valid messages
+        bool warm;     // Holds the conversation's latest messages from disk
+        std::list<std::string>::iterator lruPos;
+        
+        Ring() : head(0), count(0), warm(false) {}
+    };
+    
+    std::map<std::string, Ring> rings;  // conversation key -> ring
+    std::list<std::string> lru;         // Most recently used first
+    size_t ringSize;
+    size_t maxTopics;
+    uint64_t hits;
+    uint64_t misses;
+    mutable std::mutex mtx;
+
+public:
+    HistoryCache(size_t ringSize = HISTORY_CACHE_SIZE, size_t maxTopics = HISTORY_CACHE_MAX_TOPICS)
+        : ringSize(ringSize), maxTopics(maxTopics), hits(0), misses(0) {}
+    ~HistoryCache() = default;
+    
+    // Append a newly published message
+    void add(const std::string& key, const ChatMessage& msg) {
+        std::lock_guard<std::mutex> lock(mtx);
+        push(touch(key), msg);
+    }
+    
+    // Fill a conversation's ring with its latest messages from disk (oldest first)
+    void warm(const std::string& key, const std::vector<ChatMessage>& messages) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        Ring& ring = touch(key);
+        ring.slots.clear();
+        ring.head = 0;
+        ring.count = 0;
+        size_t start = messages.size() > ringSize ? messages.size() - ringSize : 0;
+        for (size_t i = start; i < messages.size(); i++) {
+            push(ring, messages[i]);
+        }
+        ring.warm = true;
+    }
+    
+    // Get the last 'limit' messages of a conversation (oldest first)
+    // Messages older than 'cutoff' have expired from the log and are dropped first
+    // Returns false on a miss; the caller should warm the ring from disk
+    bool getRecent(const std::string& key, size_t limit, std::vector<ChatMessage>& out, uint64_t cutoff = 0) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = rings.find(key);
+        if (it != rings.end()) {
+            expire(it->second, cutoff);
+        }
+        // Without warming, the ring is only complete if it already holds 'limit' messages
+        if (it == rings.end() || limit > ringSize ||
+            (!it->second.warm && it->second.count < limit)) {
+            misses++;
+            return false;
+        }
+        
+        Ring& ring = it->second;
+        lru.splice(lru.begin(), lru, ring.lruPos);
+        
+        size_t n = std::min(limit, ring.count);
+        out.reserve(out.size() + n);
+        size_t index = (ring.head + ringSize - n) % ringSize;
+        for (size_t i = 0; i < n; i++) {
+            out.push_back(ring.slots[index]);
+            index = (index + 1) % ringSize;
+        }
+        hits++;
+        return true;
+    }
+    
+    // Get ring capacity (largest request that can be served from memory)
+    size_t getRingSize() const { return ringSize; }
+    
+    // Get hit/miss counters
+    uint64_t getHits() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return hits;
+    }
+    
+    uint64_t getMisses() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return misses;
+    }
+    
+    // Get cached conversation count
+    size_t getTopicCount() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return rings.size();
+    }
+
+private:
+    // Find or create a ring and mark it most recently used
+    Ring& touch(const std::string& key) {
+        auto it = rings.find(key);
+        if (it != rings.end()) {
+            lru.splice(lru.begin(), lru, it->second.lruPos);
+            return it->second;
+        }
+        
+        if (rings.size() >= maxTopics && !lru.empty()) {
+            rings.erase(lru.back());
+            lru.pop_back();
+        }
+        
+        lru.push_front(key);
+        Ring& ring = rings[key];
+        ring.lruPos = lru.begin();
+        return ring;
+    }
+    
+    // Forget the oldest messages while they are older than 'cutoff'; a warm ring
+    // stays complete, as the log no longer returns them either
+    void expire(Ring& ring, uint64_t cutoff) {
+        while (ring.count > 0 && ring.slots[(ring.head + ringSize - ring.count) % ringSize].timestamp < cutoff) {
+            ring.count--;
+        }
+    }
+    
+    // Slots grow on demand up to ringSize, then the oldest is overwritten
+    void push(Ring& ring, const ChatMessage& msg) {
+        if (ring.slots.size() < ringSize) {
+            ring.slots.push_back(msg);
+        } else {
+            ring.slots[ring.head] = msg;
+        }
+        ring.head = (ring.head + 1) % ringSize;
+        if (ring.count < ringSize) {
+            ring.count++;
+        }
+    }
+};
+
+#endif // HISTORY_CACHE_H
@@ -8,19 +8,50 @@
 #include "client_manager.h"
 #include "topic_manager.h"
 #include "file_transfer_manager.h"
+#include "presence_manager.h"
+#include "topic_sequencer.h"
+#include "history_cache.h"
+#include "offline_spool.h"
+#include "file_store.h"
 #include <iostream>
 #include <vector>
+#include <mutex>
+
+// Outcome of relaying a file chunk without reading it into user space
+enum RelayResult {
+    RELAY_UNSUPPORTED,  // Not a relayable chunk - payload left unread for the regular path
+    RELAY_DONE,         // Payload consumed
+    RELAY_FAILED        // Sender connection broke mid-chunk
+};
 
 class MessageHandler {
 private:
+    // A group upload whose last chunk has arrived, waiting to be hashed and announced
+    struct CompletedUpload {
+        uint32_t transferId;
+        std::string filename;
+        uint64_t fileSize;
+        std::string sender;
+        std::string topic;
+    };
+    
     ClientManager& clientManager;
     TopicManager& topicManager;
     FileTransferManager& fileTransferManager;
+    PresenceManager& presenceManager;
+    TopicSequencer& topicSequencer;
+    HistoryCache& historyCache;
     DatabaseManager* dbManager;
+    OfflineSpool* offlineSpool;
+    FileStore* fileStore;
+    std::map<SocketType, std::vector<CompletedUpload>> completedUploads; // By the connection that finishes them
 
 public:
-    MessageHandler(ClientManager& cm, TopicManager& tm, FileTransferManager& ftm, DatabaseManager* db = nullptr)
-        : clientManager(cm), topicManager(tm), fileTransferManager(ftm), dbManager(db) {}
+    MessageHandler(ClientManager& cm, TopicManager& tm, FileTransferManager& ftm, PresenceManager& pm,
+                   TopicSequencer& ts, HistoryCache& hc, DatabaseManager* db = nullptr,
+                   OfflineSpool* spool = nullptr, FileStore* store = nullptr)
+        : clientManager(cm), topicManager(tm), fileTransferManager(ftm), presenceManager(pm),
+          topicSequencer(ts), historyCache(hc), dbManager(db), offlineSpool(spool), fileStore(store) {}
 
     // Handle login message
     void handleLogin(SocketType clientSocket, PacketHeader* header) {
@@ -37,23 +68,41 @@ public:
             
             NetworkUtils::sendAck(clientSocket, "Login successful");
             
-            // Broadcast user online to all clients
+            // Notify users who share a group or DM with this user
             broadcastUserStatus(username, true);
             
-            // Send current online users list to this client
+            // Send the online users this client may see
             sendUserList(clientSocket);
             
             // Send groups list to this client and auto-subscribe to joined groups
             sendGroupListAndSubscribe(clientSocket, username);
+            
+            // Deliver what arrived while the user was offline
+            drainOfflineSpool(clientSocket, username);
         } else {
             NetworkUtils::sendError(clientSocket, "Username already taken");
         }
     }
 
     // Handle subscribe message
-    void handleSubscribe(SocketType clientSocket, PacketHeader* header) {
+    // Optional payload: uint32 sequence the client has seen up to; the gap after it is replayed
+    void handleSubscribe(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload) {
         std::string topic(header->topic);
         std::string username = clientManager.getUsername(clientSocket);
+        bool resume = payload.size() >= sizeof(uint32_t);
+        uint32_t resumeFrom = resume ? *(uint32_t*)payload.data() : 0;
+        
+        if (StringUtils::isDMTopic(topic)) {
+            // DMs are delivered directly, subscribing only replays what was missed
+            if (!isDMParticipant(topic, username)) {
+                NetworkUtils::sendError(clientSocket, "Not a participant of " + topic);
+                return;
+            }
+            if (resume) {
+                replayTopic(clientSocket, topic, username, resumeFrom);
+            }
+            return;
+        }
         
         if (topicManager.subscribe(topic, username)) {
             std::cout << "[SUBSCRIBE] User '" << username << "' subscribed to '" << topic << "'" << std::endl;
@@ -62,6 +111,7 @@ public:
             if (dbManager && !StringUtils::isDMTopic(topic)) {
                 bool isNewGroup = dbManager->saveGroup(topic, username);
                 dbManager->addGroupMember(topic, username);
+                introducePeers(username, presenceManager.addGroupMember(topic, username));
                 
                 // Only broadcast if it's a NEW group
                 if (isNewGroup) {
@@ -70,6 +120,10 @@ public:
             }
             
             NetworkUtils::sendAck(clientSocket, "Subscribed to " + topic);
+            
+            if (resume) {
+                replayTopic(clientSocket, topic, username, resumeFrom);
+            }
         }
     }
 
@@ -84,6 +138,9 @@ public:
         if (dbManager && !StringUtils::isDMTopic(topic)) {
             dbManager->removeGroupMember(topic, username);
         }
+        if (!StringUtils::isDMTopic(topic)) {
+            retirePeers(username, presenceManager.removeGroupMember(topic, username));
+        }
         
         std::cout << "[UNSUBSCRIBE] User '" << username << "' unsubscribed from '" << topic << "'" << std::endl;
         NetworkUtils::sendAck(clientSocket, "Unsubscribed from " + topic);
@@ -95,24 +152,28 @@ public:
         std::string sender(header->sender);
         std::string message(payload.begin(), payload.end());
         
+        if (StringUtils::isDMTopic(topic) && !isDMParticipant(topic, clientManager.getUsername(clientSocket))) {
+            NetworkUtils::sendError(clientSocket, "Not a participant of " + topic);
+            return;
+        }
+        
         std::cout << "[PUBLISH] User '" << sender << "' published to '" << topic << "'" << std::endl;
         
-        // Save message to database
-        if (dbManager) {
-            if (StringUtils::isDMTopic(topic)) {
-                std::string recipient = StringUtils::extractRecipient(topic, sender);
-                dbManager->saveMessage(sender, recipient, message, false);
-            } else {
-                dbManager->saveMessage(sender, topic, message, true);
-            }
+        // Stamp the per-topic sequence number before storing and forwarding
+        header->messageId = recordMessage(topic, sender, message);
+        if (header->messageId) {
+            header->flags |= FLAG_SEQUENCED;
         }
         
         if (StringUtils::isDMTopic(topic)) {
             // Direct message - send to recipient only
             std::string recipient = StringUtils::extractRecipient(topic, sender);
+            openDirectMessage(topic, sender, recipient);
             SocketType recipientSocket = clientManager.getSocket(recipient);
             if (recipientSocket != SOCKET_INVALID) {
                 NetworkUtils::forwardMessage(recipientSocket, header, payload);
+            } else if (offlineSpool && header->messageId) {
+                offlineSpool->recordMissedDM(recipient, topic, header->messageId);
             }
         } else {
             // Group message - send to all subscribers
@@ -136,19 +197,80 @@ public:
         std::string sender(header->sender);
         
         // Extract filename and size from payload
-        uint32_t filenameLen = *(uint32_t*)payload.data();
-        std::string filename(payload.data() + 4, filenameLen);
-        uint32_t fileSize = *(uint32_t*)(payload.data() + 4 + filenameLen);
+        std::string filename;
+        uint64_t fileSize = 0;
+        uint32_t streams = 1;
+        std::string hash;
+        if (!NetworkUtils::parseFileMetadata(payload, filename, fileSize, streams, hash) ||
+            streams == 0 || streams > FILE_MAX_STREAMS) {
+            sendTransferStatus(clientSocket, header->messageId, false);
+            NetworkUtils::sendError(clientSocket, "Invalid file metadata");
+            return;
+        }
+        if (StringUtils::isDMTopic(topic) && !isDMParticipant(topic, clientManager.getUsername(clientSocket))) {
+            sendTransferStatus(clientSocket, header->messageId, false);
+            NetworkUtils::sendError(clientSocket, "Not a participant of " + topic);
+            return;
+        }
+        
+        expireIdleTransfers();
+        
+        // Same transfer id again: the sender is resuming after a reconnect
+        FileTransfer* existing = fileTransferManager.getTransfer(header->messageId);
+        if (existing) {
+            if (existing->sender != sender || existing->recipient != topic ||
+                existing->filename != filename || existing->fileSize != fileSize) {
+                sendTransferStatus(clientSocket, header->messageId, false);
+                NetworkUtils::sendError(clientSocket, "Transfer id in use");
+                return;
+            }
+            
+            std::cout << "[FILE] User '" << sender << "' resuming '" << filename << "' with "
+                      << existing->receivedSize << "/" << fileSize << " bytes received" << std::endl;
+            sendTransferStatus(clientSocket, header->messageId, true);
+            return;
+        }
+        
+        // Content the sender can already read from the store is announced straight away, no bytes are uploaded
+        if (!StringUtils::isDMTopic(topic) && fileStore && !hash.empty() &&
+            fileStore->findBlob(hash, fileSize, [&](const std::string& group) { return isGroupMember(group, sender); })) {
+            std::cout << "[DEDUP] '" << filename << "' from " << sender << " already stored as " << hash.substr(0, 12)
+                      << " (hits " << fileStore->getDedupHits() << ", misses " << fileStore->getDedupMisses()
+                      << ", " << fileStore->getDedupBytesSaved() << " bytes saved)" << std::endl;
+            sendStoredStatus(clientSocket, header->messageId, fileSize);
+            announceStoredFile(clientSocket, filename, fileSize, sender, topic, hash);
+            return;
+        }
         
         std::cout << "[FILE] User '" << sender << "' sending file '" << filename 
-                  << "' (" << fileSize << " bytes) to '" << topic << "'" << std::endl;
+                  << "' (" << fileSize << " bytes) to '" << topic << "'";
+        if (streams > 1) {
+            std::cout << " over " << streams << " streams";
+        }
+        std::cout << std::endl;
         
         // Start file transfer tracking
-        fileTransferManager.startTransfer(header->messageId, filename, fileSize, sender, topic);
+        fileTransferManager.startTransfer(header->messageId, filename, fileSize, sender, topic, streams);
+        
+        // Group files are uploaded once into the store; members pull them when notified
+        if (!StringUtils::isDMTopic(topic) && fileStore) {
+            if (!fileStore->beginUpload(header->messageId)) {
+                fileTransferManager.removeTransfer(header->messageId);
+                sendTransferStatus(clientSocket, header->messageId, false);
+                NetworkUtils::sendError(clientSocket, "Cannot store file");
+                return;
+            }
+            sendTransferStatus(clientSocket, header->messageId, true);
+            if (fileSize == 0) {
+                queueStoredFile(clientSocket, header->messageId);
+            }
+            return;
+        }
         
         // Forward file metadata to recipients
         if (StringUtils::isDMTopic(topic)) {
             std::string recipient = StringUtils::extractRecipient(topic, sender);
+            openDirectMessage(topic, sender, recipient);
             SocketType recipientSocket = clientManager.getSocket(recipient);
             if (recipientSocket != SOCKET_INVALID) {
                 NetworkUtils::forwardMessage(recipientSocket, header, payload);
@@ -165,34 +287,45 @@ public:
             }
         }
         
-        NetworkUtils::sendAck(clientSocket, "Ready to receive file");
+        sendTransferStatus(clientSocket, header->messageId, true);
     }
 
     // Handle file data chunk
     void handleFileData(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload) {
         uint32_t msgId = header->messageId;
         
-        if (!fileTransferManager.exists(msgId)) {
-            NetworkUtils::sendError(clientSocket, "No active file transfer");
+        if (!acceptChunk(clientSocket, header, payload.size())) {
             return;
         }
         
-        fileTransferManager.addChunk(msgId, payload);
-        
-        float progress = fileTransferManager.getProgress(msgId);
-        std::cout << "[FILE DATA] Progress: " << (int)(progress * 100) << "%" << std::endl;
+        if (fileStore && fileStore->isUploading(msgId)) {
+            if (!fileStore->writeChunk(msgId, header->offset, payload.data(), payload.size())) {
+                fileTransferManager.removeTransfer(msgId);
+                fileStore->abortUpload(msgId);
+                NetworkUtils::sendError(clientSocket, "Cannot store file");
+            } else if (fileTransferManager.isComplete(msgId)) {
+                queueStoredFile(clientSocket, msgId);
+            } else {
+                grantCredits(msgId, 1);
+            }
+            return;
+        }
         
         // Forward chunk to recipients
         std::string topic = fileTransferManager.getRecipient(msgId);
         std::string sender = fileTransferManager.getSender(msgId);
         
         if (StringUtils::isDMTopic(topic)) {
+            // The recipient returns credit with MSG_FILE_CREDIT once the chunk is written
             std::string recipient = StringUtils::extractRecipient(topic, sender);
             SocketType recipientSocket = clientManager.getSocket(recipient);
             if (recipientSocket != SOCKET_INVALID) {
                 NetworkUtils::forwardMessage(recipientSocket, header, payload);
+            } else {
+                grantCredits(msgId, 1);
             }
         } else {
+            grantCredits(msgId, 1);
             auto subscribers = topicManager.getSubscribers(topic);
             for (const std::string& subscriber : subscribers) {
                 if (subscriber != sender) {
@@ -204,13 +337,77 @@ public:
             }
         }
         
-        // Cleanup if complete
-        if (fileTransferManager.isComplete(msgId)) {
-            std::cout << "[FILE] Transfer complete" << std::endl;
-            fileTransferManager.removeTransfer(msgId);
-            NetworkUtils::sendAck(clientSocket, "File transfer complete");
+        finishRelayedChunk(clientSocket, msgId);
+    }
+
+#ifdef __linux__
+    // Relay a DM file chunk socket -> pipe -> socket with splice(); only the header
+    // is parsed here. The payload is pulled into the pipe before anything is sent,
+    // so a sender dropping mid-chunk never leaves the recipient with a partial frame.
+    RelayResult spliceFileData(SocketType clientSocket, PacketHeader* header,
+                               NetworkUtils::SplicePipe& relayPipe, std::mutex& brokerMtx) {
+        uint32_t msgId = header->messageId;
+        size_t length = header->payloadLength;
+        {
+            std::lock_guard<std::mutex> lock(brokerMtx);
+            if (!relayPipe.valid() || length == 0 || length > FILE_CHUNK_SIZE ||
+                dmRecipientSocket(clientSocket, msgId) == SOCKET_INVALID) {
+                return RELAY_UNSUPPORTED;
+            }
         }
-        // Don't send ACK for each chunk - only when complete
+        
+        if (!NetworkUtils::spliceIn(clientSocket, relayPipe, length)) {
+            return RELAY_FAILED;
+        }
+        
+        std::lock_guard<std::mutex> lock(brokerMtx);
+        if (!acceptChunk(clientSocket, header, length)) {
+            NetworkUtils::discardPipe(relayPipe, length);
+            return RELAY_DONE;
+        }
+        
+        // The recipient may have left while the payload was arriving
+        SocketType recipientSocket = dmRecipientSocket(clientSocket, msgId);
+        if (recipientSocket != SOCKET_INVALID) {
+            NetworkUtils::spliceOut(relayPipe, recipientSocket, header, length);
+        } else {
+            NetworkUtils::discardPipe(relayPipe, length);
+            grantCredits(msgId, 1);
+        }
+        
+        finishRelayedChunk(clientSocket, msgId);
+        return RELAY_DONE;
+    }
+#endif
+
+    // Handle an extra connection carrying one stripe of a parallel upload
+    void handleAttachStream(SocketType clientSocket, PacketHeader* header) {
+        std::string username(header->sender);
+        
+        if (!clientManager.getUsername(clientSocket).empty() || !clientManager.exists(username) ||
+            fileTransferManager.getSender(header->messageId) != username) {
+            NetworkUtils::sendError(clientSocket, "No active file transfer");
+            return;
+        }
+        
+        clientManager.addStream(clientSocket, username);
+        NetworkUtils::sendAck(clientSocket, "Stream attached");
+    }
+    
+    // Handle a DM recipient acknowledging relayed chunks - pass the credit to the uploader
+    void handleFileCredit(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload) {
+        if (payload.size() < sizeof(uint32_t)) return;
+        
+        uint32_t msgId = header->messageId;
+        std::string topic = fileTransferManager.getRecipient(msgId);
+        std::string sender = fileTransferManager.getSender(msgId);
+        if (!StringUtils::isDMTopic(topic) ||
+            StringUtils::extractRecipient(topic, sender) != clientManager.getUsername(clientSocket)) {
+            return; // Not a transfer relayed to this user
+        }
+        
+        uint32_t count = *(uint32_t*)payload.data();
+        grantCredits(msgId, std::min(count, (uint32_t)FILE_CREDIT_WINDOW));
     }
 
     // Handle client disconnect
@@ -218,6 +415,9 @@ public:
         std::string username = clientManager.removeClient(clientSocket);
         
         if (!username.empty()) {
+            saveReadCursors(username);
+            // Unfinished uploads are kept for a while so the sender can resume them
+            expireIdleTransfers();
             topicManager.removeUserFromAllTopics(username);
             
             // Update database
@@ -227,7 +427,7 @@ public:
             
             std::cout << "[LOGOUT] User '" << username << "' disconnected" << std::endl;
             
-            // Broadcast user offline to all clients
+            // Notify users who share a group or DM with this user
             broadcastUserStatus(username, false);
         }
         
@@ -246,15 +446,16 @@ public:
         std::string topic(header->topic);
         std::string username = clientManager.getUsername(clientSocket);
         
-        std::vector<ChatMessage> history;
-        
         if (StringUtils::isDMTopic(topic)) {
-            std::string otherUser = StringUtils::extractRecipient(topic, username);
-            history = dbManager->getDirectMessageHistory(username, otherUser, 50);
-        } else {
-            history = dbManager->getMessageHistory(topic, 50);
+            if (!isDMParticipant(topic, username)) {
+                NetworkUtils::sendError(clientSocket, "Not a participant of " + topic);
+                return;
+            }
+            openDirectMessage(topic, username, StringUtils::extractRecipient(topic, username));
         }
         
+        std::vector<ChatMessage> history = getRecentHistory(topic, username, 50);
+        
         // Send history messages
         for (const auto& msg : history) {
             PacketHeader histHeader = {0};
@@ -274,9 +475,61 @@ public:
             NetworkUtils::forwardMessage(clientSocket, &histHeader, histPayload);
         }
         
+        std::cout << "[HISTORY] Sent " << history.size() << " messages of '" << topic << "' to " << username
+                  << " (cache hits " << historyCache.getHits() << ", misses " << historyCache.getMisses() << ")" << std::endl;
+        
         NetworkUtils::sendAck(clientSocket, "History sent");
     }
     
+    // Handle paged history request - replies with a single MSG_HISTORY_BATCH frame
+    void handleRequestHistoryPage(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload) {
+        if (!dbManager) return;
+        
+        if (payload.size() < sizeof(HistoryQuery)) {
+            NetworkUtils::sendError(clientSocket, "Invalid history query");
+            return;
+        }
+        
+        HistoryQuery query;
+        memcpy(&query, payload.data(), sizeof(query));
+        size_t limit = (query.limit == 0 || query.limit > HISTORY_PAGE_MAX) ? HISTORY_PAGE_MAX : query.limit;
+        
+        std::string topic(header->topic);
+        std::string username = clientManager.getUsername(clientSocket);
+        bool isDM = StringUtils::isDMTopic(topic);
+        std::string otherUser;
+        
+        if (isDM) {
+            if (!isDMParticipant(topic, username)) {
+                NetworkUtils::sendError(clientSocket, "Not a participant of " + topic);
+                return;
+            }
+            otherUser = StringUtils::extractRecipient(topic, username);
+            openDirectMessage(topic, username, otherUser);
+        }
+        
+        std::vector<ChatMessage> page;
+        bool hasMore = false;
+        
+        if (!query.beforeId && !query.afterId && !query.fromTime && !query.toTime) {
+            // Latest page - served from the history cache, topic sequence tells if there is more
+            page = getRecentHistory(topic, username, limit);
+            loadTopicSequence(topic, username);
+            hasMore = topicSequencer.getLastSeq(topic) > page.size();
+        } else if (isDM) {
+            page = dbManager->getDirectMessagePage(username, otherUser, query.beforeId, query.afterId,
+                                                   query.fromTime, query.toTime, limit, &hasMore);
+        } else {
+            page = dbManager->getMessagePage(topic, query.beforeId, query.afterId,
+                                             query.fromTime, query.toTime, limit, &hasMore);
+        }
+        
+        sendHistoryBatch(clientSocket, topic, page, hasMore);
+        
+        std::cout << "[HISTORY] Sent page of " << page.size() << " messages of '" << topic << "' to " << username
+                  << (hasMore ? " (more available)" : "") << std::endl;
+    }
+    
     // Handle game message - just forward to recipient
     void handleGameMessage(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload) {
         std::string sender(header->sender);
@@ -291,9 +544,246 @@ public:
         }
     }
 
+    // Send messages of a topic with sequence > afterSeq, from memory or the database
+    // If maxCount is set, only the newest maxCount missed messages are sent
+    size_t replayTopic(SocketType clientSocket, const std::string& topic,
+                       const std::string& username, uint32_t afterSeq, uint32_t maxCount = 0) {
+        loadTopicSequence(topic, username);
+        
+        uint32_t lastSeq = topicSequencer.getLastSeq(topic);
+        if (afterSeq >= lastSeq) return 0;
+        if (maxCount && lastSeq - afterSeq > maxCount) {
+            afterSeq = lastSeq - maxCount;
+        }
+        
+        std::vector<SequencedMessage> missed;
+        bool fromMemory = topicSequencer.getSince(topic, afterSeq, missed, expiryCutoff(topic, username));
+        
+        if (!fromMemory && dbManager) {
+            // Tail no longer covers the gap - read exactly the missed messages from disk
+            int gap = lastSeq - afterSeq;
+            std::vector<ChatMessage> stored;
+            if (StringUtils::isDMTopic(topic)) {
+                std::string otherUser = StringUtils::extractRecipient(topic, username);
+                stored = dbManager->getDirectMessageHistory(username, otherUser, gap);
+            } else {
+                stored = dbManager->getMessageHistory(topic, gap);
+            }
+            
+            // The log numbers what it reads, so gaps (damaged or expired records) keep their numbers
+            for (const auto& msg : stored) {
+                if (msg.seq <= afterSeq) continue;
+                SequencedMessage m;
+                m.seq = msg.seq;
+                m.sender = msg.sender;
+                m.content = msg.content;
+                m.timestamp = msg.timestamp;
+                m.isFile = msg.isFile;
+                m.filename = msg.filename;
+                missed.push_back(m);
+            }
+        }
+        
+        // Send in batch frames of up to HISTORY_PAGE_MAX rows, row id = sequence
+        std::vector<ChatMessage> batch;
+        for (size_t i = 0; i < missed.size(); i++) {
+            ChatMessage row = {0};
+            row.id = missed[i].seq;
+            row.sender = missed[i].sender;
+            row.content = missed[i].content;
+            row.timestamp = missed[i].timestamp;
+            row.isFile = missed[i].isFile;
+            row.filename = missed[i].filename;
+            batch.push_back(row);
+            
+            if (batch.size() == HISTORY_PAGE_MAX || i + 1 == missed.size()) {
+                sendHistoryBatch(clientSocket, topic, batch, i + 1 < missed.size(), MSG_MESSAGE_BATCH);
+                batch.clear();
+            }
+        }
+        
+        std::cout << "[REPLAY] Sent " << missed.size() << " missed messages of '" << topic
+                  << "' to " << username << " (" << (fromMemory ? "memory" : "disk") << ")" << std::endl;
+        return missed.size();
+    }
+    
+    // Deliver spooled DMs and unread group messages in batches after login
+    void drainOfflineSpool(SocketType clientSocket, const std::string& username) {
+        if (!offlineSpool) return;
+        
+        auto cursors = offlineSpool->drain(username);
+        auto all = cursors.find(SPOOL_ALL_DMS);
+        if (all != cursors.end()) {
+            // The spool overflowed: replay every DM conversation, from the start where it kept no cursor
+            cursors.erase(all);
+            if (dbManager) {
+                for (const std::string& peer : dbManager->getDirectPeers(username)) {
+                    cursors.insert(std::make_pair(StringUtils::createDMTopic(username, peer), 0u));
+                }
+            }
+        }
+        size_t delivered = 0;
+        for (const auto& c : cursors) {
+            bool member = StringUtils::isDMTopic(c.first) ? isDMParticipant(c.first, username)
+                                                          : topicManager.isSubscribed(c.first, username);
+            if (member) {
+                delivered += replayTopic(clientSocket, c.first, username, c.second, SPOOL_MAX_BACKLOG);
+            }
+        }
+        
+        if (delivered > 0) {
+            std::cout << "[SPOOL] Delivered " << delivered << " offline messages to " << username << std::endl;
+        }
+    }
+    
+    // Serve a ranged read of a stored file as MSG_FILE_DATA chunks via sendfile
+    // The broker lock covers only the checks; chunks go out under the client's
+    // send lock, so a slow reader stalls nobody else and other packets to it
+    // can go out between chunks
+    void handleDownload(SocketType clientSocket, PacketHeader* header, std::vector<char>& payload,
+                        std::mutex& brokerMtx) {
+        std::unique_lock<std::mutex> lock(brokerMtx);
+        
+        std::string username = clientManager.getUsername(clientSocket);
+        if (username.empty() || !fileStore || payload.size() < sizeof(FileDownloadRequest)) {
+            NetworkUtils::sendError(clientSocket, "Invalid download request");
+            return;
+        }
+        
+        FileDownloadRequest request;
+        memcpy(&request, payload.data(), sizeof(request));
+        std::string hash(request.hash, FILE_HASH_LEN);
+        std::string topic(header->topic);
+        
+        // Only members of a group the file was announced in may read it; others
+        // are told it does not exist, so a hash reveals nothing
+        if (StringUtils::isDMTopic(topic) || !isGroupMember(topic, username) ||
+            !fileStore->isPublished(hash, topic)) {
+            NetworkUtils::sendError(clientSocket, "File not found");
+            return;
+        }
+        
+        uint64_t fileSize = 0;
+        int fd = fileStore->openBlob(hash, fileSize);
+        if (fd < 0 || request.offset > fileSize) {
+            if (fd >= 0) fileStore->closeBlob(fd);
+            NetworkUtils::sendError(clientSocket, "File not found");
+            return;
+        }
+        
+        uint64_t end = fileSize;
+        if (request.length > 0 && request.length < fileSize - request.offset) {
+            end = request.offset + request.length;
+        }
+        
+        std::cout << "[DOWNLOAD] User '" << username << "' reading " << hash.substr(0, 12)
+                  << " [" << request.offset << ", " << end << ")" << std::endl;
+        lock.unlock();
+        
+        PacketHeader chunkHeader = {0};
+        chunkHeader.msgType = MSG_FILE_DATA;
+        chunkHeader.messageId = header->messageId;
+        memcpy(chunkHeader.topic, header->topic, MAX_TOPIC_LEN - 1);
+        
+        uint64_t pos = request.offset;
+        bool ok = true;
+        while (ok && pos < end) {
+            size_t chunk = std::min((uint64_t)FILE_DOWNLOAD_CHUNK_SIZE, end - pos);
+            chunkHeader.offset = pos;
+            chunkHeader.payloadLength = chunk;
+            ok = NetworkUtils::sendFileChunk(clientSocket, &chunkHeader, fd, pos, chunk);
+            pos += chunk;
+        }
+        
+        fileStore->closeBlob(fd);
+    }
+    
+    // Hash the group uploads this connection completed and announce them. Hashing
+    // may read the file back, so it runs outside the broker lock and only this
+    // connection waits for it.
+    void finishUploads(SocketType clientSocket, std::mutex& brokerMtx) {
+        std::unique_lock<std::mutex> lock(brokerMtx);
+        auto it = completedUploads.find(clientSocket);
+        if (it == completedUploads.end()) return;
+        
+        std::vector<CompletedUpload> completed;
+        completed.swap(it->second);
+        completedUploads.erase(it);
+        lock.unlock();
+        
+        for (const CompletedUpload& upload : completed) {
+            std::string hash = fileStore->commitUpload(upload.transferId);
+            lock.lock();
+            if (hash.empty()) {
+                NetworkUtils::sendError(clientSocket, "Cannot store file");
+            } else {
+                announceStoredFile(clientSocket, upload.filename, upload.fileSize, upload.sender, upload.topic, hash);
+            }
+            lock.unlock();
+        }
+    }
+    
+    // Index the groups stored files were announced in; a store from before the
+    // index is indexed once from the file messages in every group's history
+    void loadFileIndex() {
+        if (!dbManager || !fileStore || !fileStore->needsIndex()) return;
+        
+        size_t indexed = 0;
+        auto groups = dbManager->getAllGroups();
+        for (const auto& g : groups) {
+            uint32_t beforeId = 0;
+            bool more = true;
+            while (more) {
+                auto page = dbManager->getMessagePage(g.groupName, beforeId, 0, 0, 0, HISTORY_PAGE_MAX, &more);
+                if (page.empty()) break;
+                for (const ChatMessage& msg : page) {
+                    std::string hash = msg.content.substr(0, msg.content.find(':'));
+                    if (msg.isFile && Sha256::isHexDigest(hash) && fileStore->publish(hash, g.groupName)) {
+                        indexed++;
+                    }
+                }
+                beforeId = page.front().id;
+            }
+        }
+        
+        std::cout << "[STORE] Indexed " << indexed << " stored files in " << groups.size() << " groups" << std::endl;
+    }
+    
+    // Seed the presence index from persisted group membership
+    void loadPresenceIndex() {
+        if (!dbManager) return;
+        
+        auto groups = dbManager->getAllGroups();
+        for (const auto& g : groups) {
+            for (const std::string& member : g.members) {
+                presenceManager.addGroupMember(g.groupName, member);
+            }
+        }
+        
+        std::cout << "[PRESENCE] Indexed " << groups.size() << " groups, "
+                  << presenceManager.getIndexedUserCount() << " linked users" << std::endl;
+    }
+
 private:
-    // Broadcast user online/offline status to all connected clients
+    // Send user online/offline status to users who share a group or DM with them
     void broadcastUserStatus(const std::string& username, bool online) {
+        auto peers = presenceManager.getInterestedUsers(username);
+        
+        size_t delivered = 0;
+        for (const std::string& peer : peers) {
+            SocketType peerSocket = clientManager.getSocket(peer);
+            if (peerSocket != SOCKET_INVALID) {
+                sendUserStatus(peerSocket, username, online);
+                delivered++;
+            }
+        }
+        
+        std::cout << "[STATUS] User '" << username << "' is now " 
+                  << (online ? "ONLINE" : "OFFLINE") << " (notified " << delivered << ")" << std::endl;
+    }
+    
+    // Send a single user online/offline status packet
+    void sendUserStatus(SocketType targetSocket, const std::string& username, bool online) {
         PacketHeader header = {0};
         header.msgType = online ? MSG_USER_ONLINE : MSG_USER_OFFLINE;
         header.payloadLength = username.length();
@@ -301,29 +791,380 @@ private:
         strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
         
         std::vector<char> payload(username.begin(), username.end());
+        NetworkUtils::forwardMessage(targetSocket, &header, payload);
+    }
+    
+    // Exchange current status between a user and peers they just became linked to
+    void introducePeers(const std::string& username, const std::vector<std::string>& newPeers) {
+        SocketType userSocket = clientManager.getSocket(username);
+        for (const std::string& peer : newPeers) {
+            SocketType peerSocket = clientManager.getSocket(peer);
+            if (peerSocket == SOCKET_INVALID) continue;
+            
+            sendUserStatus(peerSocket, username, userSocket != SOCKET_INVALID);
+            if (userSocket != SOCKET_INVALID) {
+                sendUserStatus(userSocket, peer, true);
+            }
+        }
+    }
+    
+    // Hide each other's status once a user and their peers no longer share anything
+    void retirePeers(const std::string& username, const std::vector<std::string>& lostPeers) {
+        SocketType userSocket = clientManager.getSocket(username);
+        for (const std::string& peer : lostPeers) {
+            SocketType peerSocket = clientManager.getSocket(peer);
+            if (peerSocket != SOCKET_INVALID) {
+                sendUserHidden(peerSocket, username);
+            }
+            if (userSocket != SOCKET_INVALID) {
+                sendUserHidden(userSocket, peer);
+            }
+        }
+    }
+    
+    // Tell a client to stop showing a user whose status it no longer receives
+    void sendUserHidden(SocketType targetSocket, const std::string& username) {
+        PacketHeader header = {0};
+        header.msgType = MSG_USER_HIDDEN;
+        header.payloadLength = username.length();
+        header.timestamp = time(nullptr);
+        strncpy(header.sender, username.c_str(), MAX_USERNAME_LEN - 1);
+        
+        std::vector<char> payload(username.begin(), username.end());
+        NetworkUtils::forwardMessage(targetSocket, &header, payload);
+    }
+    
+    // Pack history rows into one length-prefixed batch frame
+    void sendHistoryBatch(SocketType clientSocket, const std::string& topic,
+                          const std::vector<ChatMessage>& page, bool hasMore,
+                          uint32_t msgType = MSG_HISTORY_BATCH) {
+        std::vector<char> batch;
+        auto append = [&batch](const void* data, size_t len) {
+            batch.insert(batch.end(), (const char*)data, (const char*)data + len);
+        };
         
-        auto clients = clientManager.getAllClients();
-        for (const auto& client : clients) {
-            if (client.first != username) {
-                NetworkUtils::forwardMessage(client.second, &header, payload);
+        uint32_t rowCount = page.size();
+        uint8_t more = hasMore ? 1 : 0;
+        append(&rowCount, sizeof(rowCount));
+        append(&more, sizeof(more));
+        
+        for (const auto& msg : page) {
+            std::string content = msg.isFile ? fileRowContent(msg) : msg.content;
+            std::string sender = msg.sender.substr(0, 255);
+            
+            HistoryRow row;
+            row.id = msg.id;
+            row.timestamp = msg.timestamp;
+            row.isFile = msg.isFile ? 1 : 0;
+            row.senderLength = sender.length();
+            
+            uint32_t rowLength = sizeof(row) + sender.length() + content.length();
+            append(&rowLength, sizeof(rowLength));
+            append(&row, sizeof(row));
+            append(sender.data(), sender.length());
+            append(content.data(), content.length());
+        }
+        
+        PacketHeader header = {0};
+        header.msgType = msgType;
+        header.payloadLength = batch.size();
+        header.timestamp = time(nullptr);
+        strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        if (msgType == MSG_MESSAGE_BATCH && !page.empty()) {
+            header.messageId = page.back().id;
+            header.flags = FLAG_SEQUENCED;
+        }
+        
+        NetworkUtils::forwardMessage(clientSocket, &header, batch);
+    }
+    
+    // Get the last 'limit' messages of a conversation, from the history cache when possible
+    std::vector<ChatMessage> getRecentHistory(const std::string& topic, const std::string& username, int limit) {
+        std::vector<ChatMessage> history;
+        if (historyCache.getRecent(topic, limit, history, expiryCutoff(topic, username))) {
+            return history;
+        }
+        
+        // Miss - read enough from disk to warm the whole ring, then serve from it
+        int fetch = std::max(limit, (int)historyCache.getRingSize());
+        if (StringUtils::isDMTopic(topic)) {
+            std::string otherUser = StringUtils::extractRecipient(topic, username);
+            history = dbManager->getDirectMessageHistory(username, otherUser, fetch);
+        } else {
+            history = dbManager->getMessageHistory(topic, fetch);
+        }
+        historyCache.warm(topic, history);
+        
+        if (history.size() > (size_t)limit) {
+            history.erase(history.begin(), history.end() - limit);
+        }
+        return history;
+    }
+    
+    // Time before which a conversation's messages have expired from the log
+    uint64_t expiryCutoff(const std::string& topic, const std::string& username) {
+        if (!dbManager) return 0;
+        if (StringUtils::isDMTopic(topic)) {
+            return dbManager->getDirectMessageCutoff(username, StringUtils::extractRecipient(topic, username));
+        }
+        return dbManager->getMessageCutoff(topic);
+    }
+    
+    // Save a topic message, keep it in the history ring and sequence it
+    // Returns the message's sequence number (its position in the log), 0 if it could not be saved
+    uint32_t recordMessage(const std::string& topic, const std::string& sender, const std::string& content,
+                           bool isFile = false, const std::string& filename = "") {
+        loadTopicSequence(topic, sender);
+        uint32_t seq = 0;
+        
+        if (dbManager) {
+            ChatMessage stored;
+            bool saved;
+            if (StringUtils::isDMTopic(topic)) {
+                std::string recipient = StringUtils::extractRecipient(topic, sender);
+                saved = dbManager->saveMessage(sender, recipient, content, false, isFile, filename, &stored);
+            } else {
+                saved = dbManager->saveMessage(sender, topic, content, true, isFile, filename, &stored);
             }
+            if (!saved) {
+                std::cerr << "[PUBLISH] Cannot save message to '" << topic << "', delivering it unsequenced" << std::endl;
+                return 0;
+            }
+            historyCache.add(topic, stored);
+            seq = stored.seq;
         }
+        return topicSequencer.append(topic, sender, content, time(nullptr), isFile, filename, seq);
+    }
+    
+    // Hand a finished group upload to this connection's finishUploads, which
+    // moves it to its content address and notifies members
+    void queueStoredFile(SocketType clientSocket, uint32_t transferId) {
+        FileTransfer* ft = fileTransferManager.getTransfer(transferId);
+        if (!ft) return;
         
-        std::cout << "[STATUS] User '" << username << "' is now " 
-                  << (online ? "ONLINE" : "OFFLINE") << std::endl;
+        completedUploads[clientSocket].push_back(
+            CompletedUpload{transferId, ft->filename, ft->fileSize, ft->sender, ft->recipient});
+        fileTransferManager.removeTransfer(transferId);
+    }
+    
+    // Record a stored file in the conversation and notify the group's online members
+    void announceStoredFile(SocketType clientSocket, const std::string& filename, uint64_t fileSize,
+                            const std::string& sender, const std::string& topic, const std::string& hash) {
+        // Stored message content is "<hash>:<size>", the filename column keeps the name
+        std::string fileRef = hash + ":" + std::to_string(fileSize);
+        fileStore->publish(hash, topic);
+        
+        PacketHeader header = {0};
+        header.msgType = MSG_FILE_AVAILABLE;
+        header.messageId = recordMessage(topic, sender, fileRef, true, filename);
+        header.flags = header.messageId ? FLAG_SEQUENCED : 0;
+        header.timestamp = time(nullptr);
+        strncpy(header.sender, sender.c_str(), MAX_USERNAME_LEN - 1);
+        strncpy(header.topic, topic.c_str(), MAX_TOPIC_LEN - 1);
+        
+        FileNotice notice;
+        memcpy(notice.hash, hash.data(), FILE_HASH_LEN);
+        notice.fileSize = fileSize;
+        
+        std::vector<char> payload((char*)&notice, (char*)&notice + sizeof(notice));
+        payload.insert(payload.end(), filename.begin(), filename.end());
+        header.payloadLength = payload.size();
+        
+        size_t notified = 0;
+        for (const std::string& subscriber : topicManager.getSubscribers(topic)) {
+            if (subscriber == sender) continue;
+            SocketType subscriberSocket = clientManager.getSocket(subscriber);
+            if (subscriberSocket != SOCKET_INVALID) {
+                NetworkUtils::forwardMessage(subscriberSocket, &header, payload);
+                notified++;
+            }
+        }
+        
+        std::cout << "[FILE] Stored '" << filename << "' as " << hash.substr(0, 12) << " ("
+                  << fileSize << " bytes), notified " << notified << " members of '" << topic << "'" << std::endl;
+        NetworkUtils::sendAck(clientSocket, "File transfer complete");
+    }
+    
+    // Tell the uploader the whole file is already stored, so there is nothing to send
+    void sendStoredStatus(SocketType clientSocket, uint32_t transferId, uint64_t fileSize) {
+        TransferStatus status = {0};
+        status.accepted = TRANSFER_STORED;
+        status.fileSize = fileSize;
+        status.contiguousOffset = fileSize;
+        status.stripes = 1;
+        
+        std::vector<char> payload((char*)&status, (char*)&status + sizeof(status));
+        
+        PacketHeader header = {0};
+        header.msgType = MSG_TRANSFER_STATUS;
+        header.messageId = transferId;
+        header.payloadLength = payload.size();
+        header.timestamp = time(nullptr);
+        
+        NetworkUtils::forwardMessage(clientSocket, &header, payload);
+    }
+    
+    // Tell the uploader which chunks the server already has
+    void sendTransferStatus(SocketType clientSocket, uint32_t transferId, bool accepted) {
+        TransferStatus status = {0};
+        std::vector<StripeStatus> stripes;
+        if (accepted && !fileTransferManager.getStatus(transferId, status, stripes)) {
+            accepted = false;
+        }
+        status.accepted = accepted ? TRANSFER_ACCEPTED : TRANSFER_REFUSED;
+        
+        std::vector<char> payload((char*)&status, (char*)&status + sizeof(status));
+        for (const StripeStatus& stripe : stripes) {
+            payload.insert(payload.end(), (const char*)&stripe, (const char*)&stripe + sizeof(stripe));
+        }
+        
+        PacketHeader header = {0};
+        header.msgType = MSG_TRANSFER_STATUS;
+        header.messageId = transferId;
+        header.payloadLength = payload.size();
+        header.timestamp = time(nullptr);
+        
+        NetworkUtils::forwardMessage(clientSocket, &header, payload);
+    }
+    
+    // Validate a chunk from the uploader and record it; logs progress in 10% steps
+    // Returns false if the chunk must not be stored or relayed
+    bool acceptChunk(SocketType clientSocket, PacketHeader* header, size_t size) {
+        uint32_t msgId = header->messageId;
+        
+        if (fileTransferManager.getSender(msgId) != clientManager.getUsername(clientSocket)) {
+            NetworkUtils::sendError(clientSocket, "No active file transfer");
+            return false;
+        }
+        
+        float before = fileTransferManager.getProgress(msgId);
+        ChunkResult result = fileTransferManager.addChunk(msgId, header->offset, size);
+        if (result == CHUNK_REJECTED) {
+            NetworkUtils::sendError(clientSocket, "Invalid file chunk");
+            return false;
+        }
+        if (result == CHUNK_DUPLICATE) {
+            grantCredits(msgId, 1); // Receivers already have it
+            return false;
+        }
+        
+        // Chunks arrive too fast to log each one
+        float progress = fileTransferManager.getProgress(msgId);
+        if ((int)(progress * 10) != (int)(before * 10)) {
+            std::cout << "[FILE DATA] Progress: " << (int)(progress * 100) << "%" << std::endl;
+        }
+        return true;
+    }
+    
+    // Drop a relayed transfer once every chunk has passed through
+    void finishRelayedChunk(SocketType clientSocket, uint32_t msgId) {
+        if (fileTransferManager.isComplete(msgId)) {
+            std::cout << "[FILE] Transfer complete" << std::endl;
+            fileTransferManager.removeTransfer(msgId);
+            NetworkUtils::sendAck(clientSocket, "File transfer complete");
+        }
+        // Don't send ACK for each chunk - only when complete
+    }
+    
+    // Socket of the online recipient of a DM transfer sent by this client,
+    // or SOCKET_INVALID if the transfer is not a plain socket-to-socket relay
+    SocketType dmRecipientSocket(SocketType clientSocket, uint32_t msgId) {
+        std::string sender = fileTransferManager.getSender(msgId);
+        std::string topic = fileTransferManager.getRecipient(msgId);
+        if (sender.empty() || sender != clientManager.getUsername(clientSocket) ||
+            !StringUtils::isDMTopic(topic) || (fileStore && fileStore->isUploading(msgId))) {
+            return SOCKET_INVALID;
+        }
+        return clientManager.getSocket(StringUtils::extractRecipient(topic, sender));
     }
     
-    // Send list of online users to a specific client (excluding themselves)
+    // Return credit for consumed chunks to the uploader, batched by FILE_CREDIT_BATCH
+    void grantCredits(uint32_t transferId, uint32_t chunks) {
+        uint32_t grant = fileTransferManager.consumeChunks(transferId, chunks);
+        if (grant == 0) return;
+        
+        SocketType senderSocket = clientManager.getSocket(fileTransferManager.getSender(transferId));
+        if (senderSocket == SOCKET_INVALID) return;
+        
+        PacketHeader header = {0};
+        header.msgType = MSG_FILE_CREDIT;
+        header.messageId = transferId;
+        header.payloadLength = sizeof(grant);
+        
+        std::vector<char> payload((char*)&grant, (char*)&grant + sizeof(grant));
+        NetworkUtils::forwardMessage(senderSocket, &header, payload);
+    }
+    
+    // Forget uploads abandoned for longer than TRANSFER_RESUME_TIMEOUT
+    void expireIdleTransfers() {
+        for (uint32_t transferId : fileTransferManager.expireIdle()) {
+            if (fileStore) fileStore->abortUpload(transferId);
+            std::cout << "[FILE] Dropped abandoned transfer " << transferId << std::endl;
+        }
+    }
+    
+    // Content of a file row in batches: "<hash>:<size>:<filename>" for stored files
+    static std::string fileRowContent(const ChatMessage& msg) {
+        return msg.content.empty() ? msg.filename : msg.content + ":" + msg.filename;
+    }
+    
+    // Remember where the user stopped reading each subscribed group
+    void saveReadCursors(const std::string& username) {
+        if (!offlineSpool) return;
+        
+        std::map<std::string, uint32_t> cursors;
+        for (const std::string& topic : topicManager.getUserTopics(username)) {
+            loadTopicSequence(topic, username);
+            cursors[topic] = topicSequencer.getLastSeq(topic);
+        }
+        offlineSpool->saveCursors(username, cursors);
+    }
+    
+    // Load a topic's current sequence from the database on first use
+    void loadTopicSequence(const std::string& topic, const std::string& username) {
+        if (topicSequencer.isLoaded(topic)) return;
+        
+        uint32_t count = 0;
+        if (dbManager) {
+            if (StringUtils::isDMTopic(topic)) {
+                std::string otherUser = StringUtils::extractRecipient(topic, username);
+                count = dbManager->countDirectMessages(username, otherUser);
+            } else {
+                count = dbManager->countMessages(topic);
+            }
+        }
+        topicSequencer.load(topic, count);
+    }
+    
+    // Check group membership, from the database when there is one
+    bool isGroupMember(const std::string& group, const std::string& username) {
+        return dbManager ? dbManager->isGroupMember(group, username) : topicManager.isSubscribed(group, username);
+    }
+    
+    // Check if user is one of the two participants of a DM topic
+    bool isDMParticipant(const std::string& topic, const std::string& username) {
+        std::string otherUser = StringUtils::extractRecipient(topic, username);
+        return !otherUser.empty() && StringUtils::createDMTopic(username, otherUser) == topic;
+    }
+    
+    // Link DM participants in the presence index
+    void openDirectMessage(const std::string& topic, const std::string& user1, const std::string& user2) {
+        if (presenceManager.openDirectMessage(topic, user1, user2)) {
+            introducePeers(user1, std::vector<std::string>(1, user2));
+        }
+    }
+    
+    // Send a client the online users who share a group or DM with them: the only
+    // ones whose status changes it is sent, so the only ones it can keep up to date
     void sendUserList(SocketType clientSocket) {
         std::string currentUser = clientManager.getUsername(clientSocket);
-        auto clients = clientManager.getAllClients();
         
-        // Build user list as semicolon-separated string, excluding current user
+        // Build user list as semicolon-separated string
         std::string userList;
-        for (const auto& client : clients) {
-            if (client.first != currentUser) {
+        for (const std::string& peer : presenceManager.getInterestedUsers(currentUser)) {
+            if (clientManager.getSocket(peer) != SOCKET_INVALID) {
                 if (!userList.empty()) userList += ";";
-                userList += client.first;
+                userList += peer;
             }
         }
         
@@ -385,30 +1226,13 @@ private:
     void sendGroupListAndSubscribe(SocketType clientSocket, const std::string& username) {
         if (!dbManager) return;
         
-        auto groups = dbManager->getAllGroupsWithMembership(username);
-        
-        // Format: groupName:1;groupName2:0;... (1=member, 0=not member)
-        std::string groupList;
-        for (const auto& g : groups) {
-            if (!groupList.empty()) groupList += ";";
-            groupList += g.first + ":" + (g.second ? "1" : "0");
-            
-            // Auto-subscribe to groups user is a member of
-            if (g.second) {
-                topicManager.subscribe(g.first, username);
-                std::cout << "[AUTO-SUBSCRIBE] User '" << username << "' subscribed to group '" << g.first << "'" << std::endl;
-            }
+        // The membership index yields only this user's groups, not a scan of every group
+        for (const std::string& group : dbManager->getUserGroups(username)) {
+            topicManager.subscribe(group, username);
+            std::cout << "[AUTO-SUBSCRIBE] User '" << username << "' subscribed to group '" << group << "'" << std::endl;
         }
         
-        PacketHeader header = {0};
-        header.msgType = MSG_GROUP_LIST;
-        header.payloadLength = groupList.length();
-        header.timestamp = time(nullptr);
-        
-        std::vector<char> payload(groupList.begin(), groupList.end());
-        NetworkUtils::forwardMessage(clientSocket, &header, payload);
-        
-        std::cout << "[GROUP LIST] Sent to " << username << ": " << groupList << std::endl;
+        sendGroupList(clientSocket, username);
     }
 };
 
@@ -0,0 +1,188 @@
+#ifndef OFFLINE_SPOOL_H
+#define OFFLINE_SPOOL_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <mutex>
+#include <cstdint>
+#include "../utils/record_codec.h"
+
+// Cross-platform directory creation
+#ifdef _WIN32
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/types.h>
+#endif
+
+#define SPOOL_MAX_TOPICS 256     // Pending DM conversations remembered per offline user
+#define SPOOL_MAX_BACKLOG 500    // Messages delivered per conversation on login
+#define SPOOL_ALL_DMS ""         // Pending entry: replay every DM conversation on login
+
+// Store-and-forward bookkeeping for offline users.
+// Messages themselves stay in the message store; the spool only records
+// where each user stopped reading (fan-out-on-read):
+//   <user>.cursors - group topic -> last sequence seen, written on logout
+//   <user>.pending - append-only, one entry per DM conversation that
+//                    received messages while the user was offline
+// Both hold RecordCodec frames of (topic, sequence), so a topic may contain
+// any byte. A user has at most one pending entry per DM conversation and at
+// most SPOOL_MAX_TOPICS of them; past that a single SPOOL_ALL_DMS entry
+// stands for every conversation, so a miss is never lost, only widened.
+class OfflineSpool {
+private:
+    std::string spoolDir;
+    std::map<std::string, std::map<std::string, uint32_t>> pendingDMs; // user -> (DM topic -> last seq before miss)
+    std::mutex mtx;
+
+public:
+    OfflineSpool(const std::string& directory) : spoolDir(directory) {
+        #ifdef _WIN32
+        _mkdir(spoolDir.c_str());
+        #else
+        mkdir(spoolDir.c_str(), 0755);
+        #endif
+    }
+    ~OfflineSpool() = default;
+    
+    // Record that an offline user missed a DM; only the first miss per conversation is logged
+    bool recordMissedDM(const std::string& username, const std::string& topic, uint32_t seq) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        std::map<std::string, uint32_t>& pending = loadPending(username);
+        if (pending.find(topic) != pending.end() || pending.find(SPOOL_ALL_DMS) != pending.end()) {
+            return true; // Already spooled from an earlier sequence
+        }
+        
+        std::string entry = topic;
+        if (pending.size() >= SPOOL_MAX_TOPICS) {
+            std::cout << "[SPOOL] " << username << " missed DMs in more than " << SPOOL_MAX_TOPICS
+                      << " conversations, all of them will be replayed" << std::endl;
+            entry = SPOOL_ALL_DMS;
+            seq = 1;
+        }
+        pending[entry] = seq - 1;
+        
+        std::string frame;
+        RecordCodec::putFrame(frame, encodeEntry(entry, seq - 1));
+        std::ofstream file(pendingPath(username), std::ios::binary | std::ios::app);
+        return file.is_open() && (bool)file.write(frame.data(), frame.size());
+    }
+    
+    // Save where the user stopped reading each group
+    void saveCursors(const std::string& username, const std::map<std::string, uint32_t>& cursors) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        std::string data;
+        for (const auto& c : cursors) {
+            RecordCodec::putFrame(data, encodeEntry(c.first, c.second));
+        }
+        if (!RecordCodec::replaceFile(cursorPath(username), data)) {
+            std::cerr << "[SPOOL] Cannot save read cursors of " << username << std::endl;
+        }
+    }
+    
+    // Take all pending conversations of a user (topic -> last sequence seen) and clear the DM log
+    // A SPOOL_ALL_DMS entry asks for every DM conversation of the user
+    std::map<std::string, uint32_t> drain(const std::string& username) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        std::map<std::string, uint32_t> result = readEntries(cursorPath(username));
+        for (const auto& dm : loadPending(username)) {
+            auto it = result.find(dm.first);
+            if (it == result.end() || dm.second < it->second) {
+                result[dm.first] = dm.second;
+            }
+        }
+        
+        pendingDMs.erase(username);
+        std::remove(pendingPath(username).c_str());
+        return result;
+    }
+
+private:
+    // Usernames come from clients: only [a-z0-9_-] is kept as is and every other
+    // byte becomes %XX, so a name cannot reach outside the spool directory and
+    // names differing in case do not share files on case-insensitive file systems
+    static std::string fileName(const std::string& username) {
+        static const char hex[] = "0123456789ABCDEF";
+        std::string name;
+        for (unsigned char c : username) {
+            if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-') {
+                name += (char)c;
+            } else {
+                name += '%';
+                name += hex[c >> 4];
+                name += hex[c & 0x0F];
+            }
+        }
+        return name;
+    }
+    
+    std::string cursorPath(const std::string& username) const {
+        return spoolDir + "/" + fileName(username) + ".cursors";
+    }
+    
+    std::string pendingPath(const std::string& username) const {
+        return spoolDir + "/" + fileName(username) + ".pending";
+    }
+    
+    static std::string encodeEntry(const std::string& topic, uint32_t seq) {
+        std::string payload;
+        RecordCodec::putString(payload, topic);
+        RecordCodec::putVarint(payload, seq);
+        return payload;
+    }
+    
+    // Get pending DMs of a user, reading the log after a restart
+    std::map<std::string, uint32_t>& loadPending(const std::string& username) {
+        auto it = pendingDMs.find(username);
+        if (it != pendingDMs.end()) {
+            return it->second;
+        }
+        return pendingDMs[username] = readEntries(pendingPath(username), true);
+    }
+    
+    // Read (topic, seq) frames, keeping the lowest sequence per topic; with
+    // repairTail a torn entry at the end (crash mid-append) is cut off so
+    // later appends stay readable. Damage before the end is left for inspection.
+    std::map<std::string, uint32_t> readEntries(const std::string& path, bool repairTail = false) {
+        std::map<std::string, uint32_t> entries;
+        
+        std::vector<char> data;
+        if (!RecordCodec::readFile(path, data)) return entries;
+        
+        const char* begin = data.data();
+        const char* end = begin + data.size();
+        const char* p = begin;
+        RecordCodec::FrameStatus status = RecordCodec::FRAME_OK;
+        while (p < end) {
+            const char* payload;
+            size_t size;
+            status = RecordCodec::getFrame(p, end, payload, size);
+            if (status != RecordCodec::FRAME_OK) break;
+            
+            RecordCodec::Reader reader(payload, size);
+            std::string topic = reader.string();
+            uint32_t seq = (uint32_t)reader.varint();
+            if (!reader.ok()) continue;
+            
+            auto it = entries.find(topic);
+            if (it == entries.end() || seq < it->second) {
+                entries[topic] = seq;
+            }
+        }
+        
+        if (p < end) {
+            std::cerr << "[SPOOL] Ignoring " << (end - p) << " damaged bytes at the end of " << path << std::endl;
+            if (repairTail && status == RecordCodec::FRAME_INCOMPLETE) RecordCodec::truncateFile(path, p - begin);
+        }
+        return entries;
+    }
+};
+
+#endif // OFFLINE_SPOOL_H
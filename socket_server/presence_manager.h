@@ -0,0 +1,140 @@
+#ifndef PRESENCE_MANAGER_H
+#define PRESENCE_MANAGER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// Tracks who is interested in whose online/offline status.
+// Two users are adjacent when they share a group or have an open DM.
+// Each edge is reference-counted so that leaving one shared group does
+// not drop the link while another shared group (or the DM) still holds it.
+class PresenceManager {
+private:
+    std::map<std::string, std::set<std::string>> groupMembers;    // group -> members
+    std::map<std::string, std::map<std::string, int>> adjacency; // user -> (peer -> shared links)
+    std::set<std::string> openDMs;                                // DM topics already linked
+    std::mutex mtx;
+
+public:
+    PresenceManager() = default;
+    ~PresenceManager() = default;
+    
+    // Add user to group, linking them with every existing member
+    // Returns the peers that became adjacent to the user because of this join
+    std::vector<std::string> addGroupMember(const std::string& group, const std::string& username) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        std::vector<std::string> newPeers;
+        std::set<std::string>& members = groupMembers[group];
+        if (!members.insert(username).second) {
+            return newPeers; // Already a member
+        }
+        
+        for (const std::string& member : members) {
+            if (member != username && link(username, member)) {
+                newPeers.push_back(member);
+            }
+        }
+        return newPeers;
+    }
+    
+    // Remove user from group, dropping the links this group provided
+    // Returns the peers that are no longer adjacent to the user
+    std::vector<std::string> removeGroupMember(const std::string& group, const std::string& username) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        std::vector<std::string> lostPeers;
+        auto it = groupMembers.find(group);
+        if (it == groupMembers.end() || it->second.erase(username) == 0) {
+            return lostPeers;
+        }
+        
+        for (const std::string& member : it->second) {
+            if (unlink(username, member)) {
+                lostPeers.push_back(member);
+            }
+        }
+        
+        if (it->second.empty()) {
+            groupMembers.erase(it);
+        }
+        return lostPeers;
+    }
+    
+    // Link the two participants of a DM topic (once per topic)
+    // Returns true if the two users were not adjacent before
+    bool openDirectMessage(const std::string& dmTopic, const std::string& user1, const std::string& user2) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        if (user1.empty() || user2.empty() || user1 == user2) {
+            return false;
+        }
+        if (!openDMs.insert(dmTopic).second) {
+            return false;
+        }
+        return link(user1, user2);
+    }
+    
+    // Get users who should see this user's presence changes
+    std::vector<std::string> getInterestedUsers(const std::string& username) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        std::vector<std::string> peers;
+        auto it = adjacency.find(username);
+        if (it != adjacency.end()) {
+            peers.reserve(it->second.size());
+            for (const auto& peer : it->second) {
+                peers.push_back(peer.first);
+            }
+        }
+        return peers;
+    }
+    
+    // Check if two users share a group or an open DM
+    bool isAdjacent(const std::string& user1, const std::string& user2) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = adjacency.find(user1);
+        return it != adjacency.end() && it->second.find(user2) != it->second.end();
+    }
+    
+    // Get number of users with at least one link
+    size_t getIndexedUserCount() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return adjacency.size();
+    }
+
+private:
+    // Returns true if this is the first link between the two users
+    bool link(const std::string& a, const std::string& b) {
+        adjacency[b][a]++;
+        return ++adjacency[a][b] == 1;
+    }
+    
+    // Returns true if the last link between the two users was dropped
+    bool unlink(const std::string& a, const std::string& b) {
+        dropEdge(b, a);
+        return dropEdge(a, b);
+    }
+    
+    bool dropEdge(const std::string& from, const std::string& to) {
+        auto it = adjacency.find(from);
+        if (it == adjacency.end()) return false;
+        
+        bool dropped = false;
+        auto peer = it->second.find(to);
+        if (peer != it->second.end() && --peer->second <= 0) {
+            it->second.erase(peer);
+            dropped = true;
+        }
+        if (it->second.empty()) {
+            adjacency.erase(it);
+        }
+        return dropped;
+    }
+};
+
+#endif // PRESENCE_MANAGER_H
@@ -1,19 +1,37 @@
 #include "broker.h"
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 
+// Usage: server [port] [sync]
+// sync: "batch" (fsync every write batch), "never", or a period in ms (default 100)
 int main(int argc, char* argv[]) {
     int port = DEFAULT_PORT;
     if (argc > 1) {
         port = atoi(argv[1]);
     }
     
+    LogSyncMode syncMode = LOG_SYNC_INTERVAL;
+    int syncIntervalMs = MESSAGE_LOG_SYNC_INTERVAL_MS;
+    if (argc > 2) {
+        if (strcmp(argv[2], "batch") == 0) {
+            syncMode = LOG_SYNC_BATCH;
+        } else if (strcmp(argv[2], "never") == 0) {
+            syncMode = LOG_SYNC_NEVER;
+        } else if (atoi(argv[2]) > 0) {
+            syncIntervalMs = atoi(argv[2]);
+        } else {
+            std::cerr << "Unknown sync mode '" << argv[2] << "' (use batch, never or milliseconds)" << std::endl;
+            return 1;
+        }
+    }
+    
     std::cout << "========================================" << std::endl;
     std::cout << "   Chat Server - Publish/Subscribe      " << std::endl;
     std::cout << "========================================" << std::endl;
     
     Broker broker;
-    if (!broker.initialize(port)) {
+    if (!broker.initialize(port, syncMode, syncIntervalMs)) {
         std::cerr << "Failed to initialize broker" << std::endl;
         return 1;
     }
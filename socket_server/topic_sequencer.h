@@ -0,0 +1,125 @@
+#ifndef TOPIC_SEQUENCER_H
+#define TOPIC_SEQUENCER_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <algorithm>
+
+#define SEQUENCER_TAIL_SIZE 256
+
+struct SequencedMessage {
+    uint32_t seq;
+    std::string sender;
+    std::string content;
+    uint64_t timestamp;
+    bool isFile;
+    std::string filename;
+};
+
+// Assigns per-topic sequence numbers and keeps a short in-memory tail
+// so that resubscribing clients can be sent just what they missed.
+// A topic's sequence is the 1-based position of the message among that
+// topic's messages in the database, as the message log numbers them, so
+// the on-disk log can fill any gap the tail no longer covers.
+class TopicSequencer {
+private:
+    struct TopicState {
+        uint32_t lastSeq;
+        std::deque<SequencedMessage> tail;
+        
+        TopicState() : lastSeq(0) {}
+    };
+    
+    std::map<std::string, TopicState> topics; // topic -> sequence state
+    size_t tailSize;
+    mutable std::mutex mtx;
+
+public:
+    TopicSequencer(size_t tailSize = SEQUENCER_TAIL_SIZE) : tailSize(tailSize) {}
+    ~TopicSequencer() = default;
+    
+    // Check if the topic's base sequence has been loaded
+    bool isLoaded(const std::string& topic) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return topics.find(topic) != topics.end();
+    }
+    
+    // Set the topic's base sequence (number of messages already stored)
+    void load(const std::string& topic, uint32_t lastSeq) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        TopicState& state = topics[topic];
+        if (lastSeq > state.lastSeq) {
+            state.lastSeq = lastSeq;
+        }
+    }
+    
+    // Keep a message in the tail under the sequence number the log stored it
+    // with, or under the next number when 'seq' is 0 (no database)
+    uint32_t append(const std::string& topic, const std::string& sender,
+                    const std::string& content, uint64_t timestamp,
+                    bool isFile = false, const std::string& filename = "", uint32_t seq = 0) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        TopicState& state = topics[topic];
+        state.lastSeq = seq ? std::max(seq, state.lastSeq) : state.lastSeq + 1;
+        SequencedMessage msg;
+        msg.seq = seq ? seq : state.lastSeq;
+        msg.sender = sender;
+        msg.content = content;
+        msg.timestamp = timestamp;
+        msg.isFile = isFile;
+        msg.filename = filename;
+        
+        state.tail.push_back(msg);
+        if (state.tail.size() > tailSize) {
+            state.tail.pop_front();
+        }
+        return msg.seq;
+    }
+    
+    // Get the last sequence number assigned in a topic
+    uint32_t getLastSeq(const std::string& topic) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = topics.find(topic);
+        return it != topics.end() ? it->second.lastSeq : 0;
+    }
+    
+    // Get messages with sequence > afterSeq from the tail
+    // Messages older than 'cutoff' have expired from the log and leave the tail first
+    // Returns false if the tail no longer holds the whole gap
+    bool getSince(const std::string& topic, uint32_t afterSeq, std::vector<SequencedMessage>& out,
+                  uint64_t cutoff = 0) {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        auto it = topics.find(topic);
+        if (it == topics.end()) return false;
+        
+        TopicState& state = it->second;
+        while (!state.tail.empty() && state.tail.front().timestamp < cutoff) {
+            state.tail.pop_front();
+        }
+        if (afterSeq >= state.lastSeq) return true; // Nothing missed
+        if (state.tail.empty() || state.tail.front().seq > afterSeq + 1) return false;
+        
+        for (const auto& msg : state.tail) {
+            if (msg.seq > afterSeq) {
+                out.push_back(msg);
+            }
+        }
+        return true;
+    }
+    
+    // Get topic count
+    size_t getTopicCount() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return topics.size();
+    }
+};
+
+#endif // TOPIC_SEQUENCER_H
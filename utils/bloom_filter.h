@@ -0,0 +1,74 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#define BLOOM_FILTER_BYTES 4096 // 32768 bits: about 0.1% false positives at 2000 keys
+#define BLOOM_FILTER_HASHES 5
+
+// Fixed-size Bloom filter of strings. mayContain() is never wrong about a key
+// that was added; for other keys it is usually false. The bit positions come
+// from a 64-bit FNV-1a hash, which is stable across builds, so a filter can
+// be saved and read back.
+class BloomFilter {
+private:
+    std::vector<uint8_t> bits;
+    
+    static uint64_t hash(const std::string& key) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : key) {
+            h = (h ^ c) * 1099511628211ULL;
+        }
+        return h;
+    }
+    
+    // Double hashing: position i is h1 + i * h2
+    template <typename Visit>
+    void forEachBit(const std::string& key, Visit visit) const {
+        uint64_t h = hash(key);
+        uint32_t h1 = (uint32_t)h;
+        uint32_t h2 = (uint32_t)(h >> 32) | 1;
+        for (uint32_t i = 0; i < BLOOM_FILTER_HASHES; i++) {
+            uint32_t bit = (h1 + i * h2) % (BLOOM_FILTER_BYTES * 8);
+            if (!visit(bit >> 3, (uint8_t)(1 << (bit & 7)))) return;
+        }
+    }
+
+public:
+    BloomFilter() : bits(BLOOM_FILTER_BYTES, 0) {}
+    
+    void add(const std::string& key) {
+        forEachBit(key, [&](size_t byte, uint8_t mask) {
+            bits[byte] |= mask;
+            return true;
+        });
+    }
+    
+    bool mayContain(const std::string& key) const {
+        bool found = true;
+        forEachBit(key, [&](size_t byte, uint8_t mask) {
+            found = (bits[byte] & mask) != 0;
+            return found;
+        });
+        return found;
+    }
+    
+    void clear() {
+        bits.assign(BLOOM_FILTER_BYTES, 0);
+    }
+    
+    // Raw bits, for saving; assign() fails on data of the wrong size
+    std::string data() const {
+        return std::string(bits.begin(), bits.end());
+    }
+    
+    bool assign(const std::string& data) {
+        if (data.size() != BLOOM_FILTER_BYTES) return false;
+        bits.assign(data.begin(), data.end());
+        return true;
+    }
+};
+
+#endif // BLOOM_FILTER_H
@@ -8,7 +8,14 @@
 #include <sstream>
 #include <mutex>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
 #include <algorithm>
+#include <functional>
+#include "message_log.h"
+#include "record_codec.h"
 
 // Cross-platform directory creation
 #ifdef _WIN32
@@ -19,19 +26,24 @@
     #include <sys/types.h>
 #endif
 
-// Simple file-based database (no external dependencies)
-// Format: CSV files for each table
+#define USER_LOG_COMPACT_MIN 1024  // Change log entries before users.dat is rewritten
+#define GROUP_LOG_COMPACT_MIN 1024 // Change log entries before groups.dat is rewritten
 
-struct ChatMessage {
-    uint32_t id;
-    std::string sender;
-    std::string recipient; // username or group name
-    std::string content;
-    uint64_t timestamp;
-    bool isGroup;
-    bool isFile;
-    std::string filename;
-};
+// Simple file-based database (no external dependencies)
+// Format: RecordCodec binary records throughout; messages go to a
+// segmented log (see MessageLog) under <dir>/log
+// Users live in memory: users.dat is a snapshot, and every change since
+// is appended to users.log as a full record (the last record of a user wins).
+// Once the log outgrows the table it is folded into a new snapshot.
+// Groups work the same way: groups.dat is the snapshot and groups.log holds
+// create/join/leave operations; a user -> groups index answers membership.
+// The CSV tables of older versions are converted on first start.
+// Message retention is read from <dir>/retention.conf, one policy per line
+// in days (0 keeps messages for ever):
+//   default 30          every conversation without a policy below
+//   groups 90           every group topic without a policy of its own
+//   direct 365          every direct conversation
+//   topic <name> 7      one group topic
 
 struct UserRecord {
     std::string username;
@@ -52,108 +64,177 @@ class DatabaseManager {
 private:
     std::string dataDir;
     std::mutex mtx;
-    uint32_t nextMessageId;
     
-    std::string messagesFile;
+    std::string messagesFile;   // Legacy CSV message table, imported into the log once
     std::string usersFile;
+    std::string userLogFile;
     std::string groupsFile;
+    std::string groupLogFile;
+    std::string legacyUsersFile;    // CSV tables of older versions, converted once
+    std::string legacyGroupsFile;
+    std::string retentionFile;
+    
+    std::vector<UserRecord> users;                      // In first-seen order, as in the snapshot
+    std::unordered_map<std::string, size_t> userIndex;  // username -> position in users
+    std::ofstream userLog;
+    size_t userLogEntries;
+    
+    enum GroupOp {
+        GROUP_CREATE = 'G',
+        GROUP_JOIN = 'J',
+        GROUP_LEAVE = 'L'
+    };
+    
+    struct GroupEntry {
+        std::string groupName;
+        std::string createdBy;
+        uint64_t createdAt;
+        std::set<std::string> members;
+    };
+    std::vector<GroupEntry> groups;                     // In creation order, as in the snapshot
+    std::unordered_map<std::string, size_t> groupIndex; // group name -> position in groups
+    std::unordered_map<std::string, std::set<std::string>> userGroups; // username -> groups joined
+    std::ofstream groupLog;
+    size_t groupLogEntries;
+    size_t membershipCount;
+    
+    MessageLog messageLog;
 
 public:
     DatabaseManager(const std::string& directory = "data") 
-        : dataDir(directory), nextMessageId(1) {
+        : dataDir(directory), userLogEntries(0), groupLogEntries(0), membershipCount(0) {
         
         messagesFile = dataDir + "/messages.csv";
-        usersFile = dataDir + "/users.csv";
-        groupsFile = dataDir + "/groups.csv";
+        usersFile = dataDir + "/users.dat";
+        userLogFile = dataDir + "/users.log";
+        groupsFile = dataDir + "/groups.dat";
+        groupLogFile = dataDir + "/groups.log";
+        legacyUsersFile = dataDir + "/users.csv";
+        legacyGroupsFile = dataDir + "/groups.csv";
+        retentionFile = dataDir + "/retention.conf";
         
         // Create data directory
         createDirectory(dataDir);
         
-        // Initialize files if they don't exist
-        initializeFiles();
+        // Load the user and group tables: snapshot, then the changes made since
+        loadUsers();
+        loadGroups();
         
-        // Load next message ID
-        loadNextMessageId();
+        // Open the message log, moving messages of the old CSV table into it
+        // Policies come first so the log can trust the expiry its checkpoint saved
+        loadRetention();
+        messageLog.open(dataDir + "/log");
+        importLegacyMessages();
     }
     
     // ============ Messages ============
     
+    // If 'stored' is given, it receives the record as written (with its id and timestamp)
     bool saveMessage(const std::string& sender, const std::string& recipient,
                      const std::string& content, bool isGroup, 
-                     bool isFile = false, const std::string& filename = "") {
-        std::lock_guard<std::mutex> lock(mtx);
-        
-        std::ofstream file(messagesFile, std::ios::app);
-        if (!file.is_open()) return false;
-        
-        uint64_t timestamp = time(nullptr);
-        
-        // CSV format: id,sender,recipient,content,timestamp,isGroup,isFile,filename
-        file << nextMessageId++ << ","
-             << escapeCSV(sender) << ","
-             << escapeCSV(recipient) << ","
-             << escapeCSV(content) << ","
-             << timestamp << ","
-             << (isGroup ? "1" : "0") << ","
-             << (isFile ? "1" : "0") << ","
-             << escapeCSV(filename) << "\n";
-        
-        file.close();
+                     bool isFile = false, const std::string& filename = "",
+                     ChatMessage* stored = nullptr) {
+        ChatMessage msg;
+        msg.sender = sender;
+        msg.recipient = recipient;
+        msg.content = content;
+        msg.timestamp = time(nullptr);
+        msg.isGroup = isGroup;
+        msg.isFile = isFile;
+        msg.filename = filename;
+        
+        if (!messageLog.append(msg)) return false;
+        if (stored) {
+            *stored = msg;
+        }
         return true;
     }
     
     std::vector<ChatMessage> getMessageHistory(const std::string& topic, int limit = 50) {
-        std::lock_guard<std::mutex> lock(mtx);
-        std::vector<ChatMessage> messages;
-        
-        std::ifstream file(messagesFile);
-        if (!file.is_open()) return messages;
-        
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            ChatMessage msg = parseMessage(line);
-            if (msg.recipient == topic) {
-                messages.push_back(msg);
-            }
-        }
-        
-        // Return last 'limit' messages
-        if (messages.size() > (size_t)limit) {
-            messages.erase(messages.begin(), messages.end() - limit);
-        }
-        
-        return messages;
+        return messageLog.readLast(MessageLog::groupKey(topic), limit > 0 ? limit : 0);
     }
     
     std::vector<ChatMessage> getDirectMessageHistory(const std::string& user1, 
                                                       const std::string& user2, 
                                                       int limit = 50) {
-        std::lock_guard<std::mutex> lock(mtx);
-        std::vector<ChatMessage> messages;
-        
-        std::ifstream file(messagesFile);
-        if (!file.is_open()) return messages;
-        
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            ChatMessage msg = parseMessage(line);
-            if (!msg.isGroup) {
-                if ((msg.sender == user1 && msg.recipient == user2) ||
-                    (msg.sender == user2 && msg.recipient == user1)) {
-                    messages.push_back(msg);
-                }
-            }
-        }
-        
-        if (messages.size() > (size_t)limit) {
-            messages.erase(messages.begin(), messages.end() - limit);
-        }
-        
-        return messages;
+        return messageLog.readLast(MessageLog::directKey(user1, user2), limit > 0 ? limit : 0);
+    }
+    
+    // Get a page of a group's messages within an id/time window (zero bounds are open)
+    // Returns the newest 'limit' matches, or the oldest when paging forward from afterId
+    std::vector<ChatMessage> getMessagePage(const std::string& topic,
+                                            uint32_t beforeId, uint32_t afterId,
+                                            uint64_t fromTime, uint64_t toTime,
+                                            size_t limit, bool* hasMore = nullptr) {
+        return messageLog.readPage(MessageLog::groupKey(topic), beforeId, afterId,
+                                   fromTime, toTime, limit, hasMore);
+    }
+    
+    // Get a page of direct messages between two users (see getMessagePage)
+    std::vector<ChatMessage> getDirectMessagePage(const std::string& user1, const std::string& user2,
+                                                  uint32_t beforeId, uint32_t afterId,
+                                                  uint64_t fromTime, uint64_t toTime,
+                                                  size_t limit, bool* hasMore = nullptr) {
+        return messageLog.readPage(MessageLog::directKey(user1, user2), beforeId, afterId,
+                                   fromTime, toTime, limit, hasMore);
+    }
+    
+    // Time before which a group's messages have expired; caches must not serve older ones
+    uint64_t getMessageCutoff(const std::string& topic) {
+        return messageLog.expiryCutoff(MessageLog::groupKey(topic));
+    }
+    
+    uint64_t getDirectMessageCutoff(const std::string& user1, const std::string& user2) {
+        return messageLog.expiryCutoff(MessageLog::directKey(user1, user2));
+    }
+    
+    // Get the users a user has exchanged direct messages with
+    std::vector<std::string> getDirectPeers(const std::string& username) {
+        return messageLog.directPeers(username);
+    }
+    
+    // Count messages stored for a group topic
+    uint32_t countMessages(const std::string& topic) {
+        return messageLog.count(MessageLog::groupKey(topic));
+    }
+    
+    // Count direct messages stored between two users
+    uint32_t countDirectMessages(const std::string& user1, const std::string& user2) {
+        return messageLog.count(MessageLog::directKey(user1, user2));
+    }
+    
+    // Choose when saved messages are fsynced (see LogSyncMode)
+    void setMessageSync(LogSyncMode mode, int intervalMs = MESSAGE_LOG_SYNC_INTERVAL_MS) {
+        messageLog.setSyncMode(mode, intervalMs);
+    }
+    
+    // Wait until every saved message is on disk
+    void flushMessages() {
+        messageLog.flush();
+    }
+    
+    // Get number of write batches the message log has issued
+    uint64_t getMessageBatchCount() {
+        return messageLog.getBatchCount();
+    }
+    
+    // Keep a group topic's messages for 'days' (0: for ever); expired segments are deleted in the background
+    void setTopicRetention(const std::string& topic, uint32_t days) {
+        messageLog.setRetention(MessageLog::groupKey(topic), days * 86400ULL);
+    }
+    
+    // Retention of group topics and of direct conversations without a policy of their own
+    void setGroupRetention(uint32_t days) {
+        messageLog.setRetention("#", days * 86400ULL);
+    }
+    
+    void setDirectRetention(uint32_t days) {
+        messageLog.setRetention("@", days * 86400ULL);
+    }
+    
+    // Retention of every conversation no other policy covers
+    void setDefaultRetention(uint32_t days) {
+        messageLog.setRetention("", days * 86400ULL);
     }
     
     // ============ Users ============
@@ -162,24 +243,21 @@ public:
         std::lock_guard<std::mutex> lock(mtx);
         
         // Check if user exists
-        if (userExists(username)) {
-            return updateLastSeen(username);
+        if (userIndex.find(username) != userIndex.end()) {
+            return updateUserStatus(username, true);
         }
         
-        std::ofstream file(usersFile, std::ios::app);
-        if (!file.is_open()) return false;
-        
         uint64_t now = time(nullptr);
-        
-        // CSV: username,passwordHash,createdAt,lastSeen,isOnline
-        file << escapeCSV(username) << ","
-             << escapeCSV(passwordHash) << ","
-             << now << ","
-             << now << ","
-             << "1\n";
-        
-        file.close();
-        return true;
+        UserRecord user;
+        user.username = username;
+        user.passwordHash = passwordHash;
+        user.createdAt = now;
+        user.lastSeen = now;
+        user.isOnline = true;
+        
+        userIndex[username] = users.size();
+        users.push_back(user);
+        return logUser(user);
     }
     
     bool setUserOnline(const std::string& username, bool online) {
@@ -191,14 +269,7 @@ public:
         std::lock_guard<std::mutex> lock(mtx);
         std::vector<std::string> onlineUsers;
         
-        std::ifstream file(usersFile);
-        if (!file.is_open()) return onlineUsers;
-        
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            UserRecord user = parseUser(line);
+        for (const UserRecord& user : users) {
             if (user.isOnline) {
                 onlineUsers.push_back(user.username);
             }
@@ -209,18 +280,6 @@ public:
     
     std::vector<UserRecord> getAllUsers() {
         std::lock_guard<std::mutex> lock(mtx);
-        std::vector<UserRecord> users;
-        
-        std::ifstream file(usersFile);
-        if (!file.is_open()) return users;
-        
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            users.push_back(parseUser(line));
-        }
-        
         return users;
     }
     
@@ -229,166 +288,87 @@ public:
     bool saveGroup(const std::string& groupName, const std::string& createdBy) {
         std::lock_guard<std::mutex> lock(mtx);
         
-        if (groupExists(groupName)) return false;
-        
-        std::ofstream file(groupsFile, std::ios::app);
-        if (!file.is_open()) return false;
+        if (groupIndex.find(groupName) != groupIndex.end()) return false;
         
         uint64_t now = time(nullptr);
-        
-        // CSV: groupName,createdBy,createdAt,members
-        file << escapeCSV(groupName) << ","
-             << escapeCSV(createdBy) << ","
-             << now << ","
-             << escapeCSV(createdBy) << "\n";
-        
-        file.close();
-        return true;
+        createGroup(groupName, createdBy, now);
+        return logGroupOp(GROUP_CREATE, groupName, createdBy, now);
     }
     
     bool addGroupMember(const std::string& groupName, const std::string& username) {
-        // Read all groups, modify, rewrite
-        std::vector<GroupRecord> groups;
-        
-        std::ifstream inFile(groupsFile);
-        if (!inFile.is_open()) return false;
-        
-        std::string line;
-        std::getline(inFile, line); // Skip header
-        
-        bool found = false;
-        while (std::getline(inFile, line)) {
-            GroupRecord group = parseGroup(line);
-            if (group.groupName == groupName) {
-                // Check if already member
-                bool isMember = false;
-                for (const auto& m : group.members) {
-                    if (m == username) {
-                        isMember = true;
-                        break;
-                    }
-                }
-                if (!isMember) {
-                    group.members.push_back(username);
-                }
-                found = true;
-            }
-            groups.push_back(group);
-        }
-        inFile.close();
+        std::lock_guard<std::mutex> lock(mtx);
         
-        if (!found) return false;
+        auto it = groupIndex.find(groupName);
+        if (it == groupIndex.end()) return false;
         
-        // Rewrite file
-        std::ofstream outFile(groupsFile);
-        outFile << "groupName,createdBy,createdAt,members\n";
-        for (const auto& g : groups) {
-            outFile << escapeCSV(g.groupName) << ","
-                    << escapeCSV(g.createdBy) << ","
-                    << g.createdAt << ","
-                    << joinMembers(g.members) << "\n";
+        if (!joinGroup(it->second, username)) {
+            return true; // Already a member
         }
-        
-        return true;
+        return logGroupOp(GROUP_JOIN, groupName, username);
     }
     
     std::vector<std::string> getGroupMembers(const std::string& groupName) {
         std::lock_guard<std::mutex> lock(mtx);
         
-        std::ifstream file(groupsFile);
-        if (!file.is_open()) return {};
+        auto it = groupIndex.find(groupName);
+        if (it == groupIndex.end()) return {};
         
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            GroupRecord group = parseGroup(line);
-            if (group.groupName == groupName) {
-                return group.members;
-            }
-        }
-        
-        return {};
+        const std::set<std::string>& members = groups[it->second].members;
+        return std::vector<std::string>(members.begin(), members.end());
     }
     
     bool removeGroupMember(const std::string& groupName, const std::string& username) {
-        // Read all groups, modify, rewrite
-        std::vector<GroupRecord> groups;
-        
-        std::ifstream inFile(groupsFile);
-        if (!inFile.is_open()) return false;
-        
-        std::string line;
-        std::getline(inFile, line); // Skip header
-        
-        bool found = false;
-        while (std::getline(inFile, line)) {
-            GroupRecord group = parseGroup(line);
-            if (group.groupName == groupName) {
-                // Remove member
-                auto it = std::find(group.members.begin(), group.members.end(), username);
-                if (it != group.members.end()) {
-                    group.members.erase(it);
-                    found = true;
-                }
-            }
-            groups.push_back(group);
-        }
-        inFile.close();
-        
-        if (!found) return false;
+        std::lock_guard<std::mutex> lock(mtx);
         
-        // Rewrite file
-        std::ofstream outFile(groupsFile);
-        outFile << "groupName,createdBy,createdAt,members\n";
-        for (const auto& g : groups) {
-            outFile << escapeCSV(g.groupName) << ","
-                    << escapeCSV(g.createdBy) << ","
-                    << g.createdAt << ","
-                    << joinMembers(g.members) << "\n";
-        }
+        auto it = groupIndex.find(groupName);
+        if (it == groupIndex.end() || !leaveGroup(it->second, username)) return false;
         
-        return true;
+        return logGroupOp(GROUP_LEAVE, groupName, username);
     }
     
     bool isGroupMember(const std::string& groupName, const std::string& username) {
         std::lock_guard<std::mutex> lock(mtx);
         
-        std::ifstream file(groupsFile);
-        if (!file.is_open()) return false;
-        
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            GroupRecord group = parseGroup(line);
-            if (group.groupName == groupName) {
-                return std::find(group.members.begin(), group.members.end(), username) != group.members.end();
-            }
-        }
+        auto it = userGroups.find(username);
+        return it != userGroups.end() && it->second.count(groupName) > 0;
+    }
+    
+    // Get the groups a user has joined; cost depends only on that user's groups
+    std::vector<std::string> getUserGroups(const std::string& username) {
+        std::lock_guard<std::mutex> lock(mtx);
         
-        return false;
+        auto it = userGroups.find(username);
+        if (it == userGroups.end()) return {};
+        return std::vector<std::string>(it->second.begin(), it->second.end());
     }
     
     // Get all groups with info if user is member
     std::vector<std::pair<std::string, bool>> getAllGroupsWithMembership(const std::string& username) {
         std::lock_guard<std::mutex> lock(mtx);
         std::vector<std::pair<std::string, bool>> result;
+        result.reserve(groups.size());
         
-        std::ifstream file(groupsFile);
-        if (!file.is_open()) return result;
-        
-        std::string line;
-        std::getline(file, line); // Skip header
-        
-        while (std::getline(file, line)) {
-            GroupRecord group = parseGroup(line);
-            bool isMember = std::find(group.members.begin(), group.members.end(), username) != group.members.end();
+        auto joined = userGroups.find(username);
+        for (const GroupEntry& group : groups) {
+            bool isMember = joined != userGroups.end() && joined->second.count(group.groupName) > 0;
             result.push_back({group.groupName, isMember});
         }
         
         return result;
     }
+    
+    // Get all groups with their members
+    std::vector<GroupRecord> getAllGroups() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<GroupRecord> records;
+        records.reserve(groups.size());
+        
+        for (const GroupEntry& group : groups) {
+            records.push_back(toRecord(group));
+        }
+        
+        return records;
+    }
 
 private:
     void createDirectory(const std::string& dir) {
@@ -399,80 +379,88 @@ private:
         #endif
     }
     
-    void initializeFiles() {
-        // Initialize messages file
-        std::ifstream testMsg(messagesFile);
-        if (!testMsg.good()) {
-            std::ofstream file(messagesFile);
-            file << "id,sender,recipient,content,timestamp,isGroup,isFile,filename\n";
-            file.close();
-        }
-        
-        // Initialize users file
-        std::ifstream testUsr(usersFile);
-        if (!testUsr.good()) {
-            std::ofstream file(usersFile);
-            file << "username,passwordHash,createdAt,lastSeen,isOnline\n";
-            file.close();
-        }
-        
-        // Initialize groups file
-        std::ifstream testGrp(groupsFile);
-        if (!testGrp.good()) {
-            std::ofstream file(groupsFile);
-            file << "groupName,createdBy,createdAt,members\n";
-            file.close();
+    // Apply retention.conf if there is one; unknown lines are reported and skipped
+    void loadRetention() {
+        std::ifstream file(retentionFile);
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string kind, topic;
+            uint32_t days;
+            if (!(fields >> kind) || kind[0] == '#') continue;
+            
+            if (kind == "topic" && fields >> topic >> days) {
+                setTopicRetention(topic, days);
+            } else if (kind == "groups" && fields >> days) {
+                setGroupRetention(days);
+            } else if (kind == "direct" && fields >> days) {
+                setDirectRetention(days);
+            } else if (kind == "default" && fields >> days) {
+                setDefaultRetention(days);
+            } else {
+                std::cerr << "[DB] Ignoring retention policy '" << line << "'" << std::endl;
+            }
         }
     }
     
-    void loadNextMessageId() {
+    // Copy messages.csv into the log, keeping the message ids
+    // Rows with ids the log already holds are skipped, so an import cut short by a
+    // crash resumes where it stopped. Once every row is on disk the CSV is renamed
+    // to messages.csv.imported and no longer read.
+    void importLegacyMessages() {
         std::ifstream file(messagesFile);
         if (!file.is_open()) return;
         
+        bool resuming = messageLog.getRecordCount() > 0;
         std::string line;
+        std::getline(file, line); // Skip header
+        
+        size_t imported = 0;
         while (std::getline(file, line)) {
-            if (line.empty() || line[0] == 'i') continue; // Skip header
-            
-            size_t pos = line.find(',');
-            if (pos != std::string::npos) {
-                uint32_t id = std::stoul(line.substr(0, pos));
-                if (id >= nextMessageId) {
-                    nextMessageId = id + 1;
-                }
+            ChatMessage msg = parseMessage(line);
+            if (msg.id != 0 && messageLog.import(msg)) {
+                imported++;
             }
         }
-    }
-    
-    std::string escapeCSV(const std::string& str) {
-        std::string result = str;
-        // Replace commas and newlines
-        for (char& c : result) {
-            if (c == ',') c = ';';
-            if (c == '\n') c = ' ';
-            if (c == '\r') c = ' ';
+        file.close();
+        
+        if (!messageLog.flush()) {
+            std::cerr << "[DB] Could not write all messages of " << messagesFile << ", import resumes at next start" << std::endl;
+            return;
+        }
+        if (imported > 0 || resuming) {
+            std::cout << "[DB] Imported " << imported << " messages from " << messagesFile
+                      << (resuming ? " (resumed)" : "") << std::endl;
+        }
+        if (std::rename(messagesFile.c_str(), (messagesFile + ".imported").c_str()) != 0) {
+            std::cerr << "[DB] Cannot rename " << messagesFile << std::endl;
         }
-        return result;
     }
     
-    std::vector<std::string> splitCSV(const std::string& line) {
+    // Split a line of the old CSV tables
+    static std::vector<std::string> splitCSV(const std::string& line, char separator = ',') {
         std::vector<std::string> result;
-        std::stringstream ss(line);
-        std::string item;
-        while (std::getline(ss, item, ',')) {
-            result.push_back(item);
+        size_t start = 0;
+        while (true) {
+            size_t end = line.find(separator, start);
+            if (end == std::string::npos) {
+                result.push_back(line.substr(start));
+                return result;
+            }
+            result.push_back(line.substr(start, end - start));
+            start = end + 1;
         }
-        return result;
     }
     
     ChatMessage parseMessage(const std::string& line) {
         ChatMessage msg = {0};
         auto parts = splitCSV(line);
         if (parts.size() >= 8) {
-            msg.id = std::stoul(parts[0]);
+            msg.id = strtoul(parts[0].c_str(), nullptr, 10);
             msg.sender = parts[1];
             msg.recipient = parts[2];
             msg.content = parts[3];
-            msg.timestamp = std::stoull(parts[4]);
+            msg.timestamp = strtoull(parts[4].c_str(), nullptr, 10);
             msg.isGroup = (parts[5] == "1");
             msg.isFile = (parts[6] == "1");
             msg.filename = parts[7];
@@ -480,14 +468,15 @@ private:
         return msg;
     }
     
+    // A malformed row (e.g. a line cut short by a crash) gives an empty username
     UserRecord parseUser(const std::string& line) {
         UserRecord user;
         auto parts = splitCSV(line);
-        if (parts.size() >= 5) {
+        if (parts.size() >= 5 && (parts[4] == "0" || parts[4] == "1")) {
             user.username = parts[0];
             user.passwordHash = parts[1];
-            user.createdAt = std::stoull(parts[2]);
-            user.lastSeen = std::stoull(parts[3]);
+            user.createdAt = strtoull(parts[2].c_str(), nullptr, 10);
+            user.lastSeen = strtoull(parts[3].c_str(), nullptr, 10);
             user.isOnline = (parts[4] == "1");
         }
         return user;
@@ -499,11 +488,9 @@ private:
         if (parts.size() >= 4) {
             group.groupName = parts[0];
             group.createdBy = parts[1];
-            group.createdAt = std::stoull(parts[2]);
+            group.createdAt = strtoull(parts[2].c_str(), nullptr, 10);
             // Members are semicolon-separated
-            std::stringstream ss(parts[3]);
-            std::string member;
-            while (std::getline(ss, member, ';')) {
+            for (const std::string& member : splitCSV(parts[3], ';')) {
                 if (!member.empty()) {
                     group.members.push_back(member);
                 }
@@ -512,82 +499,333 @@ private:
         return group;
     }
     
-    std::string joinMembers(const std::vector<std::string>& members) {
-        std::string result;
-        for (size_t i = 0; i < members.size(); i++) {
-            if (i > 0) result += ";";
-            result += members[i];
+    // ============ Binary tables ============
+    
+    // Pass every intact record of a table file to 'apply'; returns how many were read
+    // A damaged record with intact ones after it is reported and skipped. A record
+    // running past the end is a write cut short by a crash: for a change log,
+    // 'repairTail' cuts it off so appends can follow. Other damage is left in place.
+    size_t readRecords(const std::string& path, const std::function<void(RecordCodec::Reader&)>& apply,
+                       bool repairTail = false) {
+        std::vector<char> data;
+        if (!RecordCodec::readFile(path, data)) return 0;
+        
+        const char* p = data.data();
+        const char* end = p + data.size();
+        size_t count = 0;
+        while (p < end) {
+            const char* frame = p;
+            const char* payload;
+            size_t size;
+            RecordCodec::FrameStatus status = RecordCodec::getFrame(p, end, payload, size);
+            if (status != RecordCodec::FRAME_OK) {
+                const char* next = RecordCodec::findFrame(frame, end);
+                if (next) {
+                    std::cerr << "[DB] Skipping " << (next - frame) << " damaged bytes at offset "
+                              << (frame - data.data()) << " of " << path << std::endl;
+                    p = next;
+                    continue;
+                }
+                if (repairTail && status == RecordCodec::FRAME_INCOMPLETE &&
+                    RecordCodec::truncateFile(path, frame - data.data())) {
+                    std::cerr << "[DB] Dropped a torn record (" << (end - frame) << " bytes) at the end of " << path << std::endl;
+                } else {
+                    std::cerr << "[DB] Ignoring " << (end - frame) << " damaged bytes at the end of " << path << std::endl;
+                }
+                break;
+            }
+            RecordCodec::Reader reader(payload, size);
+            apply(reader);
+            count++;
         }
-        return result;
+        return count;
+    }
+    
+    bool appendRecord(std::ofstream& log, const std::string& payload) {
+        if (!log.is_open()) return false;
+        
+        std::string frame;
+        RecordCodec::putFrame(frame, payload);
+        log.write(frame.data(), frame.size());
+        log.flush();
+        return log.good();
+    }
+    
+    static bool fileExists(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        return file.is_open();
     }
     
-    bool userExists(const std::string& username) {
-        std::ifstream file(usersFile);
-        if (!file.is_open()) return false;
+    // Set a user's status and last-seen time; one appended log record, no rewrite
+    bool updateUserStatus(const std::string& username, bool online) {
+        auto it = userIndex.find(username);
+        if (it == userIndex.end()) return false;
         
-        std::string line;
-        std::getline(file, line); // Skip header
+        UserRecord& user = users[it->second];
+        user.isOnline = online;
+        user.lastSeen = time(nullptr);
+        return logUser(user);
+    }
+    
+    // User record: username, passwordHash, createdAt, lastSeen, isOnline
+    static std::string encodeUser(const UserRecord& u) {
+        std::string payload;
+        RecordCodec::putString(payload, u.username);
+        RecordCodec::putString(payload, u.passwordHash);
+        RecordCodec::putVarint(payload, u.createdAt);
+        RecordCodec::putVarint(payload, u.lastSeen);
+        RecordCodec::putVarint(payload, u.isOnline ? 1 : 0);
+        return payload;
+    }
+    
+    void putUser(const UserRecord& user) {
+        if (user.username.empty()) return;
         
-        while (std::getline(file, line)) {
-            UserRecord user = parseUser(line);
-            if (user.username == username) {
-                return true;
-            }
+        auto it = userIndex.find(user.username);
+        if (it == userIndex.end()) {
+            userIndex[user.username] = users.size();
+            users.push_back(user);
+        } else {
+            users[it->second] = user;
         }
-        return false;
     }
     
-    bool groupExists(const std::string& groupName) {
-        std::ifstream file(groupsFile);
-        if (!file.is_open()) return false;
+    // Read users.dat, then replay users.log over it; the log keeps growing until
+    // logUser compacts it. Without users.dat, the CSV tables of older versions are converted instead
+    void loadUsers() {
+        auto apply = [&](RecordCodec::Reader& reader) {
+            UserRecord user;
+            user.username = reader.string();
+            user.passwordHash = reader.string();
+            user.createdAt = reader.varint();
+            user.lastSeen = reader.varint();
+            user.isOnline = reader.varint() != 0;
+            if (reader.ok()) putUser(user);
+        };
+        
+        bool legacy = !fileExists(usersFile) && loadLegacyUsers();
+        if (!legacy) {
+            readRecords(usersFile, apply);
+            userLogEntries = readRecords(userLogFile, apply, true);
+        }
+        
+        userLog.open(userLogFile, std::ios::binary | std::ios::app);
+        if (legacy) {
+            compactUsers();
+            std::cout << "[DB] Converted " << users.size() << " users from " << legacyUsersFile << std::endl;
+        }
+    }
+    
+    // users.csv and its row log; returns false if there is no CSV table
+    bool loadLegacyUsers() {
+        std::ifstream csv(legacyUsersFile);
+        if (!csv.is_open()) return false;
         
         std::string line;
-        std::getline(file, line); // Skip header
+        std::getline(csv, line); // Skip header
+        while (std::getline(csv, line)) {
+            putUser(parseUser(line));
+        }
         
-        while (std::getline(file, line)) {
-            GroupRecord group = parseGroup(line);
-            if (group.groupName == groupName) {
-                return true;
-            }
+        std::ifstream log(userLogFile);
+        while (log.is_open() && std::getline(log, line)) {
+            putUser(parseUser(line));
         }
-        return false;
+        return true;
     }
     
-    bool updateLastSeen(const std::string& username) {
-        return updateUserStatus(username, true);
+    // Append a user's current record to the change log, compacting when it grows past the table
+    bool logUser(const UserRecord& user) {
+        bool ok = appendRecord(userLog, encodeUser(user));
+        if (++userLogEntries >= std::max((size_t)USER_LOG_COMPACT_MIN, users.size())) {
+            compactUsers();
+        }
+        return ok;
     }
     
-    bool updateUserStatus(const std::string& username, bool online) {
-        std::vector<UserRecord> users;
+    // Write the table as a new users.dat, then start an empty change log
+    // Records are whole users, so replaying a log that survived a crash here is harmless
+    bool compactUsers() {
+        std::string data;
+        for (const UserRecord& u : users) {
+            RecordCodec::putFrame(data, encodeUser(u));
+        }
+        if (!RecordCodec::replaceFile(usersFile, data)) {
+            return false;
+        }
         
-        std::ifstream inFile(usersFile);
-        if (!inFile.is_open()) return false;
+        userLog.close();
+        userLog.open(userLogFile, std::ios::binary | std::ios::trunc);
+        userLogEntries = 0;
+        return userLog.is_open();
+    }
+    
+    GroupRecord toRecord(const GroupEntry& group) {
+        GroupRecord record;
+        record.groupName = group.groupName;
+        record.createdBy = group.createdBy;
+        record.createdAt = group.createdAt;
+        record.members.assign(group.members.begin(), group.members.end());
+        return record;
+    }
+    
+    // Register a group with its creator as the first member
+    void createGroup(const std::string& name, const std::string& createdBy, uint64_t createdAt) {
+        GroupEntry group;
+        group.groupName = name;
+        group.createdBy = createdBy;
+        group.createdAt = createdAt;
+        groupIndex[name] = groups.size();
+        groups.push_back(group);
+        joinGroup(groups.size() - 1, createdBy);
+    }
+    
+    // Returns false if the user already was a member
+    bool joinGroup(size_t pos, const std::string& user) {
+        GroupEntry& group = groups[pos];
+        if (user.empty() || !group.members.insert(user).second) return false;
+        
+        userGroups[user].insert(group.groupName);
+        membershipCount++;
+        return true;
+    }
+    
+    // Returns false if the user was not a member
+    bool leaveGroup(size_t pos, const std::string& user) {
+        GroupEntry& group = groups[pos];
+        if (group.members.erase(user) == 0) return false;
+        
+        auto it = userGroups.find(user);
+        if (it != userGroups.end()) {
+            it->second.erase(group.groupName);
+            if (it->second.empty()) userGroups.erase(it);
+        }
+        membershipCount--;
+        return true;
+    }
+    
+    // Rebuild the registry from groups.dat and the operations logged since
+    // Without groups.dat, the CSV tables of older versions are converted instead
+    void loadGroups() {
+        bool legacy = !fileExists(groupsFile) && loadLegacyGroups();
+        if (!legacy) {
+            readRecords(groupsFile, [&](RecordCodec::Reader& reader) {
+                GroupRecord record;
+                record.groupName = reader.string();
+                record.createdBy = reader.string();
+                record.createdAt = reader.varint();
+                uint64_t count = reader.varint();
+                for (uint64_t i = 0; i < count && reader.ok(); i++) {
+                    record.members.push_back(reader.string());
+                }
+                if (reader.ok()) putGroup(record);
+            });
+            
+            // Operation, group, then creator and creation time or the member joining/leaving
+            groupLogEntries = readRecords(groupLogFile, [&](RecordCodec::Reader& reader) {
+                uint64_t op = reader.varint();
+                std::string name = reader.string();
+                std::string user = reader.string();
+                uint64_t createdAt = op == GROUP_CREATE ? reader.varint() : 0;
+                if (!reader.ok() || name.empty()) return;
+                
+                auto it = groupIndex.find(name);
+                if (op == GROUP_CREATE && it == groupIndex.end()) {
+                    createGroup(name, user, createdAt);
+                } else if (op == GROUP_JOIN && it != groupIndex.end()) {
+                    joinGroup(it->second, user);
+                } else if (op == GROUP_LEAVE && it != groupIndex.end()) {
+                    leaveGroup(it->second, user);
+                }
+            }, true);
+        }
+        
+        groupLog.open(groupLogFile, std::ios::binary | std::ios::app);
+        if (legacy) {
+            compactGroups();
+            std::cout << "[DB] Converted " << groups.size() << " groups from " << legacyGroupsFile << std::endl;
+        }
+    }
+    
+    void putGroup(const GroupRecord& record) {
+        if (record.groupName.empty() || groupIndex.count(record.groupName)) return;
+        
+        createGroup(record.groupName, "", record.createdAt);
+        groups.back().createdBy = record.createdBy;
+        for (const std::string& member : record.members) {
+            joinGroup(groups.size() - 1, member);
+        }
+    }
+    
+    // groups.csv and its operation log; returns false if there is no CSV table
+    bool loadLegacyGroups() {
+        std::ifstream csv(legacyGroupsFile);
+        if (!csv.is_open()) return false;
         
         std::string line;
-        std::getline(inFile, line); // Skip header
+        std::getline(csv, line); // Skip header
+        while (std::getline(csv, line)) {
+            putGroup(parseGroup(line));
+        }
         
-        while (std::getline(inFile, line)) {
-            UserRecord user = parseUser(line);
-            if (user.username == username) {
-                user.isOnline = online;
-                user.lastSeen = time(nullptr);
+        // G,group,createdBy,createdAt | J,group,user | L,group,user
+        std::ifstream log(groupLogFile);
+        while (log.is_open() && std::getline(log, line)) {
+            auto parts = splitCSV(line);
+            if (parts.size() < 3) continue;
+            
+            auto it = groupIndex.find(parts[1]);
+            if (parts[0] == "G" && parts.size() >= 4 && it == groupIndex.end()) {
+                createGroup(parts[1], parts[2], strtoull(parts[3].c_str(), nullptr, 10));
+            } else if (parts[0] == "J" && it != groupIndex.end()) {
+                joinGroup(it->second, parts[2]);
+            } else if (parts[0] == "L" && it != groupIndex.end()) {
+                leaveGroup(it->second, parts[2]);
             }
-            users.push_back(user);
         }
-        inFile.close();
+        return true;
+    }
+    
+    // Append one operation; compact once the log outgrows the registry
+    bool logGroupOp(GroupOp op, const std::string& group, const std::string& user, uint64_t createdAt = 0) {
+        std::string payload;
+        RecordCodec::putVarint(payload, op);
+        RecordCodec::putString(payload, group);
+        RecordCodec::putString(payload, user);
+        if (op == GROUP_CREATE) {
+            RecordCodec::putVarint(payload, createdAt);
+        }
+        bool ok = appendRecord(groupLog, payload);
         
-        // Rewrite file
-        std::ofstream outFile(usersFile);
-        outFile << "username,passwordHash,createdAt,lastSeen,isOnline\n";
-        for (const auto& u : users) {
-            outFile << escapeCSV(u.username) << ","
-                    << escapeCSV(u.passwordHash) << ","
-                    << u.createdAt << ","
-                    << u.lastSeen << ","
-                    << (u.isOnline ? "1" : "0") << "\n";
+        if (++groupLogEntries >= std::max((size_t)GROUP_LOG_COMPACT_MIN, groups.size() + membershipCount)) {
+            compactGroups();
+        }
+        return ok;
+    }
+    
+    // Write the registry as a new groups.dat, then start an empty change log
+    // Record: groupName, createdBy, createdAt, member count, members
+    bool compactGroups() {
+        std::string data;
+        for (const GroupEntry& g : groups) {
+            std::string payload;
+            RecordCodec::putString(payload, g.groupName);
+            RecordCodec::putString(payload, g.createdBy);
+            RecordCodec::putVarint(payload, g.createdAt);
+            RecordCodec::putVarint(payload, g.members.size());
+            for (const std::string& member : g.members) {
+                RecordCodec::putString(payload, member);
+            }
+            RecordCodec::putFrame(data, payload);
+        }
+        if (!RecordCodec::replaceFile(groupsFile, data)) {
+            return false;
         }
         
-        return true;
+        groupLog.close();
+        groupLog.open(groupLogFile, std::ios::binary | std::ios::trunc);
+        groupLogEntries = 0;
+        return groupLog.is_open();
     }
 };
 
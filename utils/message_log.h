@@ -0,0 +1,1607 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <ctime>
+#include <fcntl.h>
+#include "record_codec.h"
+#include "bloom_filter.h"
+
+// Cross-platform file access and directory listing
+#ifdef _WIN32
+    #include <windows.h>
+    #include <direct.h>
+    #include <io.h>
+    #include <sys/stat.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/types.h>
+    #include <dirent.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+#endif
+
+#define MESSAGE_LOG_SEGMENT_SIZE (16 * 1024 * 1024) // Bytes per segment before rolling to a new file
+#define MESSAGE_LOG_PARTITION_SECONDS 86400          // Segments also roll over when a record starts a new (UTC) day
+#define MESSAGE_LOG_QUEUE_LIMIT (8 * 1024 * 1024)   // Bytes waiting for the writer before append() blocks
+#define MESSAGE_LOG_SYNC_INTERVAL_MS 100             // Default fsync period for LOG_SYNC_INTERVAL
+#define MESSAGE_LOG_ANCHOR_INTERVAL 64               // Every Nth record of a conversation is indexed
+#define MESSAGE_LOG_CHECKPOINT_INTERVAL 100000       // Records appended between checkpoints
+#define MESSAGE_LOG_MAINTENANCE_MS 60000             // How often the maintenance thread looks for work
+#define MESSAGE_LOG_FOREVER UINT64_MAX               // Expiry of records without a retention limit
+#define MESSAGE_LOG_MAGIC "CHATLOG3"                 // First bytes of every segment file
+#define MESSAGE_LOG_MAGIC_SIZE 8
+#define MESSAGE_LOG_CHECKPOINT_TAG "CHATIDX4"        // First field of the checkpoint, tells its format
+
+// When the writer thread makes appended records durable
+enum LogSyncMode {
+    LOG_SYNC_BATCH,     // fsync after every batch it writes
+    LOG_SYNC_INTERVAL,  // fsync at most every syncIntervalMs
+    LOG_SYNC_NEVER      // leave flushing to the OS
+};
+
+// Record flags
+#define LOG_FLAG_GROUP 0x01
+#define LOG_FLAG_FILE  0x02
+#define LOG_FLAG_SEQ   0x04     // The record ends with its position in the conversation
+
+struct ChatMessage {
+    uint32_t id;
+    std::string sender;
+    std::string recipient; // username or group name
+    std::string content;
+    uint64_t timestamp;
+    bool isGroup;
+    bool isFile;
+    std::string filename;
+    uint32_t seq;          // 1-based position in its conversation; set by append and reads
+};
+
+// Append-only message store: records go to numbered segment files
+// (<dir>/<n>.seg) that roll over at MESSAGE_LOG_SEGMENT_SIZE and at the start
+// of each day (MESSAGE_LOG_PARTITION_SECONDS), so a segment spans at most one day. A segment
+// starts with MESSAGE_LOG_MAGIC, then holds one RecordCodec frame per
+// message: id, timestamp, location of the previous record of the same
+// conversation, flags, sender, recipient, filename, content.
+// Each conversation (group topic or DM pair) is thus a chain running
+// backward from its newest record. Memory holds each chain's head and
+// every MESSAGE_LOG_ANCHOR_INTERVAL-th record as an anchor. History reads
+// walk a chain through memory-mapped segments, starting at the head or at
+// the anchor nearest their id/time bound, and stop once they have enough,
+// so their cost depends on how far back they reach, not on the log size.
+// Heads and anchors are saved in a checkpoint (<dir>/checkpoint) every
+// MESSAGE_LOG_CHECKPOINT_INTERVAL records and on close, along with how far
+// each segment was written; opening the log loads the checkpoint and scans
+// only the bytes written after it. A checkpoint appends a section holding
+// the conversations changed since the previous one; the writer thread keeps
+// its own copy of the index and rewrites the file as a single snapshot once
+// the appended sections outgrow it, so the lock is held only to copy changes.
+// Appends only encode and queue the record; a writer thread writes whatever
+// has queued up in one batch (group commit), opens new segments and syncs
+// according to the LogSyncMode. Records still queued are read from memory.
+// Retention policies limit how long a conversation's messages are kept.
+// Reads never return expired records, and a walk never enters a segment
+// whose newest record is older than the window it reads. A low-priority
+// maintenance thread deletes sealed segments once every record in them has
+// expired. Segments are deleted whole, never rewritten: newer records link
+// back into them, so records cannot move.
+// Each segment has a Bloom filter of the conversations it holds, saved as
+// <dir>/<n>.bloom once it is sealed. History reads follow chains and never
+// need it. Scans of whole segments use it to skip those that cannot hold a
+// conversation: a retention change for one conversation rescans only the
+// segments that may contain it.
+class MessageLog {
+private:
+    // Where a record lives; a zero length means no record
+    struct RecordRef {
+        uint32_t segment;   // Segment number
+        uint32_t offset;
+        uint32_t length;    // Whole frame
+    };
+    
+    struct Anchor {
+        uint32_t id;
+        uint64_t timestamp;
+        RecordRef ref;
+    };
+    
+    struct Conversation {
+        RecordRef last;     // Newest record, head of the chain
+        uint32_t count;
+        std::vector<Anchor> anchors;    // Records 0, N, 2N, ... of the chain, oldest first
+        uint32_t savedAnchors;  // Leading anchors the writer's copy already holds
+        bool unsaved;           // Changed since the last checkpoint was taken
+    };
+    
+    // A conversation copied for a checkpoint; it holds the anchors from 'anchorsFrom' on
+    struct ConversationUpdate {
+        std::string key;
+        Conversation conversation;
+        uint32_t anchorsFrom;
+    };
+    
+    struct Segment {
+        uint32_t number;
+        int fd;             // -1 until the writer creates the file
+        const char* map;    // Read-only mapping of the file, null where unavailable
+        size_t mapLength;
+        uint64_t size;      // Bytes appended, queued ones included
+        uint64_t written;   // Bytes the writer has written
+        uint64_t firstTime; // Timestamps of its first and newest records
+        uint64_t lastTime;
+        uint64_t expiresAt; // When the last of its records passes its retention
+        bool expiryKnown;   // expiresAt is up to date with the retention policies
+        BloomFilter keys;   // Conversation keys of its records
+        bool keysKnown;     // keys covers every record, not just those scanned since the checkpoint
+        bool keysSaved;     // keys is in its .bloom file
+    };
+    
+    // Contiguous queued bytes of one segment
+    struct PendingWrite {
+        uint32_t segment;   // Segment number
+        uint64_t offset;
+        std::vector<char> data;
+        bool claimed;       // Taken by the writer; later records start a new entry
+    };
+    
+    std::string logDir;
+    std::vector<Segment> segments;                          // Oldest first, the last one takes appends
+    uint32_t nextSegmentNumber;
+    std::unordered_map<std::string, Conversation> conversations;  // conversation key -> chain head
+    uint32_t nextId;
+    uint64_t recordCount;
+    uint64_t checkpointRecords;     // recordCount as of the last checkpoint
+    bool checkpointDue;             // Segments were deleted since the last checkpoint
+    std::vector<std::pair<const std::string, Conversation>*> unsavedConversations;  // Changed since the last checkpoint
+    
+    // Owned by the writer thread once the log is open
+    std::unordered_map<std::string, Conversation> savedConversations;   // Conversations as of the last checkpoint
+    uint64_t checkpointBytes;       // Size of the checkpoint file
+    uint64_t snapshotBytes;         // Size of its first section, the snapshot
+    bool snapshotDue;               // The next checkpoint rewrites the file
+    
+    std::map<std::string, uint64_t> retention;  // Policy key -> seconds to keep, 0 for ever (see setRetention)
+    uint64_t retentionVersion;      // Bumped on every policy change
+    bool maintenancePending;        // Wake the maintenance thread now
+    
+    std::deque<PendingWrite> pendingWrites;  // Oldest first; references stay valid as entries are added
+    size_t pendingBytes;
+    uint64_t batchCount;
+    LogSyncMode syncMode;
+    int syncIntervalMs;
+    bool stopping;
+    bool writeFailed;
+    std::mutex mtx;
+    std::condition_variable writeReady;
+    std::condition_variable spaceFreed;
+    std::condition_variable maintenanceWake;
+    std::thread writer;
+    std::thread maintenanceThread;
+
+public:
+    MessageLog() : nextSegmentNumber(0), nextId(1), recordCount(0), checkpointRecords(0), checkpointDue(false),
+                   checkpointBytes(0), snapshotBytes(0), snapshotDue(true), retentionVersion(0), maintenancePending(false), pendingBytes(0), batchCount(0),
+                   syncMode(LOG_SYNC_INTERVAL), syncIntervalMs(MESSAGE_LOG_SYNC_INTERVAL_MS),
+                   stopping(false), writeFailed(false) {}
+    
+    // Writes everything still queued, then closes the segments
+    ~MessageLog() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            writeReady.notify_all();
+            maintenanceWake.notify_all();
+            writer.join();
+            maintenanceThread.join();
+        }
+        for (const Segment& segment : segments) {
+            unmapFile(segment.map, segment.mapLength);
+            if (segment.fd >= 0) closeFile(segment.fd);
+        }
+    }
+    
+    // Choose when appended records are fsynced (see LogSyncMode)
+    void setSyncMode(LogSyncMode mode, int intervalMs = MESSAGE_LOG_SYNC_INTERVAL_MS) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            syncMode = mode;
+            syncIntervalMs = intervalMs > 0 ? intervalMs : 1;
+        }
+        writeReady.notify_all();
+    }
+    
+    // Keep messages for 'seconds' (0: for ever). 'key' is a conversation key, "#" or "@"
+    // for every group or direct conversation without a policy of its own, or "" for the rest
+    // Best set before open(), which can then trust the expiry the checkpoint saved
+    void setRetention(const std::string& key, uint64_t seconds) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = retention.find(key);
+            if (it != retention.end() && it->second == seconds) return;
+            
+            retention[key] = seconds;
+            retentionVersion++;
+            std::set<std::string> changed;
+            changed.insert(key);
+            for (Segment& segment : segments) {
+                if (mayHold(segment, changed)) segment.expiryKnown = false;
+            }
+            maintenancePending = true;
+        }
+        maintenanceWake.notify_all();
+    }
+    
+    // Open (or create) the log in a directory and index its records
+    void open(const std::string& directory) {
+        std::lock_guard<std::mutex> lock(mtx);
+        logDir = directory;
+        createDirectory(logDir);
+        
+        std::vector<uint32_t> numbers = listSegments();
+        std::sort(numbers.begin(), numbers.end());
+        for (uint32_t number : numbers) {
+            std::string path = segmentPath(number);
+            int fd = openFile(path);
+            if (fd < 0) {
+                std::cerr << "[LOG] Cannot open " << path << std::endl;
+                continue;
+            }
+            nextSegmentNumber = number + 1;
+            segments.push_back(Segment{number, fd, nullptr, 0, 0, 0, 0, 0, 0, false, BloomFilter(), false, false});
+            loadKeys(segments.back());
+        }
+        
+        // Resume from the checkpoint if it matches the files; otherwise scan them all
+        std::map<uint32_t, uint64_t> covered;   // segment number -> bytes the checkpoint covers
+        if (!loadCheckpoint(covered)) {
+            covered.clear();
+            conversations.clear();
+            nextId = 1;
+            recordCount = 0;
+        }
+        checkpointRecords = recordCount;
+        
+        for (size_t i = 0; i < segments.size(); ) {
+            auto from = covered.find(segments[i].number);
+            bool torn = false;
+            if (!scanSegment(segments[i], from != covered.end() ? from->second : 0, i + 1 == segments.size(), torn)) {
+                std::cerr << "[LOG] " << segmentPath(segments[i].number) << " is not a " << MESSAGE_LOG_MAGIC
+                          << " segment, skipping it" << std::endl;
+                unmapFile(segments[i].map, segments[i].mapLength);
+                closeFile(segments[i].fd);
+                segments.erase(segments.begin() + i);
+                continue;
+            }
+            
+            // A batch that spanned a rollover can be torn in this segment but not the next;
+            // the next records would link back into lost ones, so the log is kept a prefix
+            if (torn && i + 1 < segments.size()) {
+                bool coveredLater = false;
+                for (size_t j = i + 1; j < segments.size(); j++) {
+                    coveredLater = coveredLater || covered.count(segments[j].number) > 0;
+                    dropSegment(segments[j]);
+                }
+                segments.resize(i + 1);
+                nextSegmentNumber = segments[i].number + 1;
+                
+                if (coveredLater) {
+                    // The checkpoint points into the dropped segments: index everything again
+                    for (Segment& segment : segments) {
+                        unmapFile(segment.map, segment.mapLength);
+                        segment.map = nullptr;
+                    }
+                    covered.clear();
+                    conversations.clear();
+                    nextId = 1;
+                    recordCount = 0;
+                    checkpointRecords = 0;
+                    i = 0;
+                    continue;
+                }
+            }
+            i++;
+        }
+        
+        if (!segments.empty()) {
+            std::cout << "[LOG] Opened " << segments.size() << " segments, " << recordCount
+                      << " messages in " << conversations.size() << " conversations ("
+                      << (recordCount - checkpointRecords) << " read after the checkpoint)" << std::endl;
+        }
+        
+        // The writer's copy starts from the index as loaded; its first checkpoint is a snapshot
+        unsavedConversations.clear();
+        for (auto& c : conversations) {
+            c.second.savedAnchors = (uint32_t)c.second.anchors.size();
+            c.second.unsaved = false;
+        }
+        savedConversations = conversations;
+        snapshotDue = true;
+        
+        maintenancePending = true;    // Clear out what expired while the log was closed
+        writer = std::thread(&MessageLog::writerLoop, this);
+        maintenanceThread = std::thread(&MessageLog::maintenanceLoop, this);
+    }
+    
+    // Conversation keys: groups and DM pairs live in separate namespaces
+    static std::string groupKey(const std::string& topic) {
+        return "#" + topic;
+    }
+    
+    static std::string directKey(const std::string& user1, const std::string& user2) {
+        return user1 < user2 ? "@" + user1 + '\0' + user2 : "@" + user2 + '\0' + user1;
+    }
+    
+    // Append a message, assigning it the next id
+    // Returns once the record is queued; it is readable at once and written by the writer thread
+    bool append(ChatMessage& msg) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!waitForSpace(lock)) {
+            return false;
+        }
+        msg.id = nextId++;
+        queueRecord(msg);
+        msg.seq = conversations[keyFor(msg)].count;
+        return true;
+    }
+    
+    // Append a message that already has an id (imports); ids must keep increasing
+    bool import(const ChatMessage& msg) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (msg.id < nextId || !waitForSpace(lock)) {
+            return false;
+        }
+        queueRecord(msg);
+        nextId = msg.id + 1;
+        return true;
+    }
+    
+    // Wait until every queued record is written and synced to disk
+    // Returns false if the writer failed with records still queued
+    bool flush() {
+        std::unique_lock<std::mutex> lock(mtx);
+        writeReady.notify_all();
+        spaceFreed.wait(lock, [&]() { return pendingWrites.empty() || writeFailed; });
+        bool ok = true;
+        for (const Segment& segment : segments) {
+            if (segment.fd >= 0 && !syncFile(segment.fd)) ok = false;
+        }
+        return ok && pendingWrites.empty();
+    }
+    
+    // Get the last 'limit' messages of a conversation (oldest first), with their positions
+    std::vector<ChatMessage> readLast(const std::string& key, size_t limit) {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<RecordRef> picked;
+        if (limit == 0) return std::vector<ChatMessage>();
+        
+        auto it = conversations.find(key);
+        if (it == conversations.end()) return std::vector<ChatMessage>();
+        
+        uint64_t cutoff = retentionCutoff(key);
+        walkBack(it->second, it->second.last, cutoff, [&](const RecordRef& ref, uint32_t, uint64_t timestamp) {
+            if (timestamp < cutoff) return false;
+            picked.push_back(ref);
+            return picked.size() < limit;
+        });
+        return readRecords(picked, it->second.count);
+    }
+    
+    // Get a page of a conversation within an id/time window (zero bounds are open)
+    // Returns the newest 'limit' matches, or the oldest when paging forward from afterId.
+    // The walk starts at the anchor just past the window, stops at afterId or
+    // fromTime (or the retention cutoff) or once the page is full, and only the
+    // returned records are decoded in full.
+    std::vector<ChatMessage> readPage(const std::string& key, uint32_t beforeId, uint32_t afterId,
+                                      uint64_t fromTime, uint64_t toTime,
+                                      size_t limit, bool* hasMore) {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<RecordRef> picked;  // Newest first
+        if (hasMore) *hasMore = false;
+        if (limit == 0) return std::vector<ChatMessage>();
+        
+        auto it = conversations.find(key);
+        if (it == conversations.end()) return std::vector<ChatMessage>();
+        
+        bool forward = afterId && !beforeId;
+        uint64_t minTime = std::max(fromTime, retentionCutoff(key));
+        walkBack(it->second, startOf(it->second, beforeId, afterId, minTime, toTime, forward ? limit : 0), minTime,
+                 [&](const RecordRef& ref, uint32_t id, uint64_t timestamp) {
+            if ((afterId && id <= afterId) || timestamp < minTime) {
+                return false;   // Ids and times only get older from here
+            }
+            if ((beforeId && id >= beforeId) || (toTime && timestamp > toTime)) {
+                return true;
+            }
+            if (!forward && picked.size() == limit) {
+                if (hasMore) *hasMore = true;
+                return false;
+            }
+            picked.push_back(ref);
+            return true;
+        });
+        
+        if (forward && picked.size() > limit) {
+            if (hasMore) *hasMore = true;
+            picked.erase(picked.begin(), picked.end() - limit);
+        }
+        return readRecords(picked);
+    }
+    
+    // Time before which a conversation's records have expired (0 when none expire)
+    uint64_t expiryCutoff(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return retentionCutoff(key);
+    }
+    
+    // Get the users 'user' has direct messages with
+    std::vector<std::string> directPeers(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<std::string> peers;
+        for (const auto& entry : conversations) {
+            const std::string& key = entry.first;
+            size_t split = key.find('\0');
+            if (key[0] != '@' || split == std::string::npos) continue;
+            if (key.compare(1, split - 1, user) == 0) {
+                peers.push_back(key.substr(split + 1));
+            } else if (key.compare(split + 1, std::string::npos, user) == 0) {
+                peers.push_back(key.substr(1, split - 1));
+            }
+        }
+        return peers;
+    }
+    
+    // Count messages appended to a conversation, expired ones included
+    uint32_t count(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = conversations.find(key);
+        return it != conversations.end() ? it->second.count : 0;
+    }
+    
+    // Get total records in the log
+    uint64_t getRecordCount() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return recordCount;
+    }
+    
+    // Get number of segment files
+    size_t getSegmentCount() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return segments.size();
+    }
+    
+    // Get number of batches the writer has written (records / batches = group commit size)
+    uint64_t getBatchCount() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return batchCount;
+    }
+
+private:
+    static std::string keyFor(const ChatMessage& msg) {
+        return msg.isGroup ? groupKey(msg.recipient) : directKey(msg.sender, msg.recipient);
+    }
+    
+    std::string segmentPath(uint32_t number) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%08u.seg", number);
+        return logDir + "/" + name;
+    }
+    
+    // Follow the records of one segment from 'from' on to the conversation heads.
+    // A damaged record with intact ones after it is reported and skipped, and the
+    // file left as it is. Damage nothing intact follows is a torn tail (crash
+    // mid-append) when the record runs past the end of the file or the segment
+    // is the newest one ('last'): it is cut off and 'torn' set. A damaged end of
+    // an older segment is reported and kept.
+    // Returns false if the file is not a segment of this format
+    bool scanSegment(Segment& segment, uint64_t from, bool last, bool& torn) {
+        uint64_t fileSize = sizeOf(segment.fd);
+        if (fileSize < MESSAGE_LOG_MAGIC_SIZE) {
+            // Created but never written: give it its magic
+            truncateFile(segment.fd, 0);
+            if (!writeAt(segment.fd, 0, MESSAGE_LOG_MAGIC, MESSAGE_LOG_MAGIC_SIZE)) return false;
+            fileSize = MESSAGE_LOG_MAGIC_SIZE;
+        }
+        
+        segment.mapLength = std::max((size_t)fileSize, (size_t)MESSAGE_LOG_SEGMENT_SIZE);
+        segment.map = mapFile(segment.fd, segment.mapLength);
+        std::vector<char> buffer;
+        const char* begin = segment.map;
+        if (!begin) {
+            segment.mapLength = 0;
+            buffer.resize(fileSize);
+            if (!readAt(segment.fd, 0, buffer.data(), buffer.size())) return false;
+            begin = buffer.data();
+        }
+        if (memcmp(begin, MESSAGE_LOG_MAGIC, MESSAGE_LOG_MAGIC_SIZE) != 0) return false;
+        
+        if (from <= MESSAGE_LOG_MAGIC_SIZE) {
+            segment.firstTime = segment.lastTime = segment.expiresAt = 0;
+            segment.expiryKnown = true;
+            segment.keys.clear();
+            segment.keysKnown = true;
+        }
+        
+        const char* end = begin + fileSize;
+        const char* p = begin + std::max(from, (uint64_t)MESSAGE_LOG_MAGIC_SIZE);
+        RecordCodec::FrameStatus status = RecordCodec::FRAME_OK;
+        while (p < end) {
+            const char* frame = p;
+            const char* payload;
+            size_t size;
+            ChatMessage msg;
+            status = RecordCodec::getFrame(p, end, payload, size);
+            if (status != RecordCodec::FRAME_OK || !decodeRecord(payload, size, msg)) {
+                if (status == RecordCodec::FRAME_OK) status = RecordCodec::FRAME_CORRUPT;
+                p = frame;
+                const char* next = findIntact(frame, end);
+                if (!next) break;
+                
+                std::cerr << "[LOG] Skipping " << (next - frame) << " damaged bytes at offset " << (frame - begin)
+                          << " of " << segmentPath(segment.number) << ", keeping the records after them" << std::endl;
+                p = next;
+                continue;
+            }
+            std::string key = keyFor(msg);
+            addRecord(conversations[key], msg,
+                      RecordRef{segment.number, (uint32_t)(frame - begin), (uint32_t)(p - frame)}, msg.seq);
+            noteRecord(segment, key, msg.timestamp, frame - begin == MESSAGE_LOG_MAGIC_SIZE);
+            recordCount++;
+            if (msg.id >= nextId) {
+                nextId = msg.id + 1;
+            }
+        }
+        
+        uint64_t offset = p - begin;
+        if (offset < fileSize && (status == RecordCodec::FRAME_INCOMPLETE || last)) {
+            std::cerr << "[LOG] Dropping " << (fileSize - offset) << " bytes of a torn record at the end of "
+                      << segmentPath(segment.number) << std::endl;
+            truncateFile(segment.fd, offset);
+            torn = true;
+        } else if (offset < fileSize) {
+            std::cerr << "[LOG] Keeping " << (fileSize - offset) << " damaged bytes at the end of "
+                      << segmentPath(segment.number) << std::endl;
+            offset = fileSize;
+        }
+        segment.size = offset;
+        segment.written = offset;
+        return true;
+    }
+    
+    // Close a segment and rename it out of the log, keeping its bytes for inspection
+    void dropSegment(Segment& segment) {
+        std::string path = segmentPath(segment.number);
+        unmapFile(segment.map, segment.mapLength);
+        closeFile(segment.fd);
+        std::cerr << "[LOG] Moving " << path << " aside: it follows a torn segment" << std::endl;
+        if (std::rename(path.c_str(), (path + ".dropped").c_str()) != 0) {
+            std::cerr << "[LOG] Cannot rename " << path << std::endl;
+        }
+        std::remove(keysPath(segment.number).c_str());  // Its number will be reused
+    }
+    
+    // Block while the queue is full; fails instead if the writer cannot write
+    bool waitForSpace(std::unique_lock<std::mutex>& lock) {
+        spaceFreed.wait(lock, [&]() { return pendingBytes < MESSAGE_LOG_QUEUE_LIMIT || writeFailed || stopping; });
+        return pendingBytes < MESSAGE_LOG_QUEUE_LIMIT;
+    }
+    
+    // Encode a record, give it its place in the log and queue it for the writer
+    void queueRecord(const ChatMessage& msg) {
+        std::string key = keyFor(msg);
+        auto entry = conversations.find(key);
+        if (entry == conversations.end()) {
+            entry = conversations.emplace(key, Conversation()).first;
+        }
+        markUnsaved(*entry);
+        Conversation& conversation = entry->second;
+        const RecordRef& prev = conversation.last;
+        
+        std::string payload;
+        RecordCodec::putVarint(payload, msg.id);
+        RecordCodec::putVarint(payload, msg.timestamp);
+        RecordCodec::putVarint(payload, prev.segment);
+        RecordCodec::putVarint(payload, prev.offset);
+        RecordCodec::putVarint(payload, prev.length);
+        RecordCodec::putVarint(payload, (msg.isGroup ? LOG_FLAG_GROUP : 0) | (msg.isFile ? LOG_FLAG_FILE : 0) | LOG_FLAG_SEQ);
+        RecordCodec::putString(payload, msg.sender);
+        RecordCodec::putString(payload, msg.recipient);
+        RecordCodec::putString(payload, msg.filename);
+        RecordCodec::putString(payload, msg.content);
+        RecordCodec::putVarint(payload, conversation.count + 1);
+        std::string record;
+        RecordCodec::putFrame(record, payload);
+        size_t recordLength = record.size();
+        
+        // The writer creates the file of a new segment; appends never wait on an open
+        if (segments.empty() ||
+            (segments.back().size > MESSAGE_LOG_MAGIC_SIZE &&
+             (segments.back().size + recordLength > MESSAGE_LOG_SEGMENT_SIZE ||
+              msg.timestamp / MESSAGE_LOG_PARTITION_SECONDS > segments.back().firstTime / MESSAGE_LOG_PARTITION_SECONDS))) {
+            segments.push_back(Segment{nextSegmentNumber++, -1, nullptr, 0, MESSAGE_LOG_MAGIC_SIZE, 0, 0, 0, 0, true,
+                                       BloomFilter(), true, false});
+            pendingWrites.push_back(PendingWrite{segments.back().number, 0,
+                                                 std::vector<char>(MESSAGE_LOG_MAGIC, MESSAGE_LOG_MAGIC + MESSAGE_LOG_MAGIC_SIZE),
+                                                 false});
+            pendingBytes += MESSAGE_LOG_MAGIC_SIZE;
+        }
+        Segment& segment = segments.back();
+        
+        if (pendingWrites.empty() || pendingWrites.back().claimed || pendingWrites.back().segment != segment.number) {
+            pendingWrites.push_back(PendingWrite{segment.number, segment.size, std::vector<char>(), false});
+        }
+        std::vector<char>& data = pendingWrites.back().data;
+        data.insert(data.end(), record.begin(), record.end());
+        pendingBytes += recordLength;
+        
+        addRecord(conversation, msg, RecordRef{segment.number, (uint32_t)segment.size, (uint32_t)recordLength},
+                  conversation.count + 1);
+        noteRecord(segment, key, msg.timestamp, segment.size == MESSAGE_LOG_MAGIC_SIZE);
+        segment.size += recordLength;
+        recordCount++;
+        writeReady.notify_one();
+    }
+    
+    // Writer thread: take everything queued, write it without holding the lock,
+    // then sync as the mode asks. Records appended meanwhile form the next batch.
+    void writerLoop() {
+        typedef std::chrono::steady_clock Clock;
+        std::set<int> unsynced;     // Files written since the last fsync
+        Clock::time_point lastSync = Clock::now();
+        
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            auto hasWork = [&]() { return (!pendingWrites.empty() && !writeFailed) || stopping; };
+            if (syncMode == LOG_SYNC_INTERVAL && !unsynced.empty()) {
+                writeReady.wait_until(lock, lastSync + std::chrono::milliseconds(syncIntervalMs), hasWork);
+            } else {
+                writeReady.wait(lock, hasWork);
+            }
+            
+            // Claim the batch and note where each part goes
+            struct Job {
+                uint32_t number;
+                int fd;
+                const PendingWrite* write;
+            };
+            std::vector<Job> jobs;
+            for (PendingWrite& pending : pendingWrites) {
+                pending.claimed = true;
+                jobs.push_back(Job{pending.segment, findSegment(pending.segment)->fd, &pending});
+            }
+            
+            // The batch holds every record appended so far, so the state now is
+            // what the files will hold once it is written. Only the conversations
+            // changed since the last checkpoint are copied; they are encoded unlocked.
+            bool checkpointTaken = false;
+            std::string checkpointHeader;
+            std::vector<ConversationUpdate> updates;
+            if (recordCount - checkpointRecords >= MESSAGE_LOG_CHECKPOINT_INTERVAL || checkpointDue ||
+                (stopping && recordCount != checkpointRecords)) {
+                checkpointTaken = true;
+                checkpointHeader = encodeCheckpointHeader();
+                takeUnsaved(updates);
+                checkpointRecords = recordCount;
+                checkpointDue = false;
+            }
+            LogSyncMode mode = syncMode;
+            int intervalMs = syncIntervalMs;
+            lock.unlock();
+            
+            size_t done = 0;
+            std::map<uint32_t, int> opened;     // segment number -> fd created in this batch
+            for (Job& job : jobs) {
+                if (job.fd < 0) {
+                    auto known = opened.find(job.number);
+                    job.fd = known != opened.end() ? known->second : openFile(segmentPath(job.number));
+                    if (job.fd < 0) break;
+                    opened[job.number] = job.fd;
+                }
+                if (!writeAt(job.fd, job.write->offset, job.write->data.data(), job.write->data.size())) break;
+                unsynced.insert(job.fd);
+                done++;
+            }
+            
+            Clock::time_point now = Clock::now();
+            bool sync = (mode == LOG_SYNC_BATCH && done > 0) ||
+                        (mode == LOG_SYNC_INTERVAL && now - lastSync >= std::chrono::milliseconds(intervalMs));
+            bool checkpointReady = checkpointTaken && done == jobs.size();
+            if (sync || checkpointReady || (mode != LOG_SYNC_NEVER && stopping)) {
+                for (int fd : unsynced) {
+                    syncFile(fd);
+                }
+                unsynced.clear();
+                lastSync = now;
+            }
+            if (checkpointTaken) {
+                // The copy takes the changes even when this checkpoint is not written;
+                // the next one then rewrites the file from it
+                applyUpdates(updates);
+                if (!checkpointReady) {
+                    snapshotDue = true;
+                } else if (!writeCheckpoint(checkpointHeader, updates)) {
+                    std::cerr << "[LOG] Cannot write checkpoint" << std::endl;
+                    snapshotDue = true;
+                }
+            }
+            
+            lock.lock();
+            for (const auto& o : opened) {
+                Segment& segment = *findSegment(o.first);
+                segment.fd = o.second;
+                segment.mapLength = MESSAGE_LOG_SEGMENT_SIZE;
+                segment.map = mapFile(segment.fd, segment.mapLength);
+                if (!segment.map) segment.mapLength = 0;
+            }
+            bool sealed = false;    // A full segment is now all on disk
+            for (size_t i = 0; i < done; i++) {
+                PendingWrite& pending = pendingWrites.front();
+                Segment& segment = *findSegment(pending.segment);
+                segment.written = pending.offset + pending.data.size();
+                sealed = sealed || (&segment != &segments.back() && segment.written == segment.size);
+                pendingBytes -= pending.data.size();
+                pendingWrites.pop_front();
+            }
+            if (done > 0) {
+                batchCount++;
+            }
+            if (sealed) {
+                maintenancePending = true;
+                maintenanceWake.notify_all();
+            }
+            
+            if (done < jobs.size()) {
+                // Keep the rest queued and retry; appends fail once the queue fills up
+                if (!writeFailed) {
+                    std::cerr << "[LOG] Cannot write segment " << jobs[done].number << ", retrying" << std::endl;
+                }
+                writeFailed = true;
+                spaceFreed.notify_all();
+                if (stopping) break;
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                lock.lock();
+                writeFailed = false;
+                continue;
+            }
+            
+            writeFailed = false;
+            spaceFreed.notify_all();
+            if (stopping && pendingWrites.empty()) break;
+        }
+    }
+    
+    // Maintenance thread: completes the key filters and expiry of sealed segments
+    // that were indexed only in part or under other policies, saves the filters,
+    // then deletes the segments whose records have all expired. Files are read,
+    // written and deleted without the lock, which is held only to update the
+    // index, so appends and reads never wait on this thread's disk work.
+    void maintenanceLoop() {
+#ifdef __linux__
+        setpriority(PRIO_PROCESS, 0, 10);   // On Linux this lowers only the calling thread
+#endif
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stopping) {
+            maintenanceWake.wait_for(lock, std::chrono::milliseconds(MESSAGE_LOG_MAINTENANCE_MS),
+                                     [&]() { return maintenancePending || stopping; });
+            maintenancePending = false;
+            
+            // Only this thread removes segments, so positions stay valid while it is unlocked
+            for (size_t i = 0; i + 1 < segments.size() && !stopping; i++) {
+                const Segment& segment = segments[i];
+                bool needsScan = !segment.keysKnown || (!segment.expiryKnown && !retention.empty());
+                if (segment.written < segment.size || (!needsScan && segment.keysSaved)) continue;
+                
+                uint32_t number = segment.number;
+                uint64_t size = segment.written;
+                if (needsScan) {
+                    const char* map = segment.written <= segment.mapLength ? segment.map : nullptr;
+                    uint64_t version = retentionVersion;
+                    std::map<std::string, uint64_t> policies = retention;
+                    lock.unlock();
+                    uint64_t expiresAt = 0;
+                    BloomFilter keys;
+                    bool scanned = scanSealed(number, map, size, policies, expiresAt, keys);
+                    lock.lock();
+                    if (!scanned) continue;
+                    
+                    if (!segments[i].keysKnown) {
+                        segments[i].keys = keys;
+                        segments[i].keysKnown = true;
+                    }
+                    if (version == retentionVersion) {
+                        segments[i].expiresAt = expiresAt;
+                        segments[i].expiryKnown = true;
+                    }
+                }
+                
+                if (!segments[i].keysSaved) {
+                    std::string bits = segments[i].keys.data();
+                    lock.unlock();
+                    bool saved = saveKeys(number, size, bits);
+                    lock.lock();
+                    segments[i].keysSaved = saved;
+                }
+            }
+            if (!stopping) deleteExpired(lock);
+        }
+    }
+    
+    // Read a sealed segment: the expiry of its records under 'policies' and the keys they belong to
+    bool scanSealed(uint32_t number, const char* map, uint64_t size, const std::map<std::string, uint64_t>& policies,
+                    uint64_t& expiresAt, BloomFilter& keys) const {
+        std::vector<char> buffer;
+        if (!map) {
+            if (!RecordCodec::readFile(segmentPath(number), buffer) || buffer.size() < size) return false;
+            map = buffer.data();
+        }
+        
+        const char* p = map + MESSAGE_LOG_MAGIC_SIZE;
+        const char* end = map + size;
+        while (p < end) {
+            const char* frame = p;
+            const char* payload;
+            size_t length;
+            ChatMessage msg;
+            if (RecordCodec::getFrame(p, end, payload, length) != RecordCodec::FRAME_OK ||
+                !decodeRecord(payload, length, msg)) {
+                // Damage the open kept (see scanSegment)
+                p = findIntact(frame, end);
+                if (!p) break;
+                continue;
+            }
+            std::string key = keyFor(msg);
+            expiresAt = std::max(expiresAt, expiryOf(policies, key, msg.timestamp));
+            keys.add(key);
+        }
+        return true;
+    }
+    
+    std::string keysPath(uint32_t number) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%08u.bloom", number);
+        return logDir + "/" + name;
+    }
+    
+    // A .bloom file is one frame: the size of the segment it describes, then the filter bits
+    bool saveKeys(uint32_t number, uint64_t size, const std::string& bits) const {
+        std::string payload;
+        RecordCodec::putVarint(payload, size);
+        RecordCodec::putString(payload, bits);
+        std::string data;
+        RecordCodec::putFrame(data, payload);
+        return RecordCodec::replaceFile(keysPath(number), data);
+    }
+    
+    // Take a segment's filter from its .bloom file if that describes the file as it is now
+    void loadKeys(Segment& segment) {
+        std::vector<char> data;
+        if (!RecordCodec::readFile(keysPath(segment.number), data)) return;
+        
+        const char* p = data.data();
+        const char* payload;
+        size_t size;
+        if (RecordCodec::getFrame(p, p + data.size(), payload, size) != RecordCodec::FRAME_OK) return;
+        RecordCodec::Reader reader(payload, size);
+        uint64_t segmentSize = reader.varint();
+        std::string bits = reader.string();
+        if (reader.ok() && segmentSize == sizeOf(segment.fd) && segment.keys.assign(bits)) {
+            segment.keysKnown = true;
+            segment.keysSaved = true;
+        }
+    }
+    
+    // Whether a segment may hold records whose retention depends on one of the
+    // 'changed' policy keys; only a conversation's own policy can be checked in its filter
+    static bool mayHold(const Segment& segment, const std::set<std::string>& changed) {
+        for (const std::string& key : changed) {
+            if (key.size() <= 1 || !segment.keysKnown || segment.keys.mayContain(key)) return true;
+        }
+        return false;
+    }
+    
+    // Longest any record is kept, or MESSAGE_LOG_FOREVER if some are kept for ever
+    uint64_t retentionLimit() const {
+        if (!retention.count("")) return MESSAGE_LOG_FOREVER;
+        uint64_t longest = 0;
+        for (const auto& policy : retention) {
+            if (policy.second == 0) return MESSAGE_LOG_FOREVER;
+            longest = std::max(longest, policy.second);
+        }
+        return longest;
+    }
+    
+    // Delete the sealed, fully written segments whose records have all expired
+    // Chains that lead into them end there; every record they hold is past its cutoff anyway
+    void deleteExpired(std::unique_lock<std::mutex>& lock) {
+        uint64_t now = time(nullptr);
+        uint64_t limit = retentionLimit();
+        std::vector<Segment> expired;
+        std::set<uint32_t> numbers;
+        for (size_t i = 0; i + 1 < segments.size(); ) {
+            const Segment& segment = segments[i];
+            bool past = (segment.expiryKnown && segment.expiresAt <= now) ||
+                        (limit != MESSAGE_LOG_FOREVER && segment.lastTime + limit <= now);
+            if (!past || segment.written < segment.size) {
+                i++;
+                continue;
+            }
+            expired.push_back(segment);
+            numbers.insert(segment.number);
+            segments.erase(segments.begin() + i);
+        }
+        if (expired.empty()) return;
+        
+        for (auto& c : conversations) {
+            std::vector<Anchor>& anchors = c.second.anchors;
+            size_t before = anchors.size();
+            anchors.erase(std::remove_if(anchors.begin(), anchors.end(),
+                                         [&](const Anchor& a) { return numbers.count(a.ref.segment) > 0; }),
+                          anchors.end());
+            if (anchors.size() != before) {
+                c.second.savedAnchors = 0;  // The next checkpoint carries all of them again
+                markUnsaved(c);
+            }
+        }
+        checkpointDue = true;
+        lock.unlock();
+        
+        for (const Segment& segment : expired) {
+            std::string path = segmentPath(segment.number);
+            unmapFile(segment.map, segment.mapLength);
+            if (segment.fd >= 0) closeFile(segment.fd);
+            if (std::remove(path.c_str()) == 0) {
+                std::cout << "[LOG] Deleted " << path << ", its messages are past their retention" << std::endl;
+            }
+            std::remove(keysPath(segment.number).c_str());
+        }
+        lock.lock();
+    }
+    
+    std::string checkpointPath() const {
+        return logDir + "/checkpoint";
+    }
+    
+    static void putRef(std::string& out, const RecordRef& ref) {
+        RecordCodec::putVarint(out, ref.segment);
+        RecordCodec::putVarint(out, ref.offset);
+        RecordCodec::putVarint(out, ref.length);
+    }
+    
+    // Note that a conversation changed since the last checkpoint was taken
+    void markUnsaved(std::pair<const std::string, Conversation>& entry) {
+        if (!entry.second.unsaved) {
+            entry.second.unsaved = true;
+            unsavedConversations.push_back(&entry);
+        }
+    }
+    
+    // Copy the conversations changed since the last checkpoint, with the anchors
+    // the writer's copy lacks; called with the lock held
+    void takeUnsaved(std::vector<ConversationUpdate>& updates) {
+        updates.reserve(unsavedConversations.size());
+        for (auto* entry : unsavedConversations) {
+            Conversation& conversation = entry->second;
+            updates.push_back(ConversationUpdate{entry->first, Conversation(), conversation.savedAnchors});
+            Conversation& copy = updates.back().conversation;
+            copy.last = conversation.last;
+            copy.count = conversation.count;
+            copy.anchors.assign(conversation.anchors.begin() + conversation.savedAnchors, conversation.anchors.end());
+            conversation.savedAnchors = (uint32_t)conversation.anchors.size();
+            conversation.unsaved = false;
+        }
+        unsavedConversations.clear();
+    }
+    
+    // Bring the writer's copy of the conversations up to date
+    void applyUpdates(const std::vector<ConversationUpdate>& updates) {
+        for (const ConversationUpdate& update : updates) {
+            Conversation& saved = savedConversations[update.key];
+            saved.last = update.conversation.last;
+            saved.count = update.conversation.count;
+            saved.anchors.resize(update.anchorsFrom);
+            saved.anchors.insert(saved.anchors.end(), update.conversation.anchors.begin(),
+                                 update.conversation.anchors.end());
+        }
+    }
+    
+    // A checkpoint is a snapshot section followed by the sections appended since.
+    // A section is a header frame: the format tag, nextId, record count, next
+    // segment number, the retention policies, the segments with their sizes,
+    // time ranges and expiry, and the number of conversation frames that
+    // follow; then one frame per conversation with its key, head, count and the
+    // anchors from a given index on (0 in a snapshot). Later sections override
+    // earlier ones.
+    // The header without the conversation count; called with the lock held
+    std::string encodeCheckpointHeader() const {
+        std::string payload;
+        RecordCodec::putString(payload, MESSAGE_LOG_CHECKPOINT_TAG);
+        RecordCodec::putVarint(payload, nextId);
+        RecordCodec::putVarint(payload, recordCount);
+        RecordCodec::putVarint(payload, nextSegmentNumber);
+        RecordCodec::putVarint(payload, retention.size());
+        for (const auto& policy : retention) {
+            RecordCodec::putString(payload, policy.first);
+            RecordCodec::putVarint(payload, policy.second);
+        }
+        RecordCodec::putVarint(payload, segments.size());
+        for (const Segment& segment : segments) {
+            RecordCodec::putVarint(payload, segment.number);
+            RecordCodec::putVarint(payload, segment.size);
+            RecordCodec::putVarint(payload, segment.firstTime);
+            RecordCodec::putVarint(payload, segment.lastTime);
+            RecordCodec::putVarint(payload, segment.expiryKnown);
+            RecordCodec::putVarint(payload, segment.expiresAt);
+        }
+        return payload;
+    }
+    
+    static void putConversation(std::string& out, const std::string& key, const Conversation& conversation,
+                                uint32_t anchorsFrom) {
+        std::string payload;
+        RecordCodec::putString(payload, key);
+        putRef(payload, conversation.last);
+        RecordCodec::putVarint(payload, conversation.count);
+        RecordCodec::putVarint(payload, anchorsFrom);
+        RecordCodec::putVarint(payload, conversation.anchors.size());
+        for (const Anchor& anchor : conversation.anchors) {
+            RecordCodec::putVarint(payload, anchor.id);
+            RecordCodec::putVarint(payload, anchor.timestamp);
+            putRef(payload, anchor.ref);
+        }
+        RecordCodec::putFrame(out, payload);
+    }
+    
+    // Save a checkpoint from the writer thread: append a section with the changed
+    // conversations, or rewrite the file as a snapshot of the writer's copy once
+    // the appended sections would outgrow the last snapshot. The rewrite is
+    // atomic, and a section torn by a crash is ignored when loading.
+    bool writeCheckpoint(const std::string& header, const std::vector<ConversationUpdate>& updates) {
+        std::string data;
+        std::string payload = header;
+        RecordCodec::putVarint(payload, updates.size());
+        RecordCodec::putFrame(data, payload);
+        for (const ConversationUpdate& update : updates) {
+            putConversation(data, update.key, update.conversation, update.anchorsFrom);
+        }
+        
+        if (!snapshotDue && checkpointBytes + data.size() <= 2 * snapshotBytes) {
+            int fd = openFile(checkpointPath());
+            if (fd < 0) return false;
+            bool ok = writeAt(fd, checkpointBytes, data.data(), data.size()) && syncFile(fd);
+            closeFile(fd);
+            if (!ok) return false;
+            checkpointBytes += data.size();
+            return true;
+        }
+        
+        data.clear();
+        payload = header;
+        RecordCodec::putVarint(payload, savedConversations.size());
+        RecordCodec::putFrame(data, payload);
+        for (const auto& c : savedConversations) {
+            putConversation(data, c.first, c.second, 0);
+        }
+        if (!RecordCodec::replaceFile(checkpointPath(), data)) return false;
+        checkpointBytes = snapshotBytes = data.size();
+        snapshotDue = false;
+        return true;
+    }
+    
+    // Load the checkpoint; fails if it is missing or damaged, or covers data the segments lack
+    // Sections are applied in order up to the first incomplete or damaged one
+    // Segments it lists that are gone were deleted for retention after it was written
+    bool loadCheckpoint(std::map<uint32_t, uint64_t>& covered) {
+        std::vector<char> data;
+        if (!RecordCodec::readFile(checkpointPath(), data) || data.empty()) return false;
+        
+        struct SegmentState {
+            uint32_t number;
+            uint64_t bytes;
+            uint64_t firstTime;
+            uint64_t lastTime;
+            bool expiryKnown;
+            uint64_t expiresAt;
+        };
+        
+        const char* p = data.data();
+        const char* end = p + data.size();
+        size_t sections = 0;
+        while (p < end) {
+            const char* payload;
+            size_t size;
+            if (RecordCodec::getFrame(p, end, payload, size) != RecordCodec::FRAME_OK) break;
+            
+            RecordCodec::Reader header(payload, size);
+            if (header.string() != MESSAGE_LOG_CHECKPOINT_TAG) break;
+            uint32_t sectionNextId = (uint32_t)header.varint();
+            uint64_t sectionRecords = header.varint();
+            uint32_t checkpointNext = (uint32_t)header.varint();
+            std::map<std::string, uint64_t> policies;  // Those the saved expiry was worked out under
+            uint64_t policyCount = header.varint();
+            for (uint64_t i = 0; i < policyCount && header.ok(); i++) {
+                std::string key = header.string();
+                policies[key] = header.varint();
+            }
+            std::vector<SegmentState> states;
+            uint64_t segmentCount = header.varint();
+            for (uint64_t i = 0; i < segmentCount && header.ok(); i++) {
+                SegmentState state;
+                state.number = (uint32_t)header.varint();
+                state.bytes = header.varint();
+                state.firstTime = header.varint();
+                state.lastTime = header.varint();
+                state.expiryKnown = header.varint() != 0;
+                state.expiresAt = header.varint();
+                states.push_back(state);
+            }
+            uint64_t conversationCount = header.varint();
+            if (!header.ok()) break;
+            
+            // Read the whole section before applying any of it
+            std::vector<ConversationUpdate> updates;
+            bool complete = true;
+            for (uint64_t i = 0; i < conversationCount && complete; i++) {
+                if (RecordCodec::getFrame(p, end, payload, size) != RecordCodec::FRAME_OK) {
+                    complete = false;
+                    break;
+                }
+                RecordCodec::Reader reader(payload, size);
+                updates.push_back(ConversationUpdate{reader.string(), Conversation(), 0});
+                Conversation& conversation = updates.back().conversation;
+                conversation.last = readRef(reader);
+                conversation.count = (uint32_t)reader.varint();
+                updates.back().anchorsFrom = (uint32_t)reader.varint();
+                uint64_t anchorCount = reader.varint();
+                for (uint64_t a = 0; a < anchorCount && reader.ok(); a++) {
+                    Anchor anchor;
+                    anchor.id = (uint32_t)reader.varint();
+                    anchor.timestamp = reader.varint();
+                    anchor.ref = readRef(reader);
+                    conversation.anchors.push_back(anchor);
+                }
+                complete = reader.ok();
+            }
+            if (!complete) break;
+            
+            std::set<std::string> changed;
+            for (const auto& policy : policies) {
+                auto now = retention.find(policy.first);
+                if (now == retention.end() || now->second != policy.second) changed.insert(policy.first);
+            }
+            for (const auto& policy : retention) {
+                if (!policies.count(policy.first)) changed.insert(policy.first);
+            }
+            covered.clear();
+            for (const SegmentState& state : states) {
+                Segment* segment = findSegment(state.number);
+                if (!segment) continue;
+                if (sizeOf(segment->fd) < state.bytes) {
+                    std::cerr << "[LOG] Checkpoint does not match segment " << state.number << ", scanning all segments" << std::endl;
+                    return false;
+                }
+                covered[state.number] = state.bytes;
+                segment->firstTime = state.firstTime;
+                segment->lastTime = state.lastTime;
+                segment->expiryKnown = state.expiryKnown && !mayHold(*segment, changed);
+                segment->expiresAt = state.expiresAt;
+            }
+            for (const ConversationUpdate& update : updates) {
+                Conversation& conversation = conversations[update.key];
+                if (update.anchorsFrom > conversation.anchors.size()) return false;
+                conversation.last = update.conversation.last;
+                conversation.count = update.conversation.count;
+                conversation.anchors.resize(update.anchorsFrom);
+                conversation.anchors.insert(conversation.anchors.end(), update.conversation.anchors.begin(),
+                                            update.conversation.anchors.end());
+            }
+            nextId = sectionNextId;
+            recordCount = sectionRecords;
+            nextSegmentNumber = std::max(nextSegmentNumber, checkpointNext);
+            sections++;
+        }
+        return sections > 0;
+    }
+    
+    // Segments that are queued or being written are never deleted, so the writer always finds theirs
+    Segment* findSegment(uint32_t number) {
+        auto it = std::lower_bound(segments.begin(), segments.end(), number,
+                                   [](const Segment& segment, uint32_t n) { return segment.number < n; });
+        return it != segments.end() && it->number == number ? &*it : nullptr;
+    }
+    
+    // Find the payload of a record: in the segment mapping when it is written there,
+    // otherwise copied into 'scratch' from the file or from the write queue
+    bool loadFrame(const RecordRef& ref, const char*& payload, size_t& size, std::vector<char>& scratch) {
+        const Segment* segment = findSegment(ref.segment);
+        if (!segment || ref.length == 0) return false;
+        
+        uint64_t end = (uint64_t)ref.offset + ref.length;
+        const char* p;
+        if (end <= segment->written && end <= segment->mapLength) {
+            p = segment->map + ref.offset;
+        } else {
+            scratch.resize(ref.length);
+            if (end <= segment->written) {
+                if (!readAt(segment->fd, ref.offset, scratch.data(), scratch.size())) return false;
+            } else if (!readPending(ref, scratch.data())) {
+                return false;
+            }
+            p = scratch.data();
+        }
+        return RecordCodec::getFrame(p, p + ref.length, payload, size) == RecordCodec::FRAME_OK;
+    }
+    
+    // Make a record the head of its conversation at position 'seq' (0: the next one)
+    // A stored position past the next one means damaged records were skipped; their
+    // slots stay counted, and the first record past an anchor position becomes the anchor
+    static void addRecord(Conversation& conversation, const ChatMessage& msg, const RecordRef& ref, uint32_t seq) {
+        seq = std::max(seq, conversation.count + 1);
+        if (conversation.count == 0 ||
+            (seq - 1) / MESSAGE_LOG_ANCHOR_INTERVAL != (conversation.count - 1) / MESSAGE_LOG_ANCHOR_INTERVAL) {
+            conversation.anchors.push_back(Anchor{msg.id, msg.timestamp, ref});
+        }
+        conversation.last = ref;
+        conversation.count = seq;
+    }
+    
+    // Widen a segment's time range and expiry to cover one of its records
+    void noteRecord(Segment& segment, const std::string& key, uint64_t timestamp, bool first) {
+        if (first) segment.firstTime = timestamp;
+        segment.lastTime = std::max(segment.lastTime, timestamp);
+        segment.expiresAt = std::max(segment.expiresAt, expiryOf(retention, key, timestamp));
+        segment.keys.add(key);
+        segment.keysSaved = false;
+    }
+    
+    // Seconds a conversation's records are kept: its own policy, else that of its
+    // kind ("#" groups, "@" direct messages), else the default; 0 keeps them for ever
+    static uint64_t retentionOf(const std::map<std::string, uint64_t>& policies, const std::string& key) {
+        if (policies.empty()) return 0;
+        auto it = policies.find(key);
+        if (it == policies.end()) it = policies.find(key.substr(0, 1));
+        if (it == policies.end()) it = policies.find("");
+        return it != policies.end() ? it->second : 0;
+    }
+    
+    static uint64_t expiryOf(const std::map<std::string, uint64_t>& policies, const std::string& key, uint64_t timestamp) {
+        uint64_t seconds = retentionOf(policies, key);
+        return seconds ? timestamp + seconds : MESSAGE_LOG_FOREVER;
+    }
+    
+    // Records of a conversation older than this have expired
+    uint64_t retentionCutoff(const std::string& key) const {
+        uint64_t seconds = retentionOf(retention, key);
+        uint64_t now = time(nullptr);
+        return seconds && now > seconds ? now - seconds : 0;
+    }
+    
+    // Where a backward walk for a page can start without missing a match: the first
+    // anchor at or past beforeId/toTime, or far enough past afterId and minTime to
+    // cover a forward page of 'forwardLimit' records; the head when nothing bounds the page
+    static RecordRef startOf(const Conversation& conversation, uint32_t beforeId, uint32_t afterId,
+                             uint64_t minTime, uint64_t toTime, size_t forwardLimit) {
+        const std::vector<Anchor>& anchors = conversation.anchors;
+        size_t start = anchors.size();
+        if (beforeId) {
+            start = std::min(start, (size_t)(std::lower_bound(anchors.begin(), anchors.end(), beforeId,
+                [](const Anchor& a, uint32_t id) { return a.id < id; }) - anchors.begin()));
+        }
+        if (toTime) {
+            start = std::min(start, (size_t)(std::upper_bound(anchors.begin(), anchors.end(), toTime,
+                [](uint64_t t, const Anchor& a) { return t < a.timestamp; }) - anchors.begin()));
+        }
+        if (forwardLimit) {
+            size_t first = std::upper_bound(anchors.begin(), anchors.end(), afterId,
+                [](uint32_t id, const Anchor& a) { return id < a.id; }) - anchors.begin();
+            first = std::max(first, (size_t)(std::lower_bound(anchors.begin(), anchors.end(), minTime,
+                [](const Anchor& a, uint64_t t) { return a.timestamp < t; }) - anchors.begin()));
+            start = std::min(start, first + (forwardLimit + MESSAGE_LOG_ANCHOR_INTERVAL - 1) / MESSAGE_LOG_ANCHOR_INTERVAL);
+        }
+        return start < anchors.size() ? anchors[start].ref : conversation.last;
+    }
+    
+    // Visit a chain from 'ref' back; visit(ref, id, timestamp) returns false to stop
+    // The walk ends without a read at a deleted segment or one whose records are all older than minTime.
+    // A damaged record breaks the chain, so the walk goes on from the conversation's anchor before it.
+    template <typename Visit>
+    void walkBack(const Conversation& conversation, RecordRef ref, uint64_t minTime, Visit visit) {
+        std::vector<char> scratch;
+        while (ref.length > 0) {
+            const Segment* segment = findSegment(ref.segment);
+            if (!segment || segment->lastTime < minTime) return;
+            
+            const char* payload;
+            size_t size;
+            RecordCodec::Reader reader(nullptr, 0);
+            if (loadFrame(ref, payload, size, scratch)) {
+                reader = RecordCodec::Reader(payload, size);
+            }
+            uint32_t id = (uint32_t)reader.varint();
+            uint64_t timestamp = reader.varint();
+            RecordRef prev = readRef(reader);
+            if (!reader.ok()) {
+                const Anchor* anchor = anchorBefore(conversation, ref);
+                std::cerr << "[LOG] Damaged record in " << segmentPath(ref.segment)
+                          << (anchor ? ", resuming history at the anchor before it" : ", history stops there") << std::endl;
+                if (!anchor) return;
+                ref = anchor->ref;
+                continue;
+            }
+            if (!visit(ref, id, timestamp)) return;
+            ref = prev;
+        }
+    }
+    
+    // Newest anchor strictly older than 'ref', or null
+    static const Anchor* anchorBefore(const Conversation& conversation, const RecordRef& ref) {
+        const std::vector<Anchor>& anchors = conversation.anchors;
+        for (size_t i = anchors.size(); i > 0; i--) {
+            const RecordRef& at = anchors[i - 1].ref;
+            if (at.segment < ref.segment || (at.segment == ref.segment && at.offset < ref.offset)) {
+                return &anchors[i - 1];
+            }
+        }
+        return nullptr;
+    }
+    
+    // Decode picked records (newest first) into a list oldest first; records that
+    // store their position keep it, and if the newest is the conversation's head,
+    // newestSeq numbers older records (which do not store it) by their place in the list
+    std::vector<ChatMessage> readRecords(const std::vector<RecordRef>& picked, uint32_t newestSeq = 0) {
+        std::vector<ChatMessage> messages;
+        messages.reserve(picked.size());
+        
+        std::vector<char> scratch;
+        for (size_t i = picked.size(); i > 0; i--) {
+            const char* payload;
+            size_t size;
+            ChatMessage msg;
+            if (loadFrame(picked[i - 1], payload, size, scratch) && decodeRecord(payload, size, msg)) {
+                if (!msg.seq && newestSeq) msg.seq = newestSeq - (uint32_t)(i - 1);
+                messages.push_back(msg);
+            } else {
+                std::cerr << "[LOG] Damaged record in " << segmentPath(picked[i - 1].segment) << std::endl;
+            }
+        }
+        return messages;
+    }
+    
+    static RecordRef readRef(RecordCodec::Reader& reader) {
+        RecordRef ref;
+        ref.segment = (uint32_t)reader.varint();
+        ref.offset = (uint32_t)reader.varint();
+        ref.length = (uint32_t)reader.varint();
+        return ref;
+    }
+    
+    static bool decodeRecord(const char* payload, size_t size, ChatMessage& msg) {
+        RecordCodec::Reader reader(payload, size);
+        msg.seq = 0;
+        msg.id = (uint32_t)reader.varint();
+        msg.timestamp = reader.varint();
+        readRef(reader);
+        uint64_t flags = reader.varint();
+        msg.isGroup = (flags & LOG_FLAG_GROUP) != 0;
+        msg.isFile = (flags & LOG_FLAG_FILE) != 0;
+        msg.sender = reader.string();
+        msg.recipient = reader.string();
+        msg.filename = reader.string();
+        msg.content = reader.string();
+        if (flags & LOG_FLAG_SEQ) msg.seq = (uint32_t)reader.varint();
+        return reader.ok();
+    }
+    
+    // Find the next intact record after a damaged one at 'frame': where the damaged
+    // frame says it ends if a record starts there, else the first offset holding a
+    // frame that passes its checksum and decodes. Returns null if there is none.
+    static const char* findIntact(const char* frame, const char* end) {
+        const char* q = frame;
+        uint64_t length;
+        if (RecordCodec::getVarint(q, end, length) && length + 4 < (uint64_t)(end - q) &&
+            isRecordAt(q + length + 4, end)) {
+            return q + length + 4;
+        }
+        for (const char* p = frame + 1; p < end; p++) {
+            if (isRecordAt(p, end)) return p;
+        }
+        return nullptr;
+    }
+    
+    static bool isRecordAt(const char* p, const char* end) {
+        const char* payload;
+        size_t size;
+        ChatMessage msg;
+        return RecordCodec::getFrame(p, end, payload, size) == RecordCodec::FRAME_OK && decodeRecord(payload, size, msg);
+    }
+    
+    // Copy a record that is still waiting for the writer
+    bool readPending(const RecordRef& ref, char* out) const {
+        for (const PendingWrite& pending : pendingWrites) {
+            if (pending.segment == ref.segment && ref.offset >= pending.offset &&
+                ref.offset + ref.length <= pending.offset + pending.data.size()) {
+                memcpy(out, pending.data.data() + (ref.offset - pending.offset), ref.length);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static bool syncFile(int fd) {
+#ifdef _WIN32
+        return _commit(fd) == 0;
+#else
+        return fsync(fd) == 0;
+#endif
+    }
+    
+    // Segment numbers found in the log directory
+    std::vector<uint32_t> listSegments() const {
+        std::vector<uint32_t> numbers;
+#ifdef _WIN32
+        struct _finddata_t entry;
+        intptr_t handle = _findfirst((logDir + "/*.seg").c_str(), &entry);
+        if (handle == -1) return numbers;
+        do {
+            unsigned number;
+            if (sscanf(entry.name, "%u.seg", &number) == 1) numbers.push_back(number);
+        } while (_findnext(handle, &entry) == 0);
+        _findclose(handle);
+#else
+        DIR* dir = opendir(logDir.c_str());
+        if (!dir) return numbers;
+        while (struct dirent* entry = readdir(dir)) {
+            unsigned number;
+            size_t len = strlen(entry->d_name);
+            if (len > 4 && strcmp(entry->d_name + len - 4, ".seg") == 0 &&
+                sscanf(entry->d_name, "%u.seg", &number) == 1) {
+                numbers.push_back(number);
+            }
+        }
+        closedir(dir);
+#endif
+        return numbers;
+    }
+    
+    static int openFile(const std::string& path) {
+#ifdef _WIN32
+        return _open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        return ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+    }
+    
+    // Map a segment for reading; the length may run past the end of the file,
+    // which is fine as long as only written bytes are read
+    static const char* mapFile(int fd, size_t length) {
+#ifdef _WIN32
+        (void)fd;
+        (void)length;
+        return nullptr;     // Reads use positional IO instead
+#else
+        void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        return map == MAP_FAILED ? nullptr : (const char*)map;
+#endif
+    }
+    
+    static void unmapFile(const char* map, size_t length) {
+#ifndef _WIN32
+        if (map) munmap((void*)map, length);
+#endif
+    }
+    
+    static void closeFile(int fd) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+    
+    static uint64_t sizeOf(int fd) {
+#ifdef _WIN32
+        return _filelengthi64(fd);
+#else
+        struct stat st;
+        return fstat(fd, &st) == 0 ? st.st_size : 0;
+#endif
+    }
+    
+    static void truncateFile(int fd, uint64_t size) {
+#ifdef _WIN32
+        _chsize_s(fd, size);
+#else
+        if (ftruncate(fd, size) != 0) {
+            std::cerr << "[LOG] Could not truncate segment to " << size << " bytes" << std::endl;
+        }
+#endif
+    }
+    
+    // Positional IO: the writer thread writes a segment without the log mutex
+    // while readers read it, so neither side may move a shared file pointer.
+    // On Windows the offset travels in an OVERLAPPED, which a synchronous
+    // handle honours for that one call.
+#ifdef _WIN32
+    static OVERLAPPED overlappedAt(uint64_t offset) {
+        OVERLAPPED at;
+        memset(&at, 0, sizeof(at));
+        at.Offset = (DWORD)offset;
+        at.OffsetHigh = (DWORD)(offset >> 32);
+        return at;
+    }
+#endif
+
+    static bool readAt(int fd, uint64_t offset, char* data, size_t size) {
+#ifdef _WIN32
+        HANDLE file = (HANDLE)_get_osfhandle(fd);
+        while (size > 0) {
+            OVERLAPPED at = overlappedAt(offset);
+            DWORD n = 0;
+            DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+            if (!ReadFile(file, data, chunk, &n, &at) || n == 0) return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+#else
+        while (size > 0) {
+            ssize_t n = pread(fd, data, size, offset);
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+#endif
+        return true;
+    }
+    
+    static bool writeAt(int fd, uint64_t offset, const char* data, size_t size) {
+#ifdef _WIN32
+        HANDLE file = (HANDLE)_get_osfhandle(fd);
+        while (size > 0) {
+            OVERLAPPED at = overlappedAt(offset);
+            DWORD n = 0;
+            DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+            if (!WriteFile(file, data, chunk, &n, &at) || n == 0) return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+#else
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, offset);
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+#endif
+        return true;
+    }
+    
+    static void createDirectory(const std::string& dir) {
+        #ifdef _WIN32
+        _mkdir(dir.c_str());
+        #else
+        mkdir(dir.c_str(), 0755);
+        #endif
+    }
+};
+
+#endif // MESSAGE_LOG_H
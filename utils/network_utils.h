@@ -5,21 +5,32 @@
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
+    #include <io.h>
     #pragma comment(lib, "ws2_32.lib")
     typedef SOCKET SocketType;
     #define SOCKET_INVALID INVALID_SOCKET
+    #define SEND_FLAGS 0
     #define SOCKET_ERROR_CODE SOCKET_ERROR
     #define CLOSE_SOCKET(s) closesocket(s)
+    #define SHUTDOWN_SEND SD_SEND
 #else
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
     #include <netdb.h>
+    #include <netinet/tcp.h>
+    #include <csignal>
+    #ifdef __linux__
+        #include <sys/sendfile.h>
+        #include <fcntl.h>
+    #endif
     typedef int SocketType;
     #define SOCKET_INVALID (-1)
     #define SOCKET_ERROR_CODE (-1)
     #define CLOSE_SOCKET(s) close(s)
+    #define SHUTDOWN_SEND SHUT_WR
+    #define SEND_FLAGS MSG_NOSIGNAL  // Broken connections return EPIPE instead of killing the process
     // For compatibility
     typedef int SOCKET;
     #define INVALID_SOCKET (-1)
@@ -28,6 +39,10 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstring>
 #include "protocol.h"
 
 namespace NetworkUtils {
@@ -38,7 +53,8 @@ inline bool initWinsock() {
     WSADATA wsaData;
     return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
 #else
-    return true; // No initialization needed on Linux
+    signal(SIGPIPE, SIG_IGN); // sendfile ignores MSG_NOSIGNAL
+    return true;
 #endif
 }
 
@@ -49,33 +65,60 @@ inline void cleanupWinsock() {
 #endif
 }
 
+// Disable Nagle's algorithm: packets go out as separate header/payload writes
+// and small credit/ACK packets must not wait for delayed ACKs
+inline void setNoDelay(SocketType sock) {
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag));
+}
+
+// Send a buffer, retrying partial sends
+inline bool sendAll(SocketType sock, const char* data, size_t len, int flags = SEND_FLAGS) {
+    while (len > 0) {
+        int sent = send(sock, data, len, flags);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// Lock held while a packet goes out on 'sock', so packets sent from different
+// threads never interleave; socket numbers are reused, so locks are kept
+inline std::mutex& sendLock(SocketType sock) {
+    static std::mutex registryMtx;
+    static std::map<SocketType, std::unique_ptr<std::mutex>> locks;
+    std::lock_guard<std::mutex> lock(registryMtx);
+    std::unique_ptr<std::mutex>& entry = locks[sock];
+    if (!entry) entry.reset(new std::mutex());
+    return *entry;
+}
+
 // Send a complete packet (header + payload)
 inline bool sendPacket(SocketType sock, PacketHeader* header, const char* payload, uint32_t payloadLen) {
+    std::lock_guard<std::mutex> lock(sendLock(sock));
+    
     // Send header
-    int sent = send(sock, (char*)header, sizeof(PacketHeader), 0);
-    if (sent != sizeof(PacketHeader)) {
+    if (!sendAll(sock, (char*)header, sizeof(PacketHeader))) {
         return false;
     }
     
     // Send payload
     if (payloadLen > 0 && payload != nullptr) {
-        sent = send(sock, payload, payloadLen, 0);
-        if (sent != (int)payloadLen) {
-            return false;
-        }
+        return sendAll(sock, payload, payloadLen);
     }
     
     return true;
 }
 
-// Receive complete payload
-inline bool receivePayload(SocketType sock, std::vector<char>& payload, uint32_t payloadLength) {
-    payload.resize(payloadLength);
-    int totalReceived = 0;
+// Receive exactly 'length' bytes
+inline bool receiveAll(SocketType sock, char* data, size_t length) {
+    size_t totalReceived = 0;
     
-    while (totalReceived < (int)payloadLength) {
-        int chunk = recv(sock, payload.data() + totalReceived, 
-                        payloadLength - totalReceived, 0);
+    while (totalReceived < length) {
+        int chunk = recv(sock, data + totalReceived, length - totalReceived, 0);
         if (chunk <= 0) {
             return false;
         }
@@ -85,16 +128,71 @@ inline bool receivePayload(SocketType sock, std::vector<char>& payload, uint32_t
     return true;
 }
 
+// Receive complete payload
+inline bool receivePayload(SocketType sock, std::vector<char>& payload, uint32_t payloadLength) {
+    payload.resize(payloadLength);
+    return receiveAll(sock, payload.data(), payloadLength);
+}
+
+// Build a MSG_PUBLISH_FILE payload: uint32 filename length, filename, uint64 file size,
+// a uint32 stream count for parallel uploads, and the hex SHA-256 of the content when
+// the sender wants the store to skip data it already has (the stream count is then always sent)
+inline std::vector<char> buildFileMetadata(const std::string& filename, uint64_t fileSize, uint32_t streams = 1,
+                                           const std::string& hash = "") {
+    uint32_t filenameLen = filename.length();
+    std::vector<char> metadata(sizeof(filenameLen) + filenameLen + sizeof(fileSize));
+    memcpy(metadata.data(), &filenameLen, sizeof(filenameLen));
+    memcpy(metadata.data() + sizeof(filenameLen), filename.data(), filenameLen);
+    memcpy(metadata.data() + sizeof(filenameLen) + filenameLen, &fileSize, sizeof(fileSize));
+    if (streams > 1 || hash.length() == FILE_HASH_LEN) {
+        metadata.insert(metadata.end(), (char*)&streams, (char*)&streams + sizeof(streams));
+    }
+    if (hash.length() == FILE_HASH_LEN) {
+        metadata.insert(metadata.end(), hash.begin(), hash.end());
+    }
+    return metadata;
+}
+
+// Parse a MSG_PUBLISH_FILE payload; older peers send a 4-byte size
+// hash is left empty when the sender did not include one
+inline bool parseFileMetadata(const std::vector<char>& payload, std::string& filename, uint64_t& fileSize,
+                              uint32_t& streams, std::string& hash) {
+    uint32_t filenameLen;
+    if (payload.size() < sizeof(filenameLen)) return false;
+    memcpy(&filenameLen, payload.data(), sizeof(filenameLen));
+    if (filenameLen == 0 || payload.size() - sizeof(filenameLen) < filenameLen) return false;
+    
+    size_t sizeBytes = payload.size() - sizeof(filenameLen) - filenameLen;
+    const char* sizePtr = payload.data() + sizeof(filenameLen) + filenameLen;
+    streams = 1;
+    hash.clear();
+    if (sizeBytes == sizeof(uint64_t) + sizeof(uint32_t) + FILE_HASH_LEN) {
+        memcpy(&fileSize, sizePtr, sizeof(uint64_t));
+        memcpy(&streams, sizePtr + sizeof(uint64_t), sizeof(uint32_t));
+        hash.assign(sizePtr + sizeof(uint64_t) + sizeof(uint32_t), FILE_HASH_LEN);
+    } else if (sizeBytes == sizeof(uint64_t) + sizeof(uint32_t)) {
+        memcpy(&fileSize, sizePtr, sizeof(uint64_t));
+        memcpy(&streams, sizePtr + sizeof(uint64_t), sizeof(uint32_t));
+    } else if (sizeBytes == sizeof(uint64_t)) {
+        memcpy(&fileSize, sizePtr, sizeof(uint64_t));
+    } else if (sizeBytes == sizeof(uint32_t)) {
+        uint32_t legacySize;
+        memcpy(&legacySize, sizePtr, sizeof(legacySize));
+        fileSize = legacySize;
+    } else {
+        return false;
+    }
+    filename.assign(payload.data() + sizeof(filenameLen), filenameLen);
+    return true;
+}
+
 // Send ACK message
 inline void sendAck(SocketType sock, const std::string& message) {
     PacketHeader ack = {0};
     ack.msgType = MSG_ACK;
     ack.payloadLength = message.length();
     
-    send(sock, (char*)&ack, sizeof(PacketHeader), 0);
-    if (!message.empty()) {
-        send(sock, message.c_str(), message.length(), 0);
-    }
+    sendPacket(sock, &ack, message.c_str(), message.length());
 }
 
 // Send Error message
@@ -103,19 +201,122 @@ inline void sendError(SocketType sock, const std::string& error) {
     err.msgType = MSG_ERROR;
     err.payloadLength = error.length();
     
-    send(sock, (char*)&err, sizeof(PacketHeader), 0);
-    if (!error.empty()) {
-        send(sock, error.c_str(), error.length(), 0);
-    }
+    sendPacket(sock, &err, error.c_str(), error.length());
 }
 
 // Forward message to another socket
 inline void forwardMessage(SocketType targetSocket, PacketHeader* header, std::vector<char>& payload) {
-    send(targetSocket, (char*)header, sizeof(PacketHeader), 0);
-    if (header->payloadLength > 0) {
-        send(targetSocket, payload.data(), payload.size(), 0);
+    sendPacket(targetSocket, header, payload.data(), header->payloadLength > 0 ? payload.size() : 0);
+}
+
+// Send a header followed by 'length' bytes of a file starting at 'offset'
+// Uses sendfile on Linux so the file data never passes through user space
+inline bool sendFileChunk(SocketType sock, PacketHeader* header, int fd, uint64_t offset, size_t length) {
+    std::lock_guard<std::mutex> lock(sendLock(sock));
+#ifdef __linux__
+    // MSG_MORE holds the header back so it leaves in the same segment as the payload
+    if (!sendAll(sock, (char*)header, sizeof(PacketHeader), SEND_FLAGS | (length > 0 ? MSG_MORE : 0))) {
+        return false;
+    }
+    
+    off_t pos = offset;
+    while (length > 0) {
+        ssize_t sent = sendfile(sock, fd, &pos, length);
+        if (sent <= 0) {
+            return false;
+        }
+        length -= sent;
     }
+#else
+    if (!sendAll(sock, (char*)header, sizeof(PacketHeader))) {
+        return false;
+    }
+    
+    char buffer[FILE_CHUNK_SIZE];
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+#else
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+#endif
+        return false;
+    }
+    while (length > 0) {
+        int n = read(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+        if (n <= 0 || !sendAll(sock, buffer, n)) {
+            return false;
+        }
+        length -= n;
+    }
+#endif
+    return true;
+}
+
+#ifdef __linux__
+// Kernel pipe for moving socket data to another socket with splice()
+struct SplicePipe {
+    int fds[2];
+    
+    SplicePipe() {
+        if (pipe(fds) != 0) {
+            fds[0] = fds[1] = -1;
+        }
+    }
+    ~SplicePipe() {
+        if (valid()) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+    bool valid() const { return fds[0] >= 0; }
+
+private:
+    SplicePipe(const SplicePipe&);
+    SplicePipe& operator=(const SplicePipe&);
+};
+
+// Move 'length' bytes from a socket into the pipe (must fit in the pipe buffer)
+inline bool spliceIn(SocketType sock, SplicePipe& relayPipe, size_t length) {
+    while (length > 0) {
+        ssize_t moved = splice(sock, nullptr, relayPipe.fds[1], nullptr, length, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            return false;
+        }
+        length -= moved;
+    }
+    return true;
+}
+
+// Drop 'length' bytes buffered in the pipe
+inline void discardPipe(SplicePipe& relayPipe, size_t length) {
+    char buffer[FILE_CHUNK_SIZE];
+    while (length > 0) {
+        ssize_t n = read(relayPipe.fds[0], buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+        if (n <= 0) {
+            return;
+        }
+        length -= n;
+    }
+}
+
+// Send a header followed by 'length' bytes buffered in the pipe
+// The pipe is left empty even if the target socket fails
+inline bool spliceOut(SplicePipe& relayPipe, SocketType sock, PacketHeader* header, size_t length) {
+    std::lock_guard<std::mutex> lock(sendLock(sock));
+    if (!sendAll(sock, (char*)header, sizeof(PacketHeader), SEND_FLAGS | MSG_MORE)) {
+        discardPipe(relayPipe, length);
+        return false;
+    }
+    while (length > 0) {
+        ssize_t moved = splice(relayPipe.fds[0], nullptr, sock, nullptr, length, SPLICE_F_MOVE);
+        if (moved <= 0) {
+            discardPipe(relayPipe, length);
+            return false;
+        }
+        length -= moved;
+    }
+    return true;
 }
+#endif
 
 } // namespace NetworkUtils
 
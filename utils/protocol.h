@@ -10,6 +10,15 @@
 #define MAX_TOPIC_LEN 32
 #define MAX_USERNAME_LEN 32
 #define FILE_CHUNK_SIZE 8192
+#define HISTORY_PAGE_MAX 200    // Max rows per history batch
+#define FILE_HASH_LEN 64        // Hex SHA-256 naming a stored file
+#define FILE_DOWNLOAD_CHUNK_SIZE 65536
+#define FILE_CREDIT_WINDOW 32   // Chunks an uploader may have in flight
+#define FILE_CREDIT_BATCH 8     // Chunks returned per MSG_FILE_CREDIT
+#define FILE_MAX_STREAMS 8      // Parallel connections one upload may use
+
+// Header flags
+#define FLAG_SEQUENCED 0x01     // messageId carries the per-topic sequence number
 
 // =======================
 // Message types (low-level)
@@ -42,6 +51,32 @@ enum MessageType {
     MSG_GROUP_CREATED,
     MSG_GROUP_LIST,
     
+    // Paged history (HistoryQuery request, many rows per batch reply)
+    MSG_REQUEST_HISTORY_PAGE,
+    MSG_HISTORY_BATCH,
+    
+    // Sequenced topic messages (resume replay / offline delivery), MSG_HISTORY_BATCH layout
+    MSG_MESSAGE_BATCH,
+    
+    // Group file stored on the server, pulled on demand with LTM_DOWNLOAD
+    MSG_FILE_AVAILABLE,
+    
+    // Reply to MSG_PUBLISH_FILE with what the server already has (resumable uploads)
+    MSG_TRANSFER_STATUS,
+    
+    // Flow control for uploads, payload uint32 chunk count:
+    // recipient -> broker acknowledges relayed chunks, broker -> uploader grants credits
+    MSG_FILE_CREDIT,
+    
+    // Extra connection for a parallel upload: header sender = uploader, messageId = transfer id
+    // Answered with MSG_ACK or MSG_ERROR on that connection
+    MSG_ATTACH_STREAM,
+    
+    // The user named in the payload no longer shares a group or DM with this client,
+    // so their status stops being sent; unlike MSG_USER_OFFLINE it says nothing about
+    // whether they are connected
+    MSG_USER_HIDDEN,
+    
     // Game messages
     MSG_GAME = 50
 };
@@ -71,13 +106,85 @@ struct PacketHeader {
     uint32_t msgType;        // MessageType or PacketType
     uint32_t payloadLength; // Length of the payload
     uint32_t messageId;     // Unique message ID
-    uint64_t timestamp;     // Timestamp
+    union {
+        uint64_t timestamp; // Timestamp
+        uint64_t offset;    // Byte offset of the chunk (MSG_FILE_DATA)
+    };
     uint8_t version;        // Protocol version
     uint8_t flags;          // Bit flags
     char sender[MAX_USERNAME_LEN];
     char topic[MAX_TOPIC_LEN];
     uint32_t checksum;      // CRC32
 };
+
+// MSG_REQUEST_HISTORY_PAGE payload; zero fields are unbounded
+struct HistoryQuery {
+    uint32_t beforeId;      // Only messages with id < beforeId (scroll back)
+    uint32_t afterId;       // Only messages with id > afterId (catch up)
+    uint64_t fromTime;      // Only messages with timestamp >= fromTime
+    uint64_t toTime;        // Only messages with timestamp <= toTime
+    uint32_t limit;         // Max rows, capped at HISTORY_PAGE_MAX
+};
+
+// MSG_HISTORY_BATCH payload:
+//   uint32 rowCount, uint8 hasMore, then rowCount rows of
+//   uint32 rowLength, HistoryRow, sender bytes, content bytes
+// MSG_MESSAGE_BATCH uses the same layout with HistoryRow.id holding the
+// per-topic sequence; header messageId is the frame's last sequence
+struct HistoryRow {
+    uint32_t id;
+    uint64_t timestamp;
+    uint8_t isFile;
+    uint8_t senderLength;
+};
+// File rows whose file is in the server store carry "<hash>:<size>:<filename>" as content
+
+// MSG_FILE_AVAILABLE payload: FileNotice followed by the filename
+struct FileNotice {
+    char hash[FILE_HASH_LEN];
+    uint64_t fileSize;
+};
+
+// LTM_DOWNLOAD payload (client -> server only, its value overlaps MSG_ERROR)
+// Answered with MSG_FILE_DATA chunks carrying the request's messageId
+struct FileDownloadRequest {
+    char hash[FILE_HASH_LEN];
+    uint64_t offset;
+    uint64_t length;        // 0 = to end of file
+};
+
+// TransferStatus.accepted values
+#define TRANSFER_REFUSED 0
+#define TRANSFER_ACCEPTED 1
+#define TRANSFER_STORED 2       // The store already holds the content; nothing is uploaded
+
+// MSG_TRANSFER_STATUS payload, header messageId = transfer id
+// Every chunk below contiguousOffset has arrived, and bit i of reorderMask
+// marks chunk (contiguousOffset / FILE_CHUNK_SIZE + 1 + i) as arrived
+// For a parallel upload the offsets describe stripe 0 and a StripeStatus
+// follows for each of stripes 1 .. stripes-1
+struct TransferStatus {
+    uint8_t accepted;       // TRANSFER_REFUSED, TRANSFER_ACCEPTED or TRANSFER_STORED
+    uint64_t fileSize;
+    uint64_t contiguousOffset;
+    uint64_t reorderMask;
+    uint32_t credits;       // Chunks the uploader may send before waiting for MSG_FILE_CREDIT
+    uint32_t stripes;       // Ranges the file is uploaded in, one per stream
+};
+
+struct StripeStatus {
+    uint64_t contiguousOffset;
+    uint64_t reorderMask;
+};
 #pragma pack(pop)
 
+// Byte range of stripe 'index' when a file is uploaded over 'stripes' streams:
+// equal runs of whole chunks, in file order
+inline void stripeRange(uint64_t fileSize, uint32_t stripes, uint32_t index, uint64_t& begin, uint64_t& end) {
+    uint64_t chunks = (fileSize + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    uint64_t stripeBytes = (chunks + stripes - 1) / stripes * FILE_CHUNK_SIZE;
+    begin = index * stripeBytes < fileSize ? index * stripeBytes : fileSize;
+    end = (index + 1) * stripeBytes < fileSize ? (index + 1) * stripeBytes : fileSize;
+}
+
 #endif // PROTOCOL_H
@@ -0,0 +1,241 @@
+#ifndef RECORD_CODEC_H
+#define RECORD_CODEC_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <cstdio>
+#include <fcntl.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+    #include <sys/stat.h>
+#else
+    #include <unistd.h>
+#endif
+
+#define RECORD_MAX_LENGTH (64 * 1024 * 1024) // Longer frames are taken as damage, not data
+
+// Binary records for the message log and the user/group tables.
+// A frame is a varint payload length, the payload, then a CRC-32 of the
+// payload (4 bytes, little-endian), so a reader can tell a whole record
+// from a torn or damaged one. Payload fields are varints and
+// length-prefixed byte strings: nothing is escaped, every byte round-trips,
+// and decoding is a pointer walk over the buffer.
+namespace RecordCodec {
+
+enum FrameStatus {
+    FRAME_OK,
+    FRAME_INCOMPLETE,   // The buffer ends inside the frame (torn write)
+    FRAME_CORRUPT       // Bad length or checksum
+};
+
+struct Crc32Table {
+    uint32_t entries[256];
+    
+    Crc32Table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+// CRC-32 (IEEE 802.3, reflected), as used by zlib
+inline uint32_t crc32(const char* data, size_t size) {
+    static const Crc32Table table;
+    
+    uint32_t crc = 0xFFFFFFFFu;
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+inline void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+inline void putString(std::string& out, const std::string& str) {
+    putVarint(out, str.size());
+    out += str;
+}
+
+inline bool getVarint(const char*& p, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = (uint8_t)*p++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Append a payload to 'out' as one frame
+inline void putFrame(std::string& out, const std::string& payload) {
+    putVarint(out, payload.size());
+    out += payload;
+    uint32_t crc = crc32(payload.data(), payload.size());
+    for (int i = 0; i < 4; i++) {
+        out += (char)(crc >> (8 * i));
+    }
+}
+
+// Read the frame at p; on FRAME_OK, p moves past it and payload/size point into the buffer
+inline FrameStatus getFrame(const char*& p, const char* end, const char*& payload, size_t& size) {
+    const char* q = p;
+    uint64_t length;
+    if (!getVarint(q, end, length)) {
+        return (end - p) < 10 ? FRAME_INCOMPLETE : FRAME_CORRUPT;
+    }
+    if (length > RECORD_MAX_LENGTH) return FRAME_CORRUPT;
+    if ((uint64_t)(end - q) < length + 4) return FRAME_INCOMPLETE;
+    
+    const uint8_t* c = (const uint8_t*)(q + length);
+    uint32_t stored = c[0] | (c[1] << 8) | (c[2] << 16) | ((uint32_t)c[3] << 24);
+    if (stored != crc32(q, length)) return FRAME_CORRUPT;
+    
+    payload = q;
+    size = length;
+    p = q + length + 4;
+    return FRAME_OK;
+}
+
+// Find the next intact frame after a damaged one at 'frame': where the damaged frame
+// says it ends if a frame starts there, else the first later offset holding a
+// non-empty frame that passes its checksum. Returns null if there is none.
+inline const char* findFrame(const char* frame, const char* end) {
+    const char* payload;
+    size_t size;
+    const char* q = frame;
+    uint64_t length;
+    if (getVarint(q, end, length) && length + 4 < (uint64_t)(end - q)) {
+        const char* next = q + length + 4;
+        const char* p = next;
+        if (getFrame(p, end, payload, size) == FRAME_OK && size > 0) return next;
+    }
+    for (const char* next = frame + 1; next < end; next++) {
+        const char* p = next;
+        if (getFrame(p, end, payload, size) == FRAME_OK && size > 0) return next;
+    }
+    return nullptr;
+}
+
+// Read a whole file of frames; returns false if it cannot be opened
+inline bool readFile(const std::string& path, std::vector<char>& data) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) return false;
+    
+    std::streamoff size = file.tellg();
+    data.resize(size > 0 ? (size_t)size : 0);
+    file.seekg(0);
+    return data.empty() || (bool)file.read(data.data(), data.size());
+}
+
+// Replace a file whole: write a temporary file, sync it and rename it over the
+// old one, so a crash leaves either the old or the new contents, never a mix
+inline bool replaceFile(const std::string& path, const std::string& data) {
+    std::string tmpPath = path + ".tmp";
+#ifdef _WIN32
+    int fd = _open(tmpPath.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) return false;
+    
+    const char* p = data.data();
+    size_t left = data.size();
+    bool ok = true;
+    while (ok && left > 0) {
+#ifdef _WIN32
+        int n = _write(fd, p, (unsigned int)left);
+#else
+        ssize_t n = write(fd, p, left);
+#endif
+        ok = n > 0;
+        if (ok) {
+            p += n;
+            left -= n;
+        }
+    }
+
+#ifdef _WIN32
+    ok = ok && _commit(fd) == 0;
+    _close(fd);
+    return ok && MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) return false;
+    
+    // The rename lives in the directory, which needs its own sync
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    int dirFd = ::open(dir.c_str(), O_RDONLY);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+#endif
+}
+
+// Cut a file down to 'size' bytes, e.g. to drop a torn record at its end
+inline bool truncateFile(const std::string& path, uint64_t size) {
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0) return false;
+    bool ok = _chsize_s(fd, size) == 0;
+    _close(fd);
+    return ok;
+#else
+    return truncate(path.c_str(), size) == 0;
+#endif
+}
+
+// Walks the fields of one payload; any overrun makes ok() false
+class Reader {
+private:
+    const char* p;
+    const char* end;
+    bool valid;
+
+public:
+    Reader(const char* data, size_t size) : p(data), end(data + size), valid(true) {}
+    
+    uint64_t varint() {
+        uint64_t value = 0;
+        if (valid && !getVarint(p, end, value)) valid = false;
+        return valid ? value : 0;
+    }
+    
+    std::string string() {
+        uint64_t length = varint();
+        if (!valid || (uint64_t)(end - p) < length) {
+            valid = false;
+            return std::string();
+        }
+        std::string str(p, (size_t)length);
+        p += length;
+        return str;
+    }
+    
+    bool ok() const {
+        return valid;
+    }
+};
+
+} // namespace RecordCodec
+
+#endif // RECORD_CODEC_H